@@ -0,0 +1,848 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/sodium.h>
+#include <sodium/pipeline.h>
+#include <atomic>
+#include <cstddef>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace sodium;
+using namespace std;
+
+/*!
+ * Micro-benchmarks for the core propagation paths.
+ *
+ * Run:
+ *     sodium_bench            run everything
+ *     sodium_bench lift       run only the cases whose name contains "lift"
+ *
+ * Each case reports the cost per event_sink::send() (or per behavior_sink::send())
+ * in nanoseconds, and the number of calls to the global allocator per send. Build
+ * with -DCMAKE_BUILD_TYPE=Release, otherwise the numbers are meaningless.
+ */
+
+static std::atomic<long> allocations(0);
+
+/*
+ * Every replaceable allocation function is replaced, so each allocation is
+ * counted whichever form the library uses. They allocate and free out of line,
+ * so the compiler doesn't see new paired with free.
+ */
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+static BENCH_NOINLINE void* counted_alloc(size_t size, size_t alignment)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0)
+        size = 1;
+    if (alignment <= alignof(std::max_align_t))
+        return malloc(size);
+    void* p;
+    return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+}
+
+static BENCH_NOINLINE void counted_free(void* p)
+{
+    free(p);
+}
+
+static void* counted_alloc_or_throw(size_t size, size_t alignment)
+{
+    void* p = counted_alloc(size, alignment);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size)
+{
+    return counted_alloc_or_throw(size, 0);
+}
+
+void* operator new[](size_t size)
+{
+    return counted_alloc_or_throw(size, 0);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size, 0);
+}
+
+void operator delete(void* p) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    counted_free(p);
+}
+
+#if defined(__cpp_aligned_new)
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return counted_alloc_or_throw(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return counted_alloc_or_throw(size, (size_t)alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size, (size_t)alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    counted_free(p);
+}
+#endif
+
+namespace {
+
+    const char* filter_arg = NULL;
+
+    bool selected(const char* name)
+    {
+        return filter_arg == NULL || strstr(name, filter_arg) != NULL;
+    }
+
+    /*!
+     * Time 'n' calls of step(i), after a short warm-up, and print ns/firing and
+     * allocations/firing, where each step does 'per_step' firings.
+     */
+    template <class F>
+    void measure(const char* name, long n, int per_step, const F& step)
+    {
+        for (long i = 0; i < n / 10 + 1; i++)
+            step(i);
+        long allocs0 = allocations.load(std::memory_order_relaxed);
+        auto t0 = std::chrono::steady_clock::now();
+        for (long i = 0; i < n; i++)
+            step(i);
+        auto t1 = std::chrono::steady_clock::now();
+        long allocs = allocations.load(std::memory_order_relaxed) - allocs0;
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        long firings = n * per_step;
+        printf("%-28s %10ld %12.1f %12.2f\n", name, firings, ns / firings, (double)allocs / firings);
+        fflush(stdout);
+    }
+
+    const long N = 200000;
+
+    void baseline_callback()
+    {
+        // The same shape as map_chain_4 and a listener, written by hand, to show
+        // the overhead the library adds over plain callbacks.
+        long total = 0;
+        std::function<void(const int&)> sink = [&total] (const int& x) { total += x; };
+        std::function<void(const int&)> f4 = [&sink] (const int& x) { sink(x + 4); };
+        std::function<void(const int&)> f3 = [&f4] (const int& x) { f4(x + 3); };
+        std::function<void(const int&)> f2 = [&f3] (const int& x) { f3(x + 2); };
+        std::function<void(const int&)> f1 = [&f2] (const int& x) { f2(x + 1); };
+        measure("baseline_callback", N, 1, [&f1] (long i) { f1((int)i); });
+        if (total == 0) printf("?\n");
+    }
+
+    void send_listen()
+    {
+        event_sink<int> e;
+        long total = 0;
+        auto kill = e.listen([&total] (const int& x) { total += x; });
+        measure("send_listen", N, 1, [&e] (long i) { e.send((int)i); });
+        kill();
+    }
+
+    void send_many(const char* name, send_many_mode mode)
+    {
+        event_sink<int> e;
+        long total = 0;
+        auto kill = e.listen([&total] (const int& x) { total += x; });
+        std::vector<int> xs(1000);
+        for (size_t i = 0; i < xs.size(); i++)
+            xs[i] = (int)i;
+        measure(name, N / 1000, 1000, [&e, &xs, mode] (long) {
+            e.send_many(xs.begin(), xs.end(), mode);
+        });
+        kill();
+    }
+
+    void map_chain(const char* name, int length)
+    {
+        event_sink<int> e;
+        event<int> ev = e;
+        for (int i = 0; i < length; i++)
+            ev = ev.map<int>([i] (const int& x) { return x + i; });
+        long total = 0;
+        auto kill = ev.listen([&total] (const int& x) { total += x; });
+        measure(name, N, 1, [&e] (long i) { e.send((int)i); });
+        kill();
+    }
+
+    void pipeline_chain()
+    {
+        event_sink<int> e;
+        event<int> ev = pipe(e)
+            .map([] (const int& x) { return x + 0; })
+            .map([] (const int& x) { return x + 1; })
+            .map([] (const int& x) { return x + 2; })
+            .map([] (const int& x) { return x + 3; });
+        long total = 0;
+        auto kill = ev.listen([&total] (const int& x) { total += x; });
+        measure("pipeline_chain_4", N, 1, [&e] (long i) { e.send((int)i); });
+        kill();
+    }
+
+    void listen_churn()
+    {
+        // Replaces the oldest of 100k listeners on one sink at each step, and then
+        // unlistens them all, oldest first.
+        const long fan = 100000;
+        event_sink<int> e;
+        long total = 0;
+        std::vector<std::function<void()>> kills;
+        for (long i = 0; i < fan; i++)
+            kills.push_back(e.listen([&total] (const int& x) { total += x; }));
+        long next = 0;
+        measure("listen_churn_100k", 20000, 1, [&e, &total, &kills, &next, fan] (long) {
+            long k = next++ % fan;
+            kills[k]();
+            kills[k] = e.listen([&total] (const int& x) { total += x; });
+        });
+        std::vector<std::function<void()>> oldest_first;
+        for (long i = 0; i < fan; i++)
+            oldest_first.push_back(kills[(next + i) % fan]);
+        kills.clear();
+        // measure() warms up with a tenth of the steps first, so this kills them all.
+        long killed = 0;
+        measure("unlisten_100k", fan * 10 / 11, 1, [&oldest_first, &killed] (long) {
+            oldest_first[killed++]();
+        });
+    }
+
+    void loop_chain()
+    {
+        // Builds a 100k map chain behind an event_loop and loops it, which re-ranks
+        // the whole chain. Reported per node.
+        const int length = 100000;
+        measure("loop_chain_100k", 1, length, [length] (long) {
+            event_sink<int> s;
+            transaction<> trans;
+            event_loop<int> lp;
+            event<int> chain = lp;
+            for (int i = 0; i < length; i++)
+                chain = chain.map<int>([] (const int& x) { return x + 1; });
+            lp.loop(s.map<int>([] (const int& x) { return x + 1; })
+                     .map<int>([] (const int& x) { return x + 1; }));
+        });
+    }
+
+    void filter_chain()
+    {
+        event_sink<int> e;
+        event<int> ev = e;
+        for (int i = 0; i < 4; i++)
+            ev = ev.filter([i] (const int& x) { return x >= -i; });
+        long total = 0;
+        auto kill = ev.listen([&total] (const int& x) { total += x; });
+        measure("filter_chain_4", N, 1, [&e] (long i) { e.send((int)i); });
+        kill();
+    }
+
+    void merge()
+    {
+        event_sink<int> e1;
+        event_sink<int> e2;
+        long total = 0;
+        auto kill = e1.merge(e2).listen([&total] (const int& x) { total += x; });
+        measure("merge", N, 1, [&e1, &e2] (long i) {
+            if (i & 1) e1.send((int)i); else e2.send((int)i);
+        });
+        kill();
+    }
+
+    void coalesce()
+    {
+        event_sink<int> e;
+        long total = 0;
+        auto kill = e.coalesce([] (const int& a, const int& b) { return a + b; })
+            .listen([&total] (const int& x) { total += x; });
+        // Four firings per transaction, reported per firing.
+        measure("coalesce_4_per_trans", N / 4, 4, [&e] (long i) {
+            transaction<> trans;
+            e.send((int)i);
+            e.send((int)i);
+            e.send((int)i);
+            e.send((int)i);
+        });
+        kill();
+    }
+
+    void hold_snapshot()
+    {
+        event_sink<int> ea;
+        event_sink<int> eb;
+        behavior<int> b = ea.hold(0);
+        long total = 0;
+        auto kill = eb.snapshot<int, int>(b, [] (const int& x, const int& y) { return x + y; })
+            .listen([&total] (const int& x) { total += x; });
+        measure("hold_snapshot", N, 1, [&ea, &eb] (long i) {
+            if (i & 1) ea.send((int)i); else eb.send((int)i);
+        });
+        kill();
+    }
+
+    void sample_reads(const char* name, bool committed)
+    {
+        behavior_sink<int> b(1);
+        long total = 0;
+        measure(name, N, 1, [&b, &total, committed] (long) {
+            total += committed ? b.sample_committed() : b.sample();
+        });
+    }
+
+    void apply1()
+    {
+        behavior_sink<std::function<int(const int&)>> bf([] (const int& x) { return x; });
+        behavior_sink<int> ba(0);
+        long total = 0;
+        auto kill = apply<int, int>(bf, ba).updates().listen([&total] (const int& x) { total += x; });
+        measure("apply", N, 1, [&ba] (long i) { ba.send((int)i); });
+        kill();
+    }
+
+    void lift2()
+    {
+        behavior_sink<int> b1(0), b2(0);
+        long total = 0;
+        auto kill = lift<int, int, int>(
+            [] (const int& a, const int& b) { return a + b; },
+            b1, b2).updates().listen([&total] (const int& x) { total += x; });
+        measure("lift2", N, 1, [&b1] (long i) { b1.send((int)i); });
+        kill();
+    }
+
+    void lift3()
+    {
+        behavior_sink<int> b1(0), b2(0), b3(0);
+        long total = 0;
+        auto kill = lift<int, int, int, int>(
+            [] (const int& a, const int& b, const int& c) { return a + b + c; },
+            b1, b2, b3).updates().listen([&total] (const int& x) { total += x; });
+        measure("lift3", N, 1, [&b1] (long i) { b1.send((int)i); });
+        kill();
+    }
+
+    void lift4()
+    {
+        behavior_sink<int> b1(0), b2(0), b3(0), b4(0);
+        long total = 0;
+        auto kill = lift<int, int, int, int, int>(
+            [] (const int& a, const int& b, const int& c, const int& d) { return a + b + c + d; },
+            b1, b2, b3, b4).updates().listen([&total] (const int& x) { total += x; });
+        measure("lift4", N, 1, [&b1] (long i) { b1.send((int)i); });
+        kill();
+    }
+
+    void lift5()
+    {
+        behavior_sink<int> b1(0), b2(0), b3(0), b4(0), b5(0);
+        long total = 0;
+        auto kill = lift<int, int, int, int, int, int>(
+            [] (const int& a, const int& b, const int& c, const int& d, const int& e) {
+                return a + b + c + d + e;
+            },
+            b1, b2, b3, b4, b5).updates().listen([&total] (const int& x) { total += x; });
+        measure("lift5", N, 1, [&b1] (long i) { b1.send((int)i); });
+        kill();
+    }
+
+    void lift6()
+    {
+        behavior_sink<int> b1(0), b2(0), b3(0), b4(0), b5(0), b6(0);
+        long total = 0;
+        auto kill = lift<int, int, int, int, int, int, int>(
+            [] (const int& a, const int& b, const int& c, const int& d, const int& e, const int& f) {
+                return a + b + c + d + e + f;
+            },
+            b1, b2, b3, b4, b5, b6).updates().listen([&total] (const int& x) { total += x; });
+        measure("lift6", N, 1, [&b1] (long i) { b1.send((int)i); });
+        kill();
+    }
+
+    void lift7()
+    {
+        behavior_sink<int> b1(0), b2(0), b3(0), b4(0), b5(0), b6(0), b7(0);
+        long total = 0;
+        auto kill = lift<int, int, int, int, int, int, int, int>(
+            [] (const int& a, const int& b, const int& c, const int& d, const int& e, const int& f,
+                const int& g) {
+                return a + b + c + d + e + f + g;
+            },
+            b1, b2, b3, b4, b5, b6, b7).updates().listen([&total] (const int& x) { total += x; });
+        measure("lift7", N, 1, [&b1] (long i) { b1.send((int)i); });
+        kill();
+    }
+
+    void switch_e_churn()
+    {
+        event_sink<int> ea;
+        event_sink<int> eb;
+        behavior_sink<event<int>> bsw(ea);
+        long total = 0;
+        auto kill = switch_e<int>(bsw).listen([&total] (const int& x) { total += x; });
+        // One switch and one firing per step.
+        measure("switch_e_churn", N / 4, 1, [&ea, &eb, &bsw] (long i) {
+            if (i & 1) {
+                bsw.send(ea);
+                ea.send((int)i);
+            }
+            else {
+                bsw.send(eb);
+                eb.send((int)i);
+            }
+        });
+        kill();
+    }
+
+    void relink_inflated()
+    {
+        // Each step makes a switch_e that was ranked behind an ever deeper chain
+        // before it let go of it, and switches a 10k chain over to it. Raising
+        // the chain above it would walk all 10k nodes every time.
+        event_sink<int> ea;
+        event<int> deep = ea;
+        behavior_sink<event<int>> bsw(ea);
+        event<int> chain = switch_e<int>(bsw);
+        for (int i = 0; i < 10000; i++)
+            chain = chain.map<int>([] (const int& x) { return x + 1; });
+        long total = 0;
+        auto kill = chain.listen([&total] (const int& x) { total += x; });
+        measure("relink_inflated_10k", 2000, 1, [&ea, &deep, &bsw] (long) {
+            deep = deep.map<int>([] (const int& x) { return x + 1; });
+            behavior_sink<event<int>> inner(deep);
+            event<int> x = switch_e<int>(inner);
+            inner.send(ea);
+            bsw.send(x);
+        });
+        kill();
+    }
+
+    void switch_b_churn()
+    {
+        behavior_sink<int> ba(0);
+        behavior_sink<int> bb(0);
+        behavior_sink<behavior<int>> bsw(ba);
+        long total = 0;
+        auto kill = switch_b<int>(bsw).updates().listen([&total] (const int& x) { total += x; });
+        measure("switch_b_churn", N / 4, 1, [&ba, &bb, &bsw] (long i) {
+            if (i & 1) {
+                bsw.send(ba);
+                ba.send((int)i);
+            }
+            else {
+                bsw.send(bb);
+                bb.send((int)i);
+            }
+        });
+        kill();
+    }
+
+    void split8()
+    {
+        event_sink<std::list<int>> e;
+        long total = 0;
+        auto kill = split<int>(e).listen([&total] (const int& x) { total += x; });
+        std::list<int> l = { 1, 2, 3, 4, 5, 6, 7, 8 };
+        // Eight transactions per step, reported per element.
+        measure("split_8", N / 8, 8, [&e, &l] (long i) { e.send(l); });
+        kill();
+    }
+
+    struct part_a {
+        static partition* part()
+        {
+            static partition p;
+            return &p;
+        }
+    };
+
+    struct part_b {
+        static partition* part()
+        {
+            static partition p;
+            return &p;
+        }
+    };
+
+    void cross1()
+    {
+        event_sink<int, part_a> e;
+        long total = 0;
+        auto kill = cross<int, part_a, part_b>(e).listen([&total] (const int& x) { total += x; });
+        measure("cross", N, 1, [&e] (long i) { e.send((int)i); });
+        kill();
+    }
+
+    struct part_c {
+        static partition* part()
+        {
+            static partition p;
+            return &p;
+        }
+    };
+
+    /*!
+     * cross() to a partition with its own executor thread. Every 1000th send waits
+     * for the executor to catch up, so the time includes the far side.
+     */
+    void cross_executor()
+    {
+        executor_policy* ex = new executor_policy;
+        policy::set_global(ex);
+        ex->start(part_c::part());
+        event_sink<int, part_a> e;
+        event_sink<int, part_c> fence;
+        long total = 0;
+        auto kill = cross<int, part_a, part_c>(e).listen([&total] (const int& x) { total += x; });
+        measure("cross_executor", N / 1000, 1000, [&e, &fence] (long i) {
+            for (int j = 0; j < 999; j++)
+                e.send((int)i);
+            fence.send_async(0).wait();
+        });
+        kill();
+        policy::set_global(new simple_policy);
+    }
+
+    // Large payloads, to show how often values are copied on the way through.
+
+    void accum_vector()
+    {
+        event_sink<int> e;
+        long total = 0;
+        auto kill = e.accum_e<std::vector<int>>(std::vector<int>(1000, 0),
+            [] (const int& x, const std::vector<int>& v) {
+                std::vector<int> r(v);
+                r[x % r.size()] += x;
+                return r;
+            }).listen([&total] (const std::vector<int>& v) { total += v[0]; });
+        measure("accum_vector_1000", N / 4, 1, [&e] (long i) { e.send((int)i); });
+        kill();
+    }
+
+    void cross_string()
+    {
+        event_sink<std::string, part_a> e;
+        long total = 0;
+        auto kill = cross<std::string, part_a, part_b>(e)
+            .listen([&total] (const std::string& s) { total += s.size(); });
+        std::string s(1024, 'x');
+        measure("cross_string_1k", N / 4, 1, [&e, &s] (long i) { e.send(s); });
+        kill();
+    }
+
+    void split_strings()
+    {
+        event_sink<std::list<std::string>> e;
+        long total = 0;
+        auto kill = split<std::string>(e).listen([&total] (const std::string& s) { total += s.size(); });
+        std::list<std::string> l(8, std::string(1024, 'x'));
+        // Eight transactions per step, reported per element.
+        measure("split_strings_1k_8", N / 32, 8, [&e, &l] (long i) { e.send(l); });
+        kill();
+    }
+
+    /*!
+     * Run workers[t](n, ready, go) on threads t = 0..threads-1. Each worker sets up, increments
+     * 'ready', waits for 'go', and then does n firings. Prints the wall-clock time
+     * per firing over all threads, so perfect scaling shows as ns/firing dividing by
+     * the thread count.
+     */
+    typedef void (*worker_fn)(long n, std::atomic<int>& ready, std::atomic<bool>& go);
+
+    void measure_threads(const char* base, int threads, long n, const worker_fn* workers)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%dt", base, threads);
+        std::atomic<int> ready(0);
+        std::atomic<bool> go(false);
+        std::vector<std::thread> ts;
+        for (int t = 0; t < threads; t++) {
+            worker_fn worker = workers[t];
+            ts.push_back(std::thread([n, worker, &ready, &go] () { worker(n, ready, go); }));
+        }
+        while (ready.load() < threads)
+            std::this_thread::yield();
+        long allocs0 = allocations.load(std::memory_order_relaxed);
+        auto t0 = std::chrono::steady_clock::now();
+        go.store(true);
+        for (int t = 0; t < threads; t++)
+            ts[t].join();
+        auto t1 = std::chrono::steady_clock::now();
+        long allocs = allocations.load(std::memory_order_relaxed) - allocs0;
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        long firings = n * threads;
+        printf("%-28s %10ld %12.1f %12.2f\n", name, firings, ns / firings, (double)allocs / firings);
+        fflush(stdout);
+    }
+
+    void wait_for_go(std::atomic<int>& ready, std::atomic<bool>& go)
+    {
+        ready.fetch_add(1);
+        while (!go.load())
+            std::this_thread::yield();
+    }
+
+    void light_ptr_copy_worker(long n, std::atomic<int>& ready, std::atomic<bool>& go)
+    {
+        // Each thread copies its own value, so any slow-down comes from shared
+        // state inside light_ptr rather than from the values themselves. It's a
+        // string so it's reference counted rather than stored inline.
+        light_ptr a = light_ptr::create<std::string>(std::string("value"));
+        wait_for_go(ready, go);
+        for (long i = 0; i < n; i++) {
+            light_ptr b = a;
+            light_ptr c = b;
+        }
+    }
+
+    template <int I>
+    struct part_n {
+        static partition* part()
+        {
+            static partition p;
+            return &p;
+        }
+    };
+
+    template <class P>
+    void partition_worker(long n, std::atomic<int>& ready, std::atomic<bool>& go)
+    {
+        // Each thread has its own partition, so nothing should serialize them.
+        event_sink<int, P> e;
+        event<int, P> ev = e;
+        for (int i = 0; i < 4; i++)
+            ev = ev.template map<int>([i] (const int& x) { return x + i; });
+        long total = 0;
+        auto kill = ev.listen([&total] (const int& x) { total += x; });
+        wait_for_go(ready, go);
+        for (long i = 0; i < n; i++)
+            e.send((int)i);
+        kill();
+    }
+
+    void contention()
+    {
+        static const worker_fn light_ptr_workers[] = {
+            light_ptr_copy_worker, light_ptr_copy_worker, light_ptr_copy_worker, light_ptr_copy_worker,
+            light_ptr_copy_worker, light_ptr_copy_worker, light_ptr_copy_worker, light_ptr_copy_worker
+        };
+        static const worker_fn partition_workers[] = {
+            partition_worker<part_n<0> >, partition_worker<part_n<1> >,
+            partition_worker<part_n<2> >, partition_worker<part_n<3> >,
+            partition_worker<part_n<4> >, partition_worker<part_n<5> >,
+            partition_worker<part_n<6> >, partition_worker<part_n<7> >
+        };
+        for (int threads = 1; threads <= 8; threads *= 2)
+            measure_threads("light_ptr_copy", threads, N * 10, light_ptr_workers);
+        for (int threads = 1; threads <= 8; threads *= 2)
+            measure_threads("partition_map_chain_4", threads, N / 4, partition_workers);
+    }
+
+    template <class P>
+    void stealing_sink(work_stealing_policy* ws, std::vector<std::function<void(int)>>& sends,
+        std::vector<std::function<std::future<void>()>>& fences,
+        std::vector<std::function<void()>>& kills, long& total)
+    {
+        ws->attach(P::part());
+        event_sink<int, P> e;
+        event<int, P> ev = e;
+        for (int i = 0; i < 4; i++)
+            ev = ev.template map<int>([i] (const int& x) { return x + i; });
+        kills.push_back(ev.listen([&total] (const int& x) { total += x; }));
+        sends.push_back([e] (int x) { e.send(x); });
+        fences.push_back([e] () { return e.send_async(0); });
+    }
+
+    /*!
+     * Sends spread over 8 partitions, each a map chain of length 4, run by a
+     * work_stealing_policy with 4 threads. Each step ends by waiting for all of them
+     * to finish, so the time includes the processing.
+     */
+    void work_stealing_8()
+    {
+        work_stealing_policy* ws = new work_stealing_policy(4);
+        policy::set_global(ws);
+        std::vector<std::function<void(int)>> sends;
+        std::vector<std::function<std::future<void>()>> fences;
+        std::vector<std::function<void()>> kills;
+        long total = 0;
+        stealing_sink<part_n<10> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<11> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<12> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<13> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<14> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<15> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<16> >(ws, sends, fences, kills, total);
+        stealing_sink<part_n<17> >(ws, sends, fences, kills, total);
+        measure("work_stealing_8", N / 1000, 1000, [&sends, &fences] (long i) {
+            for (int j = 0; j < 992; j++)
+                sends[j % 8]((int)i);
+            // Hold back until every partition has caught up.
+            std::future<void> done[8];
+            for (int p = 0; p < 8; p++)
+                done[p] = fences[p]();
+            for (int p = 0; p < 8; p++)
+                done[p].wait();
+        });
+        for (size_t i = 0; i < kills.size(); i++)
+            kills[i]();
+        policy::set_global(new simple_policy);
+    }
+
+    /*!
+     * One sink feeding 1000 independent map chains of length 4, on a partition
+     * whose pure actions run on the given number of threads.
+     */
+    void fan_out(const char* name, unsigned threads)
+    {
+        typedef part_n<8> P;
+        P::part()->set_parallel(threads, 64);
+        event_sink<int, P> e;
+        long total = 0;
+        std::vector<std::function<void()>> kills;
+        for (int i = 0; i < 1000; i++) {
+            event<int, P> ev = e;
+            for (int j = 0; j < 4; j++)
+                ev = ev.map<int>([j] (const int& x) { return x * 3 + j; });
+            kills.push_back(ev.listen([&total] (const int& x) { total += x; }));
+        }
+        measure(name, N / 1000, 1000, [&e] (long i) { e.send((int)i); });
+        for (size_t i = 0; i < kills.size(); i++)
+            kills[i]();
+        P::part()->set_parallel(0);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        filter_arg = argv[1];
+    printf("%-28s %10s %12s %12s\n", "case", "firings", "ns/firing", "allocs/firing");
+    if (selected("baseline_callback")) baseline_callback();
+    if (selected("send_listen"))       send_listen();
+    if (selected("send_many_1000_separate"))
+        send_many("send_many_1000_separate", separate_transactions);
+    if (selected("send_many_1000_one_trans"))
+        send_many("send_many_1000_one_trans", one_transaction);
+    if (selected("map_chain_1"))       map_chain("map_chain_1", 1);
+    if (selected("map_chain_4"))       map_chain("map_chain_4", 4);
+    if (selected("map_chain_16"))      map_chain("map_chain_16", 16);
+    if (selected("pipeline_chain_4"))  pipeline_chain();
+    if (selected("filter_chain_4"))    filter_chain();
+    if (selected("listen_churn_100k")) listen_churn();
+    if (selected("loop_chain_100k"))   loop_chain();
+    if (selected("merge"))             merge();
+    if (selected("coalesce_4_per_trans")) coalesce();
+    if (selected("hold_snapshot"))     hold_snapshot();
+    if (selected("sample"))            sample_reads("sample", false);
+    if (selected("sample_committed"))  sample_reads("sample_committed", true);
+    if (selected("apply"))             apply1();
+    if (selected("lift2"))             lift2();
+    if (selected("lift3"))             lift3();
+    if (selected("lift4"))             lift4();
+    if (selected("lift5"))             lift5();
+    if (selected("lift6"))             lift6();
+    if (selected("lift7"))             lift7();
+    if (selected("switch_e_churn"))    switch_e_churn();
+    if (selected("switch_b_churn"))    switch_b_churn();
+    if (selected("relink_inflated_10k")) relink_inflated();
+    if (selected("split_8"))           split8();
+    if (selected("cross"))             cross1();
+    if (selected("cross_executor"))    cross_executor();
+    if (selected("accum_vector_1000")) accum_vector();
+    if (selected("cross_string_1k"))   cross_string();
+    if (selected("split_strings_1k_8")) split_strings();
+    if (selected("fan_out_1000_serial")) fan_out("fan_out_1000_serial", 1);
+    if (selected("fan_out_1000_parallel_4")) fan_out("fan_out_1000_parallel_4", 4);
+    if (selected("work_stealing_8"))   work_stealing_8();
+    if (selected("contention") || selected("light_ptr_copy") || selected("partition_map_chain_4"))
+        contention();
+    return 0;
+}
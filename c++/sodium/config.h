@@ -65,4 +65,80 @@ namespace sodium {
 #define SODIUM_FORWARD_LIST std::forward_list
 #endif
 
+/*!
+ * Reference counts are lock-free atomics when threads and C++11 are available,
+ * otherwise they're protected by the spin locks in lock_pool. The same goes for
+ * the partition's lock-free ingress queue, its worker pool for parallel
+ * transactions, and the sequence count that lets other threads read committed
+ * values consistently, which only exist in that case.
+ */
+#if !defined(SODIUM_SINGLE_THREADED) && !defined(SODIUM_NO_CXX11)
+#define SODIUM_ATOMIC_COUNTS
+#define SODIUM_INGRESS_QUEUE
+#define SODIUM_PARALLEL
+#define SODIUM_COMMITTED_READS
+#endif
+
+/*!
+ * With C++11, event's map, filter and listen keep the caller's function type and
+ * call it from a typed handler (impl::map_holder etc), instead of through nested
+ * type-erased std::functions on light_ptrs. Define SODIUM_TYPE_ERASED_HANDLERS
+ * to use the old handlers.
+ */
+#if !defined(SODIUM_NO_CXX11) && !defined(SODIUM_TYPE_ERASED_HANDLERS)
+#define SODIUM_TYPED_HANDLERS
+#endif
+
+/*!
+ * Define SODIUM_METRICS to have each partition count what its transactions do,
+ * and SODIUM_NODE_METRICS, which implies it, to count firings, fan-out and
+ * handler time for each node as well. Both are off by default, and then none of
+ * it is compiled in. See sodium/metrics.h.
+ */
+#if defined(SODIUM_NODE_METRICS) && !defined(SODIUM_METRICS)
+#define SODIUM_METRICS
+#endif
+
+/*!
+ * Define SODIUM_INTROSPECTION to be able to walk the graph and export it as DOT or
+ * JSON, with each node's operator and reference counts. It's off by default. See
+ * sodium/introspect.h.
+ */
+
+/*!
+ * Define SODIUM_TRACING to be able to record what sampled transactions do, for
+ * viewing as a Chrome trace. It's off by default. See sodium/trace.h.
+ */
+
+/*!
+ * Define SODIUM_MEMORY_ACCOUNTING to count the memory held by nodes, payloads,
+ * closures, cleanups and transactions, and break the nodes' down by operator. It's
+ * off by default. See sodium/memory.h.
+ */
+
+/*!
+ * Define SODIUM_PROFILING to be able to attribute handler time to the places in
+ * your code that made the nodes, for flame graphs. It's off by default. See
+ * sodium/profile.h.
+ */
+
+/*!
+ * Define SODIUM_LATENCY to be able to time values from the sinks they're sent on
+ * to the listeners they reach, in histograms. It's off by default. See
+ * sodium/latency.h.
+ */
+
+/*!
+ * Node metrics, introspection and memory accounting keep every live node in a
+ * registry, numbered in order of creation, and all but node metrics label each
+ * node with the operator that made it.
+ */
+#if defined(SODIUM_NODE_METRICS) || defined(SODIUM_INTROSPECTION) || defined(SODIUM_MEMORY_ACCOUNTING)
+#define SODIUM_NODE_REGISTRY
+#endif
+#if defined(SODIUM_INTROSPECTION) || defined(SODIUM_TRACING) || defined(SODIUM_MEMORY_ACCOUNTING) || \
+    defined(SODIUM_PROFILING)
+#define SODIUM_NODE_KINDS
+#endif
+
 #endif
@@ -10,10 +10,130 @@
 #include <sodium/config.h>
 #include <limits.h>
 #include <assert.h>
+#if defined(SODIUM_ATOMIC_COUNTS)
+#include <atomic>
+#include <stdint.h>
+#endif
 
 namespace sodium {
     namespace impl {
 
+#if defined(SODIUM_ATOMIC_COUNTS)
+        /*!
+         * Three counters packed into one atomic 64-bit word, plus a flag recording that
+         * the owner's function has been torn down. Increments are relaxed; decrements
+         * are acq_rel and return the new word, so the caller can decide with no lock
+         * whether it has to tear down or delete the owner.
+         *
+         * Each count has 20 bits in the word and an overflow bit above them. When a
+         * count gets near the top, spill of it moves to a side table and the overflow
+         * bit is set, and it moves back when the count in the word runs out, so there
+         * is no limit. A count with its overflow bit set is never zero.
+         */
+        class count_set {
+            public:
+                typedef uint64_t word;
+                static const word strong_unit = (word)1;
+                static const word event_unit  = (word)1 << 21;
+                static const word node_unit   = (word)1 << 42;
+                static const word count_mask  = ((word)1 << 20) - 1;
+                static const word overflow    = count_mask + 1;
+                /*!
+                 * How much of a count moves to or from the side table at a time, and how
+                 * high the count in the word gets before it does. Above that there's room
+                 * for 2^18 more increments, one per thread at most, before they carry.
+                 */
+                static const word spill       = (word)1 << 19;
+                static const word spill_at    = (word)3 << 18;
+                static const word torn_down   = (word)1 << 63;
+
+                count_set() : w(0) {}
+
+                void inc_strong() { inc(strong_unit); }
+                void inc_event()  { inc(event_unit); }
+                void inc_node()   { inc(node_unit); }
+
+                /*!
+                 * Subtract one unit and return the new word.
+                 */
+                word dec(word unit) {
+                    bool claimed;
+                    return sub(unit, false, claimed);
+                }
+
+                static bool nonzero(word w, word unit) {
+                    return ((w / unit) & (count_mask | overflow)) != 0;
+                }
+                static bool active(word w) {
+                    return nonzero(w, strong_unit) || (nonzero(w, node_unit) && nonzero(w, event_unit));
+                }
+                static bool alive(word w) {
+                    return (w & ~torn_down) != 0;
+                }
+
+                /*!
+                 * Subtract one unit and return the new word. If that leaves the counts
+                 * inactive and nobody has torn down yet, the same step sets the torn_down
+                 * flag and takes a strong count to keep the owner alive while it tears
+                 * down, and sets claimed. That is true for exactly one caller.
+                 *
+                 * Claiming in a separate step would let another thread drop the last
+                 * count, tear down and delete the owner in between.
+                 */
+                word dec_and_claim(word unit, bool& claimed) {
+                    return sub(unit, true, claimed);
+                }
+                /*!
+                 * Drop the strong count taken by dec_and_claim(), and return the new word.
+                 */
+                word end_teardown() { return dec(strong_unit); }
+
+                unsigned strong_count() const { return count(strong_unit); }
+                unsigned event_count() const  { return count(event_unit); }
+                unsigned node_count() const   { return count(node_unit); }
+
+            private:
+                // disable copy constructor and assignment
+                count_set(const count_set& other) {}
+                count_set& operator = (const count_set& other) { return *this; }
+                std::atomic<word> w;
+
+                void inc(word unit) {
+                    word old = w.fetch_add(unit, std::memory_order_relaxed);
+                    if (((old / unit) & count_mask) + 1 >= spill_at)
+                        spill_out(unit);
+                }
+                word sub(word unit, bool claim, bool& claimed) {
+                    word cur = w.load(std::memory_order_relaxed);
+                    word next;
+                    do {
+                        if (((cur / unit) & count_mask) == 0)
+                            return borrow(unit, claim, claimed);
+                        next = cur - unit;
+                        claimed = claim && !(next & torn_down) && !active(next);
+                        if (claimed)
+                            next = (next | torn_down) + strong_unit;
+                    }
+                    while (!w.compare_exchange_weak(cur, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+                    return next;
+                }
+                unsigned count(word unit) const {
+                    word cur = w.load(std::memory_order_relaxed);
+                    unsigned n = (unsigned)((cur / unit) & count_mask);
+                    return (cur / unit) & overflow ? n + overflow_count(unit) : n;
+                }
+                /*!
+                 * Move spill of a count that has reached spill_at to the side table.
+                 */
+                void spill_out(word unit);
+                /*!
+                 * sub() for a count that's all in the side table: move spill of it back
+                 * into the word in the same step as the subtraction.
+                 */
+                word borrow(word unit, bool claim, bool& claimed);
+                unsigned overflow_count(word unit) const;
+        };
+#else
         struct large_count_set {
             large_count_set(
                     unsigned strong_count,
@@ -176,7 +296,17 @@ namespace sodium {
                     impl.node_count--;
 #endif
                 }
+#if defined(SODIUM_CONSERVE_MEMORY)
+                unsigned strong_count() const { return impl.small.is_small ? impl.small.strong_count : impl.large->strong_count; }
+                unsigned event_count() const  { return impl.small.is_small ? impl.small.event_count : impl.large->event_count; }
+                unsigned node_count() const   { return impl.small.is_small ? impl.small.node_count : impl.large->node_count; }
+#else
+                unsigned strong_count() const { return impl.strong_count; }
+                unsigned event_count() const  { return impl.event_count; }
+                unsigned node_count() const   { return impl.node_count; }
+#endif
         };
+#endif
     }
 }
 #endif
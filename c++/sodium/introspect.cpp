@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/introspect.h>
+
+#if defined(SODIUM_INTROSPECTION)
+#include <algorithm>
+#include <set>
+#include <sstream>
+
+namespace sodium {
+
+    namespace impl {
+        namespace {
+            graph_node describe(const node& n)
+            {
+                graph_node gn;
+                gn.id = n.serial;
+                gn.kind = n.kind;
+                gn.rank = n.rank;
+                gn.targets = n.targets.size() - n.dead_targets;
+                gn.sources = n.sources.size();
+                gn.pending_firings = n.firings.size();
+                if (n.listen_impl) {
+                    gn.strong_count = n.listen_impl->counts.strong_count();
+                    gn.event_count = n.listen_impl->counts.event_count();
+                    gn.node_count = n.listen_impl->counts.node_count();
+                }
+                else
+                    gn.strong_count = gn.event_count = gn.node_count = 0;
+                return gn;
+            }
+
+            void add_edges(const node& n, graph& g)
+            {
+                for (size_t i = 0; i < n.targets.size(); i++) {
+                    holder* h = n.targets[i].get();
+                    if (h != NULL && h->target) {
+                        graph_edge e;
+                        e.from = n.serial;
+                        e.to = h->target->serial;
+                        g.edges.push_back(e);
+                    }
+                }
+            }
+
+            void add_node(const node& n, void* ctx)
+            {
+                graph& g = *static_cast<graph*>(ctx);
+                g.nodes.push_back(describe(n));
+                add_edges(n, g);
+            }
+
+            bool newest_first(const graph_node& a, const graph_node& b)
+            {
+                return a.id > b.id;
+            }
+
+            std::string rank_text(rank_t rank, const char* none)
+            {
+                if (rank == SODIUM_IMPL_RANK_T_MAX)
+                    return none;
+                std::ostringstream out;
+                out << rank;
+                return out.str();
+            }
+
+            std::string json_string(const std::string& s)
+            {
+                std::string out("\"");
+                for (size_t i = 0; i < s.size(); i++) {
+                    char c = s[i];
+                    if (c == '"' || c == '\\')
+                        out += '\\';
+                    out += c;
+                }
+                return out + "\"";
+            }
+        }
+    }
+
+    void graph_walk::add_(const boost::intrusive_ptr<impl::listen_impl_func<impl::H_EVENT> >& li, partition* part)
+    {
+        // The never event has no node.
+        if (li) {
+            SODIUM_SHARED_PTR<impl::node> n = li->introspect_node.lock();
+            if (n) {
+                roots.push_back(n);
+                parts.push_back(part);
+            }
+        }
+    }
+
+    graph graph_walk::run() const
+    {
+        graph g;
+#if !defined(SODIUM_SINGLE_THREADED)
+        // An empty list locks every partition, as it should with no roots.
+        std::vector<partition*> locked = impl::lock_partitions(parts);
+#endif
+        if (roots.empty())
+            impl::visit_nodes(impl::add_node, &g);
+        else {
+            std::set<const impl::node*> seen;
+            std::vector<const impl::node*> stack;
+            for (size_t i = 0; i < roots.size(); i++)
+                if (seen.insert(roots[i].get()).second)
+                    stack.push_back(roots[i].get());
+            while (!stack.empty()) {
+                const impl::node* n = stack.back();
+                stack.pop_back();
+                impl::add_node(*n, &g);
+                for (size_t i = 0; i < n->targets.size(); i++) {
+                    impl::holder* h = n->targets[i].get();
+                    if (h != NULL && h->target && seen.insert(h->target.get()).second)
+                        stack.push_back(h->target.get());
+                }
+                for (size_t i = 0; i < n->sources.size(); i++)
+                    if (seen.insert(n->sources[i].from).second)
+                        stack.push_back(n->sources[i].from);
+            }
+            std::sort(g.nodes.begin(), g.nodes.end(), impl::newest_first);
+        }
+#if !defined(SODIUM_SINGLE_THREADED)
+        impl::unlock_partitions(locked);
+#endif
+        return g;
+    }
+
+    std::string to_dot(const graph& g)
+    {
+        std::ostringstream out;
+        out << "digraph sodium {\n";
+        out << "    node [shape=box, fontname=\"monospace\"];\n";
+        for (size_t i = 0; i < g.nodes.size(); i++) {
+            const graph_node& n = g.nodes[i];
+            out << "    n" << n.id << " [label=\"" << n.kind << " #" << n.id
+                << "\\nrank " << impl::rank_text(n.rank, "-")
+                << "\\ntargets " << n.targets << ", sources " << n.sources;
+            if (n.pending_firings != 0)
+                out << "\\npending " << n.pending_firings;
+            out << "\\nstrong " << n.strong_count << ", event " << n.event_count
+                << ", node " << n.node_count << "\"];\n";
+        }
+        for (size_t i = 0; i < g.edges.size(); i++)
+            out << "    n" << g.edges[i].from << " -> n" << g.edges[i].to << ";\n";
+        out << "}\n";
+        return out.str();
+    }
+
+    std::string to_json(const graph& g)
+    {
+        std::ostringstream out;
+        out << "{\"nodes\":[";
+        for (size_t i = 0; i < g.nodes.size(); i++) {
+            const graph_node& n = g.nodes[i];
+            if (i != 0)
+                out << ',';
+            out << "{\"id\":" << n.id
+                << ",\"kind\":" << impl::json_string(n.kind)
+                << ",\"rank\":" << impl::rank_text(n.rank, "null")
+                << ",\"targets\":" << n.targets
+                << ",\"sources\":" << n.sources
+                << ",\"pending_firings\":" << n.pending_firings
+                << ",\"strong_count\":" << n.strong_count
+                << ",\"event_count\":" << n.event_count
+                << ",\"node_count\":" << n.node_count << '}';
+        }
+        out << "],\"edges\":[";
+        for (size_t i = 0; i < g.edges.size(); i++) {
+            if (i != 0)
+                out << ',';
+            out << "{\"from\":" << g.edges[i].from << ",\"to\":" << g.edges[i].to << '}';
+        }
+        out << "]}";
+        return out.str();
+    }
+}  // end namespace sodium
+#endif
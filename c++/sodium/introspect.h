@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_INTROSPECT_H_
+#define _SODIUM_INTROSPECT_H_
+
+#include <sodium/sodium.h>
+#include <string>
+#include <vector>
+
+#if defined(SODIUM_INTROSPECTION)
+namespace sodium {
+    /*!
+     * A node as it was when the graph was walked.
+     */
+    struct graph_node {
+        /*!
+         * Numbered in order of creation, from 1.
+         */
+        unsigned long id;
+        /*!
+         * The operator that made it, such as "map" or "switch_e". Listeners are
+         * "listen", and "node" is an operator's internal node.
+         */
+        std::string kind;
+        /*!
+         * Listeners have no rank, and are given SODIUM_IMPL_RANK_T_MAX.
+         */
+        impl::rank_t rank;
+        size_t targets;
+        size_t sources;
+        /*!
+         * Values fired in the transaction that's under way.
+         */
+        size_t pending_firings;
+        /*!
+         * The counts in the listen_impl_func that keeps the node's event alive.
+         */
+        unsigned strong_count;
+        unsigned event_count;
+        unsigned node_count;
+    };
+
+    struct graph_edge {
+        unsigned long from;
+        unsigned long to;
+    };
+
+    struct graph {
+        /*!
+         * Newest first.
+         */
+        std::vector<graph_node> nodes;
+        std::vector<graph_edge> edges;
+    };
+
+    /*!
+     * Walks the graph connected to some events and behaviors, following links both
+     * up and downstream, or, if none are added, takes every live node:
+     *
+     *     graph g = graph_walk().add(e).add(b).run();
+     *     std::cout << to_dot(g);
+     *
+     * Links only join nodes of one partition, because cross() goes through a post
+     * and a sink of its own, so a walk from roots stays on the roots' partitions.
+     * It holds the locks of all of those partitions, or, with no roots, of every
+     * live partition, so no transaction changes what it reads. Partitions mustn't
+     * be destroyed while a walk is running.
+     */
+    class graph_walk {
+        public:
+            template <class A, class P>
+            graph_walk& add(const event<A, P>& e)
+            {
+                add_(e.p_listen_impl, P::part());
+                return *this;
+            }
+
+            template <class A, class P>
+            graph_walk& add(const behavior<A, P>& b)
+            {
+                return add(event<A, P>(b.impl->updates));
+            }
+
+            /*!
+             * Walk the graph. With no roots, it's every live node, whatever its
+             * partition.
+             */
+            graph run() const;
+
+        private:
+            void add_(const boost::intrusive_ptr<impl::listen_impl_func<impl::H_EVENT> >& li, partition* part);
+            std::vector<SODIUM_SHARED_PTR<impl::node> > roots;
+            /*!
+             * The roots' partitions.
+             */
+            std::vector<partition*> parts;
+    };
+
+    /*!
+     * Format a graph for Graphviz.
+     */
+    std::string to_dot(const graph& g);
+
+    /*!
+     * Format a graph as JSON: {"nodes":[{"id":..., ...}], "edges":[{"from":...,"to":...}]}.
+     * A listener's rank is null.
+     */
+    std::string to_json(const graph& g);
+}  // end namespace sodium
+#endif
+
+#endif
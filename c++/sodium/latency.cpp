@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/latency.h>
+
+#if defined(SODIUM_LATENCY)
+#include <cmath>
+#include <map>
+
+namespace sodium {
+
+    namespace impl {
+        namespace {
+            /*!
+             * Guards the named histograms, which are never freed, since nodes point at
+             * them.
+             */
+            spin_lock latency_lock;
+            std::map<std::string, latency_histogram*>* histograms = NULL;
+#if defined(SODIUM_SINGLE_THREADED)
+            unsigned long long origin = 0;
+#elif !defined(SODIUM_NO_CXX11)
+            thread_local unsigned long long origin = 0;
+#else
+            pthread_key_t origin_key;
+            pthread_once_t key_once = PTHREAD_ONCE_INIT;
+            void delete_origin(void* p)
+            {
+                delete (unsigned long long*)p;
+            }
+            void make_key()
+            {
+                pthread_key_create(&origin_key, delete_origin);
+            }
+#endif
+
+            unsigned long long& this_origin()
+            {
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+                return origin;
+#else
+                // Nanoseconds don't fit a void* on 32-bit targets.
+                pthread_once(&key_once, make_key);
+                unsigned long long* p = (unsigned long long*)pthread_getspecific(origin_key);
+                if (p == NULL) {
+                    p = new unsigned long long(0);
+                    pthread_setspecific(origin_key, p);
+                }
+                return *p;
+#endif
+            }
+
+            unsigned most_significant_bit(unsigned long long v)
+            {
+#if defined(__GNUC__)
+                return 63 - __builtin_clzll(v);
+#else
+                unsigned m = 0;
+                while (v >>= 1)
+                    m++;
+                return m;
+#endif
+            }
+        }
+
+        latency_histogram* latency_named(const std::string& name)
+        {
+            latency_lock.lock();
+            if (histograms == NULL)
+                histograms = new std::map<std::string, latency_histogram*>;
+            latency_histogram*& h = (*histograms)[name];
+            if (h == NULL)
+                h = new latency_histogram;
+            latency_histogram* result = h;
+            latency_lock.unlock();
+            return result;
+        }
+
+        unsigned long long latency_origin()
+        {
+            unsigned long long o = this_origin();
+            return o != 0 ? o : monotonic_ns();
+        }
+
+        latency_scope::latency_scope(unsigned long long origin)
+            : previous(this_origin())
+        {
+            this_origin() = origin;
+        }
+
+        latency_scope::~latency_scope()
+        {
+            this_origin() = previous;
+        }
+    }
+
+    size_t latency_histogram::index(unsigned long long ns)
+    {
+        if (ns < exact)
+            return (size_t)ns;
+        // The top seven bits of ns pick the bucket within its power of two.
+        unsigned m = impl::most_significant_bit(ns);
+        size_t i = exact + (m - 7) * per_octave + (size_t)(ns >> (m - 6)) - per_octave;
+        return i < buckets ? i : buckets - 1;
+    }
+
+    unsigned long long latency_histogram::highest(size_t i)
+    {
+        if (i < exact)
+            return i;
+        unsigned m = 7 + (unsigned)((i - exact) / per_octave);
+        unsigned long long top = per_octave + (i - exact) % per_octave;
+        return ((top + 1) << (m - 6)) - 1;
+    }
+
+    void latency_histogram::record(unsigned long long ns)
+    {
+        counts[index(ns)].add(1);
+        total_ns.add(ns);
+    }
+
+    unsigned long long latency_histogram::count() const
+    {
+        unsigned long long n = 0;
+        for (size_t i = 0; i < buckets; i++)
+            n += counts[i].get();
+        return n;
+    }
+
+    unsigned long long latency_histogram::quantile_ns(double q) const
+    {
+        unsigned long long n = count();
+        if (n == 0)
+            return 0;
+        unsigned long long rank = (unsigned long long)std::ceil(q * n);
+        if (rank == 0)
+            rank = 1;
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < buckets; i++) {
+            seen += counts[i].get();
+            if (seen >= rank)
+                return highest(i);
+        }
+        return max_ns();
+    }
+
+    unsigned long long latency_histogram::max_ns() const
+    {
+        for (size_t i = buckets; i-- > 0; )
+            if (counts[i].get() != 0)
+                return highest(i);
+        return 0;
+    }
+
+    double latency_histogram::mean_ns() const
+    {
+        unsigned long long n = count();
+        return n != 0 ? (double)total_ns.get() / n : 0;
+    }
+
+    void latency_histogram::clear()
+    {
+        for (size_t i = 0; i < buckets; i++)
+            counts[i].sub(counts[i].get());
+        total_ns.sub(total_ns.get());
+    }
+
+    latency_histogram& latency(const std::string& name)
+    {
+        return *impl::latency_named(name);
+    }
+
+    std::vector<latency_summary> latency_report()
+    {
+        std::vector<std::pair<std::string, latency_histogram*> > named;
+        impl::latency_lock.lock();
+        if (impl::histograms != NULL)
+            named.assign(impl::histograms->begin(), impl::histograms->end());
+        impl::latency_lock.unlock();
+        std::vector<latency_summary> report;
+        for (size_t i = 0; i < named.size(); i++) {
+            const latency_histogram& h = *named[i].second;
+            latency_summary s;
+            s.name = named[i].first;
+            s.count = h.count();
+            s.mean_seconds = h.mean_ns() * 1e-9;
+            s.p50_seconds = h.quantile_ns(0.5) * 1e-9;
+            s.p99_seconds = h.quantile_ns(0.99) * 1e-9;
+            s.p999_seconds = h.quantile_ns(0.999) * 1e-9;
+            s.max_seconds = h.max_ns() * 1e-9;
+            report.push_back(s);
+        }
+        return report;
+    }
+
+    void clear_latency()
+    {
+        impl::latency_lock.lock();
+        if (impl::histograms != NULL)
+            for (std::map<std::string, latency_histogram*>::iterator it = impl::histograms->begin();
+                    it != impl::histograms->end(); ++it)
+                it->second->clear();
+        impl::latency_lock.unlock();
+    }
+}  // end namespace sodium
+#endif
@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_LATENCY_H_
+#define _SODIUM_LATENCY_H_
+
+#include <sodium/sodium.h>
+#include <string>
+#include <vector>
+
+#if defined(SODIUM_LATENCY)
+namespace sodium {
+    /*!
+     * Nanosecond latencies, counted in the manner of HdrHistogram: those under 128ns
+     * exactly, and larger ones in 64 buckets for each power of two, so what's read
+     * back is within 1/64 of what was recorded, up to about three days. Another
+     * thread can read it while it's being recorded to.
+     */
+    class latency_histogram {
+        public:
+            latency_histogram() {}
+            void record(unsigned long long ns);
+            unsigned long long count() const;
+            /*!
+             * The latency that the fraction q (0 to 1) of those recorded are at or
+             * below, or 0 if none have been.
+             */
+            unsigned long long quantile_ns(double q) const;
+            unsigned long long max_ns() const;
+            double mean_ns() const;
+            void clear();
+
+        private:
+            latency_histogram(const latency_histogram& other) {}
+            latency_histogram& operator = (const latency_histogram& other) { return *this; }
+            enum {
+                exact = 128,
+                per_octave = 64,
+                octaves = 41,
+                buckets = exact + per_octave * octaves
+            };
+            static size_t index(unsigned long long ns);
+            static unsigned long long highest(size_t i);
+            impl::metric_count counts[buckets];
+            impl::metric_count total_ns;
+    };
+
+    /*!
+     * The histogram registered under name, made the first time it's asked for. It
+     * lives for the rest of the program. Values are timed from the send on an
+     * event_sink or behavior_sink, including any wait for the partition's lock,
+     * its ingress queue, and for values that reach a partition through cross()
+     * or post(), the time they spent in the post queue.
+     *
+     *     event_sink<order> orders("orders");    // until its listeners have run
+     *     orders.map(...).listen(fill, "fills");  // until fill is called
+     */
+    latency_histogram& latency(const std::string& name);
+
+    struct latency_summary {
+        std::string name;
+        unsigned long long count;
+        double mean_seconds;
+        double p50_seconds;
+        double p99_seconds;
+        double p999_seconds;
+        double max_seconds;
+    };
+
+    /*!
+     * Every named histogram, in order of name.
+     */
+    std::vector<latency_summary> latency_report();
+
+    /*!
+     * Clear every named histogram.
+     */
+    void clear_latency();
+}  // end namespace sodium
+#endif
+
+#endif
@@ -7,65 +7,293 @@
 #include <sodium/light_ptr.h>
 #include <sodium/lock_pool.h>
 #include <stdio.h>
+#include <string.h>
 
 namespace sodium {
-#define SODIUM_DEFINE_LIGHTPTR(Name, GET_AND_LOCK, UNLOCK) \
-    Name::Name() \
-        : value(NULL), count(NULL) \
-    { \
-    } \
-     \
+    namespace impl {
+        namespace {
+            /*!
+             * Blocks of up to 256 bytes are rounded up to one of these size classes, and
+             * freed blocks are kept on a per-thread list for their class, up to
+             * max_cached of them.
+             */
+            const int n_classes = 4;
+            const size_t class_sizes[n_classes] = { 32, 64, 128, 256 };
+            const unsigned max_cached = 256;
+
+            inline int size_class(size_t size)
+            {
+                return size <= 32  ? 0 :
+                       size <= 64  ? 1 :
+                       size <= 128 ? 2 :
+                       size <= 256 ? 3 : -1;
+            }
+
+            struct free_block_t {
+                free_block_t* next;
+            };
+
+            struct block_cache {
+                free_block_t* lists[n_classes];
+                unsigned lengths[n_classes];
+                bool armed;
+                bool closed;
+            };
+
+#if defined(SODIUM_SINGLE_THREADED)
+            block_cache cache;
+#elif !defined(SODIUM_NO_CXX11)
+            thread_local block_cache cache;
+
+            /*!
+             * Gives a thread's cached blocks back to the global allocator when the
+             * thread exits.
+             */
+            struct block_cache_drainer {
+                void arm() {}
+                ~block_cache_drainer()
+                {
+                    for (int i = 0; i < n_classes; i++) {
+                        while (cache.lists[i] != NULL) {
+                            free_block_t* next = cache.lists[i]->next;
+                            ::operator delete(cache.lists[i]);
+                            cache.lists[i] = next;
+                        }
+                        cache.lengths[i] = 0;
+                    }
+                    cache.closed = true;
+                }
+            };
+            thread_local block_cache_drainer drainer;
+#endif
+        }
+
+        void* alloc_block(size_t size)
+        {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+            account(memory_payloads, 1, (long)size);
+#endif
+            int cl = size_class(size);
+            if (cl < 0)
+                return ::operator new(size);
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            free_block_t* b = cache.lists[cl];
+            if (b != NULL) {
+                cache.lists[cl] = b->next;
+                cache.lengths[cl]--;
+                return b;
+            }
+#endif
+            return ::operator new(class_sizes[cl]);
+        }
+
+        void free_block(void* block, size_t size)
+        {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+            account(memory_payloads, -1, -(long)size);
+#endif
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            int cl = size_class(size);
+            if (cl >= 0 && cache.lengths[cl] < max_cached && !cache.closed) {
+#if !defined(SODIUM_SINGLE_THREADED)
+                if (!cache.armed) {
+                    cache.armed = true;
+                    drainer.arm();
+                }
+#endif
+                free_block_t* b = (free_block_t*)block;
+                b->next = cache.lists[cl];
+                cache.lists[cl] = b;
+                cache.lengths[cl]++;
+                return;
+            }
+#endif
+            ::operator delete(block);
+        }
+
+        void release(void* value, count* c)
+        {
+            if (c->size == 0) {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                account(memory_payloads, -1, -(long)sizeof(count));
+#endif
+                c->del(value);
+                delete c;
+            }
+            else {
+                size_t size = c->size;
+                c->del(value);
+                free_block(c, size);
+            }
+        }
+    }
+
+    namespace impl {
+        namespace {
+            inline void inc_count(void* value, count* c)
+            {
+#if defined(SODIUM_ATOMIC_COUNTS)
+                c->c.fetch_add(1, std::memory_order_relaxed);
+#else
+                spin_lock* l = spin_get_and_lock(value);
+                c->c++;
+                l->unlock();
+#endif
+            }
+
+            /*!
+             * Returns true if the count dropped to zero.
+             */
+            inline bool dec_count(void* value, count* c)
+            {
+#if defined(SODIUM_ATOMIC_COUNTS)
+                return c->c.fetch_sub(1, std::memory_order_acq_rel) == 1;
+#else
+                spin_lock* l = spin_get_and_lock(value);
+                bool zero = --c->c == 0;
+                l->unlock();
+                return zero;
+#endif
+            }
+
+            inline int count_of(void* value, count* c)
+            {
+#if defined(SODIUM_ATOMIC_COUNTS)
+                return c->c.load(std::memory_order_acquire);
+#else
+                spin_lock* l = spin_get_and_lock(value);
+                int n = c->c;
+                l->unlock();
+                return n;
+#endif
+            }
+
+            inline int unsafe_count_of(void* value, count* c)
+            {
+#if defined(SODIUM_ATOMIC_COUNTS)
+                return c->c.load(std::memory_order_relaxed);
+#else
+                return c->c;
+#endif
+            }
+
+            inline void unsafe_inc_count(void* value, count* c)
+            {
+#if defined(SODIUM_ATOMIC_COUNTS)
+                c->c.store(c->c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#else
+                c->c++;
+#endif
+            }
+
+            inline bool unsafe_dec_count(void* value, count* c)
+            {
+#if defined(SODIUM_ATOMIC_COUNTS)
+                int n = c->c.load(std::memory_order_relaxed) - 1;
+                c->c.store(n, std::memory_order_relaxed);
+                return n == 0;
+#else
+                return --c->c == 0;
+#endif
+            }
+        }
+    }
+
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+#define SODIUM_ACCOUNT_COUNT() impl::account(impl::memory_payloads, 1, (long)sizeof(impl::count))
+#else
+#define SODIUM_ACCOUNT_COUNT()
+#endif
+
+#define SODIUM_DEFINE_LIGHTPTR(Name, INC_COUNT, DEC_COUNT, COUNT_OF) \
     Name Name::DUMMY; \
      \
     Name::Name(void* value, impl::deleter del) \
         : value(value), count(new impl::count(1, del)) \
+    { \
+        SODIUM_ACCOUNT_COUNT(); \
+    } \
+     \
+    Name::Name(void* value, impl::count* count) \
+        : value(value), count(count) \
     { \
     } \
      \
     Name::Name(const Name& other) \
-        : value(other.value), count(other.count) \
     { \
-        GET_AND_LOCK; \
-        count->c++; \
-        UNLOCK; \
+        if (other.is_inline()) { \
+            memcpy(inline_value, other.inline_value, impl::inline_size); \
+            value = inline_value; \
+        } \
+        else { \
+            value = other.value; \
+            count = other.count; \
+            if (count != NULL) \
+                INC_COUNT(value, count); \
+        } \
     } \
      \
-    Name::~Name() { \
-        GET_AND_LOCK; \
-        if (count != NULL && --count->c == 0) { \
-            UNLOCK; \
-            count->del(value); delete count; \
+    Name::Name(Name&& other) noexcept \
+    { \
+        if (other.is_inline()) { \
+            memcpy(inline_value, other.inline_value, impl::inline_size); \
+            value = inline_value; \
         } \
         else { \
-            UNLOCK; \
+            value = other.value; \
+            count = other.count; \
+            other.value = NULL; \
+            other.count = NULL; \
         } \
     } \
      \
+    Name::~Name() { \
+        if (!is_inline() && count != NULL && DEC_COUNT(value, count)) \
+            impl::release(value, count); \
+    } \
+     \
     Name& Name::operator = (const Name& other) { \
-        { \
-            GET_AND_LOCK; \
-            if (--count->c == 0) { \
-                UNLOCK; \
-                count->del(value); delete count; \
-            } \
-            else { \
-                UNLOCK; \
-            } \
+        if (this == &other) \
+            return *this; \
+        if (!other.is_inline() && other.count != NULL) \
+            INC_COUNT(other.value, other.count); \
+        if (!is_inline() && count != NULL && DEC_COUNT(value, count)) \
+            impl::release(value, count); \
+        if (other.is_inline()) { \
+            memcpy(inline_value, other.inline_value, impl::inline_size); \
+            value = inline_value; \
         } \
-        value = other.value; \
-        count = other.count; \
-        { \
-            GET_AND_LOCK; \
-            count->c++; \
-            UNLOCK; \
+        else { \
+            value = other.value; \
+            count = other.count; \
+        } \
+        return *this; \
+    } \
+     \
+    Name& Name::operator = (Name&& other) noexcept { \
+        if (this == &other) \
+            return *this; \
+        if (!is_inline() && count != NULL && DEC_COUNT(value, count)) \
+            impl::release(value, count); \
+        if (other.is_inline()) { \
+            memcpy(inline_value, other.inline_value, impl::inline_size); \
+            value = inline_value; \
+        } \
+        else { \
+            value = other.value; \
+            count = other.count; \
+            other.value = NULL; \
+            other.count = NULL; \
         } \
         return *this; \
+    } \
+     \
+    bool Name::unique() const { \
+        return is_inline() || count == NULL || COUNT_OF(value, count) == 1; \
     }
 
-SODIUM_DEFINE_LIGHTPTR(light_ptr, impl::spin_lock* l = impl::spin_get_and_lock(this->value),
-                          l->unlock())
+SODIUM_DEFINE_LIGHTPTR(light_ptr, impl::inc_count, impl::dec_count, impl::count_of)
 
-SODIUM_DEFINE_LIGHTPTR(unsafe_light_ptr,,)
+SODIUM_DEFINE_LIGHTPTR(unsafe_light_ptr, impl::unsafe_inc_count, impl::unsafe_dec_count, impl::unsafe_count_of)
 
 };
-
@@ -7,6 +7,14 @@
 #ifndef _SODIUM_LIGHTPTR_H_
 #define _SODIUM_LIGHTPTR_H_
 
+#include <sodium/config.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <type_traits>
+#if defined(SODIUM_ATOMIC_COUNTS)
+#include <atomic>
+#endif
 #include <utility>
 
 namespace sodium {
@@ -22,10 +30,214 @@ namespace sodium {
             count(
                 int c,
                 deleter del
-            ) : c(c), del(del) {}
+            ) : c(c), size(0), del(del) {}
+            count(
+                int c,
+                deleter del,
+                unsigned size
+            ) : c(c), size(size), del(del) {}
+#if defined(SODIUM_ATOMIC_COUNTS)
+            std::atomic<int> c;
+#else
             int c;
+#endif
+            /*!
+             * If non-zero, the count and the value share one block of this many bytes,
+             * with the value at count_header, and del destroys the value in place.
+             * Otherwise the value is allocated separately and del deletes it.
+             */
+            unsigned size;
             deleter del;
         };
+
+        /*!
+         * Offset of the value from the count in a combined block. It's also the
+         * alignment blocks are allocated with.
+         */
+        const size_t count_header = 16;
+
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+        /*!
+         * What accounted memory is used for. Nodes aren't here, since they're
+         * measured by walking the node registry. See sodium/memory.h.
+         */
+        enum memory_use {
+            memory_payloads,
+            memory_closures,
+            memory_cleanups,
+            memory_transactions,
+            memory_uses
+        };
+
+        /*!
+         * A number of objects and their bytes, which another thread can read while
+         * it's being added to.
+         */
+        class memory_tally {
+            public:
+                // Constant so the global tallies are zero before any static
+                // constructor can allocate.
+#if defined(SODIUM_NO_CXX11)
+                memory_tally() : n(0), b(0) {}
+#else
+                constexpr memory_tally() : n(0), b(0) {}
+#endif
+#if defined(SODIUM_ATOMIC_COUNTS)
+                void add(long count, long bytes)
+                {
+                    n.fetch_add(count, std::memory_order_relaxed);
+                    b.fetch_add(bytes, std::memory_order_relaxed);
+                }
+                long count() const { return n.load(std::memory_order_relaxed); }
+                long bytes() const { return b.load(std::memory_order_relaxed); }
+            private:
+                std::atomic<long> n;
+                std::atomic<long> b;
+#else
+                void add(long count, long bytes) { n += count; b += bytes; }
+                long count() const { return n; }
+                long bytes() const { return b; }
+            private:
+                long n;
+                long b;
+#endif
+        };
+
+        /*!
+         * Record that count objects taking bytes bytes have been allocated for use,
+         * or freed if they're negative.
+         */
+        void account(memory_use use, long count, long bytes);
+#endif
+
+        /*!
+         * Allocate and free blocks for count+value pairs. Small blocks come from
+         * per-thread free lists by size class, so they rarely reach the global
+         * allocator.
+         */
+        void* alloc_block(size_t size);
+        void free_block(void* block, size_t size);
+
+        /*!
+         * Release the value and the count once the count has dropped to zero.
+         */
+        void release(void* value, count* c);
+
+        template <class A>
+        void destroy_in_place(void* a0)
+        {
+            ((A*)a0)->~A();
+        }
+
+        template <class A>
+        void delete_aligned(void* a0)
+        {
+            ((A*)a0)->~A();
+            free(a0);
+        }
+
+        /*!
+         * Memory for an A at A's alignment, which new doesn't honour for
+         * over-aligned types before C++17.
+         */
+        template <class A>
+        void* alloc_aligned()
+        {
+            // posix_memalign() wants at least the alignment of a pointer.
+            size_t alignment = alignof(A) > sizeof(void*) ? alignof(A) : sizeof(void*);
+            void* p;
+            if (posix_memalign(&p, alignment, sizeof(A)) != 0)
+#if defined(SODIUM_NO_EXCEPTIONS)
+                abort();
+#else
+                throw std::bad_alloc();
+#endif
+            return p;
+        }
+
+        /*!
+         * Construct an A from arg in a block with its count in front of it, and
+         * return the value. Types that need stronger alignment than the block
+         * gives get a separately allocated count instead.
+         */
+        template <class A, class Arg>
+        void* create_with_count(Arg&& arg, count*& c)
+        {
+            if (alignof(A) > count_header || count_header + sizeof(A) > 0xffffffffu) {
+                void* mem = alloc_aligned<A>();
+                A* value;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                try {
+#endif
+                    value = new (mem) A(std::forward<Arg>(arg));
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                }
+                catch (...) {
+                    free(mem);
+                    throw;
+                }
+#endif
+                c = new count(1, delete_aligned<A>);
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                // Only the count is accounted, since release() can't tell the
+                // value's size.
+                account(memory_payloads, 1, (long)sizeof(count));
+#endif
+                return value;
+            }
+            size_t size = count_header + sizeof(A);
+            void* block = alloc_block(size);
+            A* value;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            try {
+#endif
+                value = new ((char*)block + count_header) A(std::forward<Arg>(arg));
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            }
+            catch (...) {
+                free_block(block, size);
+                throw;
+            }
+#endif
+            c = new (block) count(1, destroy_in_place<A>, (unsigned)size);
+            return value;
+        }
+
+        /*!
+         * Values that are trivially copyable and fit in inline_size bytes are stored in
+         * the light_ptr itself, with no allocation or count. Empty types are shared
+         * instead, so light_ptrs of them just point at shared_instance.
+         */
+        const size_t inline_size = 16;
+
+        struct counted_storage {};
+        struct inline_storage {};
+        struct shared_storage {};
+
+        template <class A>
+        struct storage_for {
+            typedef typename std::conditional<
+                std::is_empty<A>::value && std::is_trivially_copyable<A>::value &&
+                    std::is_default_constructible<A>::value,
+                shared_storage,
+                typename std::conditional<
+                    std::is_trivially_copyable<A>::value && sizeof(A) <= inline_size &&
+                        alignof(A) <= alignof(void*),
+                    inline_storage,
+                    counted_storage
+                >::type
+            >::type type;
+        };
+
+        /*!
+         * The one instance of an empty type, which is never destroyed.
+         */
+        template <class A>
+        struct shared_instance {
+            static A value;
+        };
+        template <class A>
+        A shared_instance<A>::value;
     };
 
     /*!
@@ -35,19 +247,43 @@ namespace sodium {
         struct name { \
             static name DUMMY;  /* A null value that does not work, but can be used to */ \
                                 /* satisfy the compiler for unusable private constructors */ \
-            name(); \
+            name() : value(NULL), count(NULL) {} \
             name(const name& other); \
+            name(name&& other) noexcept; \
             template <class A> static inline name create(const A& a) { \
-                return name(new A(a), deleter<A>); \
+                name p; \
+                p.init<A>(a, typename impl::storage_for<A>::type()); \
+                return p; \
             } \
             template <class A> static inline name create(A&& a) { \
-                return name(new A(std::move(a)), deleter<A>); \
+                name p; \
+                p.init<A>(std::move(a), typename impl::storage_for<A>::type()); \
+                return p; \
             } \
             name(void* value, impl::deleter del); \
+            name(void* value, impl::count* count); \
             ~name(); \
             name& operator = (const name& other); \
+            name& operator = (name&& other) noexcept; \
+            /* True if no other light_ptr refers to this value, so it may be moved from. */ \
+            bool unique() const; \
+            /* Points at inline_value if the value is stored inline. */ \
             void* value; \
-            impl::count* count; \
+            union { \
+                impl::count* count; \
+                char inline_value[impl::inline_size]; \
+            }; \
+            bool is_inline() const { return value == (const void*)inline_value; } \
+         \
+            template <class A, class Arg> void init(Arg&& a, impl::counted_storage) { \
+                value = impl::create_with_count<A>(std::forward<Arg>(a), count); \
+            } \
+            template <class A, class Arg> void init(Arg&& a, impl::inline_storage) { \
+                value = new (inline_value) A(std::forward<Arg>(a)); \
+            } \
+            template <class A, class Arg> void init(Arg&& a, impl::shared_storage) { \
+                value = &impl::shared_instance<A>::value; \
+            } \
          \
             template <class A> inline A* cast_ptr(A*) {return (A*)value;} \
             template <class A> inline const A* cast_ptr(A*) const {return (A*)value;} \
@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/memory.h>
+
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+
+namespace sodium {
+
+    namespace impl {
+        namespace {
+            memory_tally tallies[memory_uses];
+
+            memory_usage usage_of(const memory_tally& t)
+            {
+                memory_usage u;
+                u.count = t.count();
+                u.bytes = t.bytes();
+                return u;
+            }
+
+            void add(memory_usage& u, long count, long bytes)
+            {
+                u.count += count;
+                u.bytes += bytes;
+            }
+
+            void add_node(const node& n, void* ctx)
+            {
+                long bytes = sizeof(node)
+                    + n.targets.capacity() * sizeof(SODIUM_SHARED_PTR<holder>)
+                    + n.firings.capacity() * sizeof(light_ptr)
+                    + n.sources.capacity() * sizeof(node::source);
+                memory_snapshot& m = *static_cast<memory_snapshot*>(ctx);
+                add(m.nodes, 1, bytes);
+                add(m.operators[n.kind], 1, bytes);
+            }
+        }
+
+        void account(memory_use use, long count, long bytes)
+        {
+            tallies[use].add(count, bytes);
+        }
+    }
+
+    memory_usage memory_snapshot::total() const
+    {
+        memory_usage u;
+        const memory_usage* parts[] = { &nodes, &payloads, &closures, &cleanups, &transactions };
+        for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+            impl::add(u, parts[i]->count, parts[i]->bytes);
+        return u;
+    }
+
+    memory_snapshot snapshot_memory(partition* part)
+    {
+        memory_snapshot m;
+        m.payloads = impl::usage_of(impl::tallies[impl::memory_payloads]);
+        m.closures = impl::usage_of(impl::tallies[impl::memory_closures]);
+        m.cleanups = impl::usage_of(impl::tallies[impl::memory_cleanups]);
+        m.transactions = impl::usage_of(impl::tallies[impl::memory_transactions]);
+        m.partition = impl::usage_of(part->memory);
+#if !defined(SODIUM_SINGLE_THREADED)
+        // Transactions resize the nodes' vectors under their partitions' locks.
+        std::vector<partition*> locked = impl::lock_partitions(std::vector<partition*>());
+#endif
+        impl::visit_nodes(impl::add_node, &m);
+#if !defined(SODIUM_SINGLE_THREADED)
+        impl::unlock_partitions(locked);
+#endif
+        return m;
+    }
+}  // end namespace sodium
+#endif
@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_MEMORY_H_
+#define _SODIUM_MEMORY_H_
+
+#include <sodium/sodium.h>
+#include <map>
+#include <string>
+
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+namespace sodium {
+    struct memory_usage {
+        memory_usage() : count(0), bytes(0) {}
+        long count;
+        long bytes;
+    };
+
+    /*!
+     * The memory Sodium holds at one moment. Bytes are the objects' own sizes and
+     * what they allocate directly, so what a handler's captures or a payload's
+     * members allocate in turn isn't included.
+     */
+    struct memory_snapshot {
+        /*!
+         * Live nodes, with their vectors of targets, sources and firings.
+         */
+        memory_usage nodes;
+        /*!
+         * Values held by light_ptrs, with their counts. Values that are stored
+         * inline or shared take nothing.
+         */
+        memory_usage payloads;
+        /*!
+         * Events' functions and the holders of their handlers.
+         */
+        memory_usage closures;
+        /*!
+         * Functions waiting to run when an event is torn down.
+         */
+        memory_usage cleanups;
+        /*!
+         * Transactions on every partition, including the ones kept for reuse, and
+         * their arenas.
+         */
+        memory_usage transactions;
+        /*!
+         * The share of transactions belonging to the partition snapshotted.
+         */
+        memory_usage partition;
+        /*!
+         * nodes by the operator that made them, such as "map" or "listen".
+         */
+        std::map<std::string, memory_usage> operators;
+
+        /*!
+         * Everything except partition, which is already in transactions.
+         */
+        memory_usage total() const;
+    };
+
+    /*!
+     * Take a snapshot of the memory in use, with the given partition's transactions
+     * broken out. The nodes are read with every partition locked, so it waits for
+     * the transactions in progress, and it mustn't be called from inside one.
+     */
+    memory_snapshot snapshot_memory(partition* part = def_part::part());
+}  // end namespace sodium
+#endif
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/metrics.h>
+
+#if defined(SODIUM_METRICS)
+#include <sstream>
+
+namespace sodium {
+
+    namespace impl {
+
+        partition_counters::partition_counters()
+            : transactions(0),
+              prioritized_peak(0),
+              last_peak(0),
+              last_total(0),
+              post_peak(0),
+              lock_ns(0),
+              locked_at(0)
+        {
+        }
+
+#if defined(SODIUM_NODE_METRICS)
+        namespace {
+            void add_node(const node& n, void* ctx)
+            {
+                node_metrics nm;
+                nm.id = n.serial;
+                nm.firings = n.fired.get();
+                nm.fan_out = (size_t)n.fan_out.get();
+                nm.handler_seconds = n.handler_ns.get() * 1e-9;
+                static_cast<std::vector<node_metrics>*>(ctx)->push_back(nm);
+            }
+        }
+#endif
+
+        namespace {
+            /*!
+             * Quote a label value, escaping what the text format needs escaped.
+             */
+            std::string label(const std::string& value)
+            {
+                std::string s("\"");
+                for (size_t i = 0; i < value.size(); i++) {
+                    char c = value[i];
+                    if (c == '\\' || c == '"')
+                        s += '\\';
+                    if (c == '\n')
+                        s += "\\n";
+                    else
+                        s += c;
+                }
+                return s + "\"";
+            }
+
+            void header(std::ostringstream& out, const char* name, const char* type, const char* help)
+            {
+                out << "# HELP " << name << ' ' << help << '\n';
+                out << "# TYPE " << name << ' ' << type << '\n';
+            }
+        }
+    }
+
+    partition_metrics::partition_metrics()
+        : taken_ns(0),
+          transactions(0),
+          prioritized_peak(0),
+          regens(0),
+          rekeys(0),
+          last_peak(0),
+          last_mean(0),
+          post_length(0),
+          post_peak(0),
+          lock_seconds(0)
+    {
+    }
+
+    metrics_snapshot snapshot_metrics(partition* part)
+    {
+        metrics_snapshot m;
+#if !defined(SODIUM_SINGLE_THREADED)
+        part->mx.lock();
+#endif
+        const impl::partition_counters& c = part->counters;
+        partition_metrics& pm = m.partition;
+        pm.taken_ns = impl::monotonic_ns();
+        pm.transactions = c.transactions;
+        pm.prioritized_peak = c.prioritized_peak;
+        pm.regens = part->regen_count;
+        pm.rekeys = part->rekey_count;
+        pm.last_peak = c.last_peak;
+        pm.last_mean = c.transactions != 0 ? (double)c.last_total / c.transactions : 0;
+        pm.post_length = part->postQ.size();
+        pm.post_peak = c.post_peak;
+        pm.lock_seconds = c.lock_ns * 1e-9;
+#if !defined(SODIUM_SINGLE_THREADED)
+        part->mx.unlock();
+#endif
+#if defined(SODIUM_NODE_METRICS)
+        impl::visit_nodes(impl::add_node, &m.nodes);
+#endif
+        return m;
+    }
+
+    double transactions_per_sec(const metrics_snapshot& earlier, const metrics_snapshot& later)
+    {
+        const partition_metrics& a = earlier.partition;
+        const partition_metrics& b = later.partition;
+        if (b.taken_ns <= a.taken_ns)
+            return 0;
+        return (double)(b.transactions - a.transactions) * 1e9 / (b.taken_ns - a.taken_ns);
+    }
+
+    std::string to_prometheus(const metrics_snapshot& m, const std::string& partition_name)
+    {
+        using impl::header;
+        std::ostringstream out;
+        std::string part = "{partition=" + impl::label(partition_name) + "} ";
+        const partition_metrics& pm = m.partition;
+        header(out, "sodium_transactions_total", "counter", "Transactions run on the partition.");
+        out << "sodium_transactions_total" << part << pm.transactions << '\n';
+        header(out, "sodium_prioritized_queue_peak", "gauge", "Most actions queued at once in one transaction.");
+        out << "sodium_prioritized_queue_peak" << part << pm.prioritized_peak << '\n';
+        header(out, "sodium_regens_total", "counter", "Times a transaction re-ranked its queue after re-linking.");
+        out << "sodium_regens_total" << part << pm.regens << '\n';
+        header(out, "sodium_rekeys_total", "counter", "Queued actions moved by re-ranking.");
+        out << "sodium_rekeys_total" << part << pm.rekeys << '\n';
+        header(out, "sodium_last_queue_peak", "gauge", "Most end-of-transaction actions in one transaction.");
+        out << "sodium_last_queue_peak" << part << pm.last_peak << '\n';
+        header(out, "sodium_last_queue_mean", "gauge", "Mean end-of-transaction actions per transaction.");
+        out << "sodium_last_queue_mean" << part << pm.last_mean << '\n';
+        header(out, "sodium_post_queue_length", "gauge", "Posted actions waiting to run.");
+        out << "sodium_post_queue_length" << part << pm.post_length << '\n';
+        header(out, "sodium_post_queue_peak", "gauge", "Most posted actions ever waiting.");
+        out << "sodium_post_queue_peak" << part << pm.post_peak << '\n';
+        header(out, "sodium_lock_seconds_total", "counter", "Time transactions have held the partition lock.");
+        out << "sodium_lock_seconds_total" << part << pm.lock_seconds << '\n';
+#if defined(SODIUM_NODE_METRICS)
+        header(out, "sodium_node_firings_total", "counter", "Values fired by the node.");
+        for (size_t i = 0; i < m.nodes.size(); i++)
+            out << "sodium_node_firings_total{node=\"" << m.nodes[i].id << "\"} " << m.nodes[i].firings << '\n';
+        header(out, "sodium_node_fan_out", "gauge", "Nodes and listeners the node sends to.");
+        for (size_t i = 0; i < m.nodes.size(); i++)
+            out << "sodium_node_fan_out{node=\"" << m.nodes[i].id << "\"} " << m.nodes[i].fan_out << '\n';
+        header(out, "sodium_node_handler_seconds_total", "counter", "Time spent handling values sent to the node.");
+        for (size_t i = 0; i < m.nodes.size(); i++)
+            out << "sodium_node_handler_seconds_total{node=\"" << m.nodes[i].id << "\"} " << m.nodes[i].handler_seconds << '\n';
+#endif
+        return out.str();
+    }
+}  // end namespace sodium
+#endif
@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_METRICS_H_
+#define _SODIUM_METRICS_H_
+
+#include <sodium/sodium.h>
+#include <string>
+#include <vector>
+
+#if defined(SODIUM_METRICS)
+namespace sodium {
+    /*!
+     * What a partition's transactions have done since it was created.
+     */
+    struct partition_metrics {
+        partition_metrics();
+        /*!
+         * When the snapshot was taken, in nanoseconds on a monotonic clock, so that
+         * transactions_per_sec() can work out a rate between two snapshots.
+         */
+        unsigned long long taken_ns;
+        unsigned long transactions;
+        /*!
+         * The most actions that have been waiting in one transaction's prioritized
+         * queue at once.
+         */
+        size_t prioritized_peak;
+        /*!
+         * How many times a transaction has had to re-rank its queue because the graph
+         * was re-linked, and how many queued actions that moved.
+         */
+        unsigned long regens;
+        unsigned long rekeys;
+        /*!
+         * The most actions that have run at the end of one transaction (where
+         * behaviors take their new values), and the mean per transaction.
+         */
+        size_t last_peak;
+        double last_mean;
+        /*!
+         * The actions posted to run after a transaction that are waiting now, and
+         * the most that have ever been waiting.
+         */
+        size_t post_length;
+        size_t post_peak;
+        /*!
+         * Total time transactions have held the partition's lock, from the start of
+         * the transaction until it's been processed.
+         */
+        double lock_seconds;
+    };
+
+#if defined(SODIUM_NODE_METRICS)
+    /*!
+     * What one node has done since it was created. Nodes are the events and
+     * behaviors' internal parts, and are identified by number. Its rank is in the
+     * graph that graph_walk returns, which reads it under the partitions' locks.
+     */
+    struct node_metrics {
+        unsigned long id;
+        unsigned long long firings;
+        /*!
+         * How many nodes and listeners it sends its values to.
+         */
+        size_t fan_out;
+        /*!
+         * Total time spent in the handlers that take values sent to it, which for a
+         * listener is the listener's callback.
+         */
+        double handler_seconds;
+    };
+#endif
+
+    struct metrics_snapshot {
+        partition_metrics partition;
+#if defined(SODIUM_NODE_METRICS)
+        /*!
+         * Every live node, on every partition, newest first.
+         */
+        std::vector<node_metrics> nodes;
+#endif
+    };
+
+    /*!
+     * Read the partition's metrics, and with SODIUM_NODE_METRICS, every node's. The
+     * partition's are read under its lock, so they're consistent with each other,
+     * while the nodes' are read while transactions carry on.
+     */
+    metrics_snapshot snapshot_metrics(partition* part = def_part::part());
+
+    /*!
+     * The partition's transactions per second between two snapshots of it. Taking a
+     * snapshot changes nothing, so each reader keeps its own previous one.
+     */
+    double transactions_per_sec(const metrics_snapshot& earlier, const metrics_snapshot& later);
+
+    /*!
+     * Format a snapshot in the Prometheus text exposition format, with the partition
+     * labelled partition_name.
+     */
+    std::string to_prometheus(const metrics_snapshot& m, const std::string& partition_name = "default");
+}  // end namespace sodium
+#endif
+
+#endif
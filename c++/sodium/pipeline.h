@@ -0,0 +1,214 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_PIPELINE_H_
+#define _SODIUM_PIPELINE_H_
+
+#include <sodium/sodium.h>
+#include <boost/optional.hpp>
+#include <type_traits>
+#include <utility>
+
+namespace sodium {
+    namespace impl {
+        /*!
+         * The stages of a pipeline. Each one passes its output to a continuation k,
+         * so a whole chain compiles down to nested inline calls, and values between
+         * stages live on the stack instead of in light_ptrs. run() isn't const, so
+         * that, as with event::map(), the functions can be mutable.
+         */
+        template <class A>
+        struct pipe_source {
+            typedef A in_type;
+            typedef A out_type;
+            static const bool pure = true;
+            template <class K>
+            void run(const A& a, const K& k) { k(a); }
+        };
+
+        template <class Prev, class F, class B>
+        struct pipe_map {
+            typedef typename Prev::in_type in_type;
+            typedef B out_type;
+            static const bool pure = Prev::pure;
+            pipe_map(const Prev& prev, const F& f) : prev(prev), f(f) {}
+            Prev prev;
+            F f;
+            template <class K>
+            struct cont {
+                F& f;
+                const K& k;
+                void operator () (const typename Prev::out_type& a) const { k(f(a)); }
+            };
+            template <class K>
+            void run(const in_type& a, const K& k) { prev.run(a, cont<K>{f, k}); }
+        };
+
+        template <class Prev, class F>
+        struct pipe_filter {
+            typedef typename Prev::in_type in_type;
+            typedef typename Prev::out_type out_type;
+            static const bool pure = Prev::pure;
+            pipe_filter(const Prev& prev, const F& pred) : prev(prev), pred(pred) {}
+            Prev prev;
+            F pred;
+            template <class K>
+            struct cont {
+                F& pred;
+                const K& k;
+                void operator () (const out_type& a) const { if (pred(a)) k(a); }
+            };
+            template <class K>
+            void run(const in_type& a, const K& k) { prev.run(a, cont<K>{pred, k}); }
+        };
+
+        template <class Prev>
+        struct pipe_filter_optional {
+            typedef typename Prev::in_type in_type;
+            typedef typename Prev::out_type::value_type out_type;
+            static const bool pure = Prev::pure;
+            pipe_filter_optional(const Prev& prev) : prev(prev) {}
+            Prev prev;
+            template <class K>
+            struct cont {
+                const K& k;
+                void operator () (const boost::optional<out_type>& oa) const { if (oa) k(oa.get()); }
+            };
+            template <class K>
+            void run(const in_type& a, const K& k) { prev.run(a, cont<K>{k}); }
+        };
+
+        /*!
+         * Samples the behavior like snapshot() does. This isn't pure, because the
+         * first sample of a lazy behavior writes to it.
+         */
+        template <class Prev>
+        struct pipe_gate {
+            typedef typename Prev::in_type in_type;
+            typedef typename Prev::out_type out_type;
+            static const bool pure = false;
+            pipe_gate(const Prev& prev, const behavior_& g) : prev(prev), g(g) {}
+            Prev prev;
+            behavior_ g;
+            template <class K>
+            struct cont {
+                const behavior_& g;
+                const K& k;
+                void operator () (const out_type& a) const {
+                    if (*g.impl->sample().template cast_ptr<bool>(NULL)) k(a);
+                }
+            };
+            template <class K>
+            void run(const in_type& a, const K& k) { prev.run(a, cont<K>{g, k}); }
+        };
+
+        template <class B>
+        struct pipe_send {
+            const SODIUM_SHARED_PTR<node>& target;
+            transaction_impl* trans;
+            void operator () (const B& b) const { send(target, trans, light_ptr::create<B>(b)); }
+        };
+    }
+
+    /*!
+     * A chain of stateless operators on an event, fused into one node. Where
+     *
+     *     e.map<B>(f).filter(p).map<C>(g)
+     *
+     * makes three nodes, each with its own rank, scheduler entry, type-erased
+     * handler and light_ptr per firing,
+     *
+     *     event<C, P> ec = pipe(e).map(f).filter(p).map(g);
+     *
+     * makes one, whose handler is f, p and g inlined together. The node is only
+     * made when the pipeline is turned into an event, so do that wherever the
+     * chain fans out, otherwise each branch repeats the stages before it.
+     */
+    template <class S, class P>
+    class pipeline {
+        public:
+            typedef typename S::in_type in_type;
+            typedef typename S::out_type out_type;
+
+            pipeline(const event<in_type, P>& source, const S& stages)
+                : source(source), stages(stages) {}
+
+            /*!
+             * Map a function over the values. As with event::map(), the function must be
+             * pure (referentially transparent).
+             */
+            template <class F>
+            pipeline<impl::pipe_map<S, typename std::decay<F>::type,
+                    typename std::decay<decltype(std::declval<F>()(std::declval<const out_type&>()))>::type>, P>
+                map(const F& f) const
+            {
+                // A plain function is held as a pointer to it.
+                typedef typename std::decay<F>::type G;
+                typedef typename std::decay<decltype(std::declval<F>()(std::declval<const out_type&>()))>::type B;
+                return pipeline<impl::pipe_map<S, G, B>, P>(source, impl::pipe_map<S, G, B>(stages, f));
+            }
+
+            /*!
+             * Only let through values that satisfy the predicate.
+             */
+            template <class F>
+            pipeline<impl::pipe_filter<S, typename std::decay<F>::type>, P> filter(const F& pred) const
+            {
+                typedef typename std::decay<F>::type G;
+                return pipeline<impl::pipe_filter<S, G>, P>(source, impl::pipe_filter<S, G>(stages, pred));
+            }
+
+            /*!
+             * Drop empty optionals and unwrap the rest. The values must be boost::optional.
+             */
+            pipeline<impl::pipe_filter_optional<S>, P> filter_optional() const
+            {
+                return pipeline<impl::pipe_filter_optional<S>, P>(source, impl::pipe_filter_optional<S>(stages));
+            }
+
+            /*!
+             * Only let values through while the behavior is true, like event::gate().
+             */
+            pipeline<impl::pipe_gate<S>, P> gate(const behavior<bool, P>& g) const
+            {
+                return pipeline<impl::pipe_gate<S>, P>(source, impl::pipe_gate<S>(stages, g));
+            }
+
+            /*!
+             * Make the node that runs all the stages.
+             */
+            event<out_type, P> to_event() const
+            {
+                transaction<P> trans;
+                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("pipeline");
+                S st(stages);
+                auto kill = source.listen_raw(trans.impl(), std::get<1>(p),
+                        new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
+                            [st] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) mutable {
+                                st.run(*ptr.cast_ptr<in_type>(NULL), impl::pipe_send<out_type>{target, trans});
+                            }), false, S::pure);
+                event<out_type, P> ev(SODIUM_TUPLE_GET<0>(p));
+                return event<out_type, P>(ev.unsafe_add_cleanup(kill));
+            }
+
+            operator event<out_type, P>() const { return to_event(); }
+
+        private:
+            event<in_type, P> source;
+            S stages;
+    };
+
+    /*!
+     * Start a fused pipeline from an event. See pipeline.
+     */
+    template <class A, class P>
+    pipeline<impl::pipe_source<A>, P> pipe(const event<A, P>& e)
+    {
+        return pipeline<impl::pipe_source<A>, P>(e, impl::pipe_source<A>());
+    }
+}  // end namespace sodium
+
+#endif
@@ -0,0 +1,219 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/profile.h>
+
+#if defined(SODIUM_PROFILING)
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+namespace sodium {
+
+    namespace impl {
+        struct profile_site {
+            profile_site(const profile_site* parent, const std::string& label)
+                : parent(parent), label(label) {}
+            const profile_site* parent;
+            std::string label;
+        };
+
+        namespace {
+            /*!
+             * Guards sites and slots. Sites and slots are never freed, since nodes
+             * and creation_sites point at them for as long as they live.
+             */
+            spin_lock profile_lock;
+            std::map<std::pair<const profile_site*, std::string>, profile_site*>* sites = NULL;
+            std::map<std::pair<const profile_site*, std::string>, profile_slot*>* slots = NULL;
+#if defined(SODIUM_SINGLE_THREADED)
+            unsigned long every = 0;
+            const profile_site* current = NULL;
+            unsigned long ticks = 0;
+#elif !defined(SODIUM_NO_CXX11)
+            std::atomic<unsigned long> every(0);
+            thread_local const profile_site* current = NULL;
+            thread_local unsigned long ticks = 0;
+#else
+            unsigned long every = 0;
+            pthread_key_t current_key;
+            pthread_key_t ticks_key;
+            pthread_once_t keys_once = PTHREAD_ONCE_INIT;
+            void make_keys()
+            {
+                pthread_key_create(&current_key, NULL);
+                pthread_key_create(&ticks_key, NULL);
+            }
+#endif
+
+            const profile_site* get_current()
+            {
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+                return current;
+#else
+                pthread_once(&keys_once, make_keys);
+                return (const profile_site*)pthread_getspecific(current_key);
+#endif
+            }
+
+            void set_current(const profile_site* site)
+            {
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+                current = site;
+#else
+                pthread_once(&keys_once, make_keys);
+                pthread_setspecific(current_key, site);
+#endif
+            }
+
+            /*!
+             * Frames are separated by ';' and the count follows the last space, so
+             * keep ';' and newlines out of labels.
+             */
+            std::string frame(const std::string& label)
+            {
+                std::string f(label);
+                for (size_t i = 0; i < f.size(); i++)
+                    if (f[i] == ';' || f[i] == '\n')
+                        f[i] = '_';
+                return f;
+            }
+
+            std::string stack_of(const profile_slot& slot)
+            {
+                std::vector<const profile_site*> path;
+                for (const profile_site* s = slot.site; s != NULL; s = s->parent)
+                    path.push_back(s);
+                std::string stack("sodium");
+                for (size_t i = path.size(); i-- > 0; )
+                    stack += ";" + frame(path[i]->label);
+                return stack + ";" + slot.kind;
+            }
+
+            bool hottest_first(const profile_entry& a, const profile_entry& b)
+            {
+                return a.seconds > b.seconds;
+            }
+        }
+
+        profile_slot* profile_slot_here(const char* kind)
+        {
+            std::pair<const profile_site*, std::string> key(get_current(), kind);
+            profile_lock.lock();
+            if (slots == NULL)
+                slots = new std::map<std::pair<const profile_site*, std::string>, profile_slot*>;
+            profile_slot*& slot = (*slots)[key];
+            if (slot == NULL)
+                slot = new profile_slot(key.first, kind);
+            profile_slot* s = slot;
+            profile_lock.unlock();
+            return s;
+        }
+
+        unsigned long profile_weight()
+        {
+            unsigned long n = every;
+            if (n == 0)
+                return 0;
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            if (++ticks < n)
+                return 0;
+            ticks = 0;
+#else
+            pthread_once(&keys_once, make_keys);
+            unsigned long t = (unsigned long)pthread_getspecific(ticks_key) + 1;
+            pthread_setspecific(ticks_key, (void*)(t < n ? t : 0));
+            if (t < n)
+                return 0;
+#endif
+            return n;
+        }
+    }
+
+    creation_site::creation_site(const std::string& name)
+    {
+        enter(name);
+    }
+
+    creation_site::creation_site(const char* file, unsigned line)
+    {
+        std::ostringstream label;
+        label << file << ':' << line;
+        enter(label.str());
+    }
+
+    void creation_site::enter(const std::string& label)
+    {
+        previous = impl::get_current();
+        std::pair<const impl::profile_site*, std::string> key(previous, label);
+        impl::profile_lock.lock();
+        if (impl::sites == NULL)
+            impl::sites = new std::map<std::pair<const impl::profile_site*, std::string>, impl::profile_site*>;
+        impl::profile_site*& site = (*impl::sites)[key];
+        if (site == NULL)
+            site = new impl::profile_site(previous, label);
+        impl::profile_site* s = site;
+        impl::profile_lock.unlock();
+        impl::set_current(s);
+    }
+
+    creation_site::~creation_site()
+    {
+        impl::set_current(previous);
+    }
+
+    void set_profiling(unsigned long every)
+    {
+        impl::every = every;
+    }
+
+    std::vector<profile_entry> profile_report()
+    {
+        std::vector<profile_entry> report;
+        impl::profile_lock.lock();
+        if (impl::slots != NULL)
+            for (std::map<std::pair<const impl::profile_site*, std::string>, impl::profile_slot*>::const_iterator
+                    it = impl::slots->begin(); it != impl::slots->end(); ++it) {
+                const impl::profile_slot& slot = *it->second;
+                if (slot.samples.get() == 0)
+                    continue;
+                profile_entry e;
+                e.stack = impl::stack_of(slot);
+                e.seconds = slot.ns.get() * 1e-9;
+                e.samples = (unsigned long)slot.samples.get();
+                report.push_back(e);
+            }
+        impl::profile_lock.unlock();
+        std::sort(report.begin(), report.end(), impl::hottest_first);
+        return report;
+    }
+
+    std::string folded_stacks()
+    {
+        std::vector<profile_entry> report = profile_report();
+        std::ostringstream out;
+        for (size_t i = 0; i < report.size(); i++) {
+            unsigned long long us = (unsigned long long)(report[i].seconds * 1e6 + 0.5);
+            if (us != 0)
+                out << report[i].stack << ' ' << us << '\n';
+        }
+        return out.str();
+    }
+
+    void clear_profile()
+    {
+        impl::profile_lock.lock();
+        if (impl::slots != NULL)
+            for (std::map<std::pair<const impl::profile_site*, std::string>, impl::profile_slot*>::iterator
+                    it = impl::slots->begin(); it != impl::slots->end(); ++it) {
+                impl::profile_slot& slot = *it->second;
+                slot.ns.sub(slot.ns.get());
+                slot.samples.sub(slot.samples.get());
+            }
+        impl::profile_lock.unlock();
+    }
+}  // end namespace sodium
+#endif
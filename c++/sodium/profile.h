@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_PROFILE_H_
+#define _SODIUM_PROFILE_H_
+
+#include <sodium/sodium.h>
+#include <string>
+#include <vector>
+
+#if defined(SODIUM_PROFILING)
+namespace sodium {
+    /*!
+     * While it's in scope, the nodes made on this thread are attributed to it, so
+     * their handler time can be told apart from all the other maps and filters.
+     * Sites nest, and a site entered inside another is a frame below it in the
+     * folded stacks:
+     *
+     *     creation_site site("pricing");
+     *     event<double> mid = quotes.map<double>(...);
+     *
+     * SODIUM_CREATION_SITE() names one after the file and line it's on.
+     */
+    class creation_site {
+        public:
+            explicit creation_site(const std::string& name);
+            creation_site(const char* file, unsigned line);
+            ~creation_site();
+
+        private:
+            creation_site(const creation_site& other) {}
+            creation_site& operator = (const creation_site& other) { return *this; }
+            void enter(const std::string& label);
+            const impl::profile_site* previous;
+    };
+
+    #define SODIUM_CREATION_SITE_CAT_(a, b) a##b
+    #define SODIUM_CREATION_SITE_CAT(a, b) SODIUM_CREATION_SITE_CAT_(a, b)
+    #define SODIUM_CREATION_SITE() \
+        sodium::creation_site SODIUM_CREATION_SITE_CAT(sodium_creation_site_, __LINE__)(__FILE__, __LINE__)
+
+    /*!
+     * Time one handler run in every 'every' on each thread, counting it as 'every'
+     * runs, or none if it's 0, which is the default. Timing costs two clock reads,
+     * so 1 gives exact figures and larger values keep the overhead down.
+     */
+    void set_profiling(unsigned long every);
+
+    struct profile_entry {
+        /*!
+         * "sodium", the sites the nodes were made in from the outermost in, and the
+         * operator, separated by ';'.
+         */
+        std::string stack;
+        /*!
+         * The estimated time spent in the handlers of those nodes.
+         */
+        double seconds;
+        unsigned long samples;
+    };
+
+    /*!
+     * Handler time by creation site and operator, hottest first.
+     */
+    std::vector<profile_entry> profile_report();
+
+    /*!
+     * profile_report() as folded stacks, one "stack microseconds" line each, for
+     * flamegraph.pl, speedscope and the like.
+     */
+    std::string folded_stacks();
+
+    /*!
+     * Forget the time recorded so far.
+     */
+    void clear_profile();
+}  // end namespace sodium
+#endif
+
+#endif
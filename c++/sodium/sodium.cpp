@@ -5,6 +5,9 @@
  * C++ implementation courtesy of International Telematics Ltd.
  */
 #include <sodium/sodium.h>
+#if defined(SODIUM_LATENCY)
+#include <sodium/latency.h>
+#endif
 
 using namespace std;
 using namespace boost;
@@ -33,9 +36,10 @@ namespace sodium {
 #else
                     std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler,
 #endif
-                    bool suppressEarlierFirings) const
+                    bool suppressEarlierFirings,
+                    bool pure) const
         {
-            SODIUM_SHARED_PTR<holder> h(new holder(handler));
+            SODIUM_SHARED_PTR<holder> h(new holder(handler, pure));
             return listen_impl(trans, target, h, suppressEarlierFirings);
         }
 
@@ -103,7 +107,7 @@ namespace sodium {
             SODIUM_SHARED_PTR<function<void()>*> ppKill(new function<void()>*(NULL));
 #endif
 
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("once");
             *ppKill = listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
 #if defined(SODIUM_NO_CXX11)
                 new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>(
@@ -148,10 +152,10 @@ namespace sodium {
 #endif
 
         event_ event_::merge_(transaction_impl* trans, const event_& other) const {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("merge");
             SODIUM_SHARED_PTR<impl::node> left(new impl::node);
             const SODIUM_SHARED_PTR<impl::node>& right = SODIUM_TUPLE_GET<1>(p);
-            char* h = new char;
+            SODIUM_SHARED_PTR<holder> h(new holder(NULL));
             if (left->link(h, right))
                 trans->to_regen = true;
             // defer right side to make sure merge is left-biased
@@ -165,8 +169,7 @@ namespace sodium {
                     }), false);
             auto kill2 = other.listen_raw(trans, right, NULL, false);
             auto kill3 = new std::function<void()>([left, h] () {
-                left->unlink(h);
-                delete h;
+                left->unlink(h.get());
             });
 #endif
             return SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(kill1, kill2, kill3);
@@ -218,7 +221,7 @@ namespace sodium {
             ) const
         {
             SODIUM_SHARED_PTR<coalesce_state> pState(new coalesce_state);
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("coalesce");
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* kill = listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
                 new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>(
@@ -282,7 +285,7 @@ namespace sodium {
 #endif
             ) const
         {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("snapshot");
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* kill = listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
                 new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>(
@@ -321,18 +324,18 @@ namespace sodium {
 #endif
             ) const
         {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("filter");
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* kill = listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
                 new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>(
                     new filter_listen(pred)
-                ), false);
+                ), false, true);
 #else
             auto kill = listen_raw(trans, std::get<1>(p),
                     new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
                         [pred] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) {
                             if (pred(ptr)) send(target, trans, ptr);
-                        }), false);
+                        }), false, true);
 #endif
             return SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(kill);
         }
@@ -381,7 +384,7 @@ namespace sodium {
          */
         void send(const SODIUM_SHARED_PTR<node>& n, transaction_impl* trans, const light_ptr& a)
         {
-            if (n->firings.begin() == n->firings.end())
+            if (n->firings.empty())
 #if defined(SODIUM_NO_CXX11)
                 trans->last(new clear_firings(n));
 #else
@@ -389,14 +392,53 @@ namespace sodium {
                     n->firings.clear();
                 });
 #endif
-            n->firings.push_front(a);
-            SODIUM_FORWARD_LIST<node::target>::iterator it = n->targets.begin();
-            while (it != n->targets.end()) {
-                node::target* f = &*it;
-                trans->prioritized(f->n, [f, a] (transaction_impl* trans) {
-                    ((holder*)f->h)->handle(f->n, trans, a);
+            n->firings.push_back(a);
+#if defined(SODIUM_NODE_METRICS)
+            n->fired.add(1);
+#endif
+            // Newest first. The vector can move under us if a handler links to n, so
+            // the action holds the holder and not a pointer into it.
+            for (size_t i = n->targets.size(); i-- > 0; ) {
+                holder* h = n->targets[i].get();
+                if (h == NULL)
+                    continue;
+                task* t = trans->prioritized(h->target, [h, a] (transaction_impl* trans) {
+#if defined(SODIUM_LATENCY)
+                    if (h->target && h->target->latency != NULL && trans->origin_ns != 0)
+                        h->target->latency->record(monotonic_ns() - trans->origin_ns);
+#endif
+#if defined(SODIUM_NODE_METRICS) || defined(SODIUM_PROFILING)
+#if defined(SODIUM_PROFILING)
+                    unsigned long weight = profile_weight();
+#if !defined(SODIUM_NODE_METRICS)
+                    if (weight == 0) {
+                        h->handle(h->target, trans, a);
+                        return;
+                    }
+#endif
+#endif
+                    // The time goes to the node being handled for. The handler can
+                    // unlink h, so hold on to it.
+                    SODIUM_SHARED_PTR<node> target(h->target);
+                    unsigned long long t0 = monotonic_ns();
+                    h->handle(target, trans, a);
+                    if (target) {
+                        unsigned long long ns = monotonic_ns() - t0;
+#if defined(SODIUM_NODE_METRICS)
+                        target->handler_ns.add(ns);
+#endif
+#if defined(SODIUM_PROFILING)
+                        if (weight != 0) {
+                            target->profile->ns.add(ns * weight);
+                            target->profile->samples.add(1);
+                        }
+#endif
+                    }
+#else
+                    h->handle(h->target, trans, a);
+#endif
                 });
-                it++;
+                t->pure = h->is_pure();
             }
         }
 
@@ -436,7 +478,7 @@ namespace sodium {
                         bool suppressEarlierFirings) const {  // Register listener
                 SODIUM_SHARED_PTR<node> n = n_weak.lock();
                 if (n) {
-                    SODIUM_FORWARD_LIST<light_ptr> firings;
+                    std::vector<light_ptr> firings;
                     holder* h = new holder(handler);   *** TO DO: BRING THIS UP-TO-DATE relative to C++11
                     {
 #if !defined(SODIUM_SINGLE_THREADED)
@@ -449,8 +491,8 @@ namespace sodium {
 #endif
                         firings = n->firings;
                     }
-                    if (!suppressEarlierFirings && firings.begin() != firings.end())
-                        for (SODIUM_FORWARD_LIST<light_ptr>::iterator it = firings.begin(); it != firings.end(); it++)
+                    if (!suppressEarlierFirings && !firings.empty())
+                        for (std::vector<light_ptr>::reverse_iterator it = firings.rbegin(); it != firings.rend(); it++)
                             h->handle(target, trans, *it);
                     return new lambda0<void>(new unregister(trans->part, n_weak, h));
                 }
@@ -465,9 +507,15 @@ namespace sodium {
         /*!
          * Creates an event, that values can be pushed into using impl::send(). 
          */
-        SODIUM_TUPLE<event_, SODIUM_SHARED_PTR<node> > unsafe_new_event()
+        SODIUM_TUPLE<event_, SODIUM_SHARED_PTR<node> > unsafe_new_event(const char* kind)
         {
             SODIUM_SHARED_PTR<node> n(new node);
+#if defined(SODIUM_NODE_KINDS)
+            n->kind = kind;
+#endif
+#if defined(SODIUM_PROFILING)
+            n->profile = profile_slot_here(kind);
+#endif
             SODIUM_WEAK_PTR<node> n_weak(n);
             boost::intrusive_ptr<listen_impl_func<H_STRONG> > impl(
 #if defined(SODIUM_NO_CXX11)
@@ -483,15 +531,16 @@ namespace sodium {
 #if !defined(SODIUM_SINGLE_THREADED)
                         trans->part->mx.lock();
 #endif
-                        if (n->link(h.get(), target))
+                        if (n->link(h, target))
                             trans->to_regen = true;
 #if !defined(SODIUM_SINGLE_THREADED)
                         trans->part->mx.unlock();
 #endif
-                        if (!suppressEarlierFirings && n->firings.begin() != n->firings.end()) {
-                            SODIUM_FORWARD_LIST<light_ptr> firings = n->firings;
+                        if (!suppressEarlierFirings && !n->firings.empty()) {
+                            std::vector<light_ptr> firings = n->firings;
+                            // Replayed newest first.
                             trans->prioritized(target, [target, h, firings] (transaction_impl* trans) {
-                                for (SODIUM_FORWARD_LIST<light_ptr>::const_iterator it = firings.begin(); it != firings.end(); it++)
+                                for (std::vector<light_ptr>::const_reverse_iterator it = firings.rbegin(); it != firings.rend(); it++)
                                     h->handle(target, trans, *it);
                             });
                         }
@@ -511,6 +560,9 @@ namespace sodium {
                         return NULL;
                 }))
             );
+#endif
+#if defined(SODIUM_INTROSPECTION)
+            impl->introspect_node = n;
 #endif
             n->listen_impl = boost::intrusive_ptr<listen_impl_func<H_NODE> >(
                 reinterpret_cast<listen_impl_func<H_NODE>*>(impl.get()));
@@ -525,16 +577,65 @@ namespace sodium {
 
         event_ event_sink_impl::construct()
         {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("sink");
             this->target = SODIUM_TUPLE_GET<1>(p);
             return SODIUM_TUPLE_GET<0>(p);
         }
 
         void event_sink_impl::send(transaction_impl* trans, const light_ptr& value) const
         {
+#if defined(SODIUM_LATENCY)
+            trans->sent(target);
+#endif
             sodium::impl::send(target, trans, value);
         }
 
+#if defined(SODIUM_INGRESS_QUEUE)
+        void event_sink_impl::send(partition* part, light_ptr value,
+                                   std::unique_ptr<std::promise<void> > done) const
+        {
+            bool nested = policy::get_global()->current_transaction(part) != NULL;
+            if (part->ingress.load(std::memory_order_relaxed) != ingress_off && !nested)
+                part->enqueue(target, std::move(value), std::move(done));
+            else {
+                transaction_ trans(part);
+                {
+                    // Let go of the value before the transaction closes, so that split()
+                    // can find it unique and move its elements out.
+                    light_ptr sent(std::move(value));
+                    send(trans.impl(), sent);
+                }
+                if (nested) {
+                    if (done)
+                        fulfil_at_end(trans.impl(), std::move(done));
+                    return;
+                }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                try {
+#endif
+                    trans.close();
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                }
+                catch (...) {
+                    // As through the ingress queue, the exception goes to the future.
+                    if (!done)
+                        throw;
+                    done->set_exception(std::current_exception());
+                    return;
+                }
+#endif
+                if (done)
+                    done->set_value();
+            }
+        }
+
+        bool event_sink_impl::queued(partition* part) const
+        {
+            return part->ingress.load(std::memory_order_relaxed) != ingress_off &&
+                policy::get_global()->current_transaction(part) == NULL;
+        }
+#endif
+
 #if defined(SODIUM_NO_CXX11)
         struct hold_update_task : i_lambda0<void> {
             hold_update_task(const SODIUM_SHARED_PTR<behavior_state>& state) : state(state) {}
@@ -585,6 +686,10 @@ namespace sodium {
                 SODIUM_SHARED_PTR<behavior_impl_concrete<behavior_state> > impl(
                     new behavior_impl_concrete<behavior_state>(input, state, std::shared_ptr<behavior_impl>())
                 );
+#if !defined(SODIUM_NO_CXX11)
+                // Weak, since impl owns the listener through kill.
+                SODIUM_WEAK_PTR<behavior_impl_concrete<behavior_state> > impl_weak(impl);
+#endif
                 impl->kill =
                     input.listen_raw(trans0, SODIUM_SHARED_PTR<node>(new node(SODIUM_IMPL_RANK_T_MAX)),
 #if defined(SODIUM_NO_CXX11)
@@ -593,7 +698,10 @@ namespace sodium {
                     )
 #else
                     new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
-                        [impl] (const std::shared_ptr<impl::node>& target, transaction_impl* trans, const light_ptr& ptr) {
+                        [impl_weak] (const std::shared_ptr<impl::node>& target, transaction_impl* trans, const light_ptr& ptr) {
+                            SODIUM_SHARED_PTR<behavior_impl_concrete<behavior_state> > impl = impl_weak.lock();
+                            if (!impl)
+                                return;
                             bool first = !impl->state.update;
                             impl->state.update = boost::optional<light_ptr>(ptr);
                             if (first)
@@ -614,6 +722,10 @@ namespace sodium {
             SODIUM_SHARED_PTR<behavior_impl_concrete<behavior_state_lazy> > impl(
                 new behavior_impl_concrete<behavior_state_lazy>(input, state, std::shared_ptr<behavior_impl>())
             );
+#if !defined(SODIUM_NO_CXX11)
+            // Weak, since impl owns the listener through kill.
+            SODIUM_WEAK_PTR<behavior_impl_concrete<behavior_state_lazy> > impl_weak(impl);
+#endif
             impl->kill =
                 input.listen_raw(trans0, SODIUM_SHARED_PTR<node>(new node(SODIUM_IMPL_RANK_T_MAX)),
 #if defined(SODIUM_NO_CXX11)
@@ -622,7 +734,10 @@ namespace sodium {
                 )
 #else
                 new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
-                    [impl] (const std::shared_ptr<impl::node>& target, transaction_impl* trans, const light_ptr& ptr) {
+                    [impl_weak] (const std::shared_ptr<impl::node>& target, transaction_impl* trans, const light_ptr& ptr) {
+                        SODIUM_SHARED_PTR<behavior_impl_concrete<behavior_state_lazy> > impl = impl_weak.lock();
+                        if (!impl)
+                            return;
                         bool first = !impl->state.update;
                         impl->state.update = boost::optional<light_ptr>(ptr);
                         if (first)
@@ -655,7 +770,7 @@ namespace sodium {
 
         event_ behavior_::value_(transaction_impl* trans) const
         {
-            SODIUM_TUPLE<event_,SODIUM_SHARED_PTR<node> > p = unsafe_new_event();
+            SODIUM_TUPLE<event_,SODIUM_SHARED_PTR<node> > p = unsafe_new_event("value");
             const event_& eSpark = std::get<0>(p);
             const SODIUM_SHARED_PTR<node>& node = std::get<1>(p);
             send(node, trans, light_ptr::create<unit>(unit()));
@@ -729,9 +844,9 @@ namespace sodium {
                     SODIUM_SHARED_PTR<applicative_state> state(new applicative_state);
 
                     SODIUM_SHARED_PTR<impl::node> in_target(new impl::node);
-                    SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+                    SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("apply");
                     const SODIUM_SHARED_PTR<impl::node>& out_target = SODIUM_TUPLE_GET<1>(p);
-                    char* h = new char;
+                    SODIUM_SHARED_PTR<holder> h(new holder(NULL));
                     if (in_target->link(h, out_target))
                         trans0->to_regen = true;
 #if defined(SODIUM_NO_CXX11)
@@ -765,8 +880,7 @@ namespace sodium {
                                 }
                             ), false);
                     auto kill3 = new std::function<void()>([in_target, h] () {
-                        in_target->unlink(h);
-                        delete h;
+                        in_target->unlink(h.get());
                     });
 #endif
                     return SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(kill1, kill2, kill3).hold_lazy_(
@@ -795,7 +909,7 @@ namespace sodium {
         event_ event_::add_cleanup_(transaction_impl* trans, std::function<void()>* cleanup) const
 #endif
         {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("add_cleanup");
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* kill = listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
                 new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>(
@@ -831,17 +945,17 @@ namespace sodium {
 #endif
             const event_& ev)
         {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("map");
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* kill = ev.listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
                 new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>(
-                    new map_handler(f)), false);
+                    new map_handler(f)), false, true);
 #else
             auto kill = ev.listen_raw(trans, std::get<1>(p),
                     new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
                         [f] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) {
                             send(target, trans, f(ptr));
-                        }), false);
+                        }), false, true);
 #endif
             return SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(kill);
         }
@@ -903,7 +1017,7 @@ namespace sodium {
 
         event_ switch_e(transaction_impl* trans0, const behavior_& bea)
         {
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = unsafe_new_event("switch_e");
             const SODIUM_SHARED_PTR<impl::node>& target = SODIUM_TUPLE_GET<1>(p);
 #if defined(SODIUM_NO_CXX11)
             SODIUM_SHARED_PTR<lambda0<void>*> pKillInner(new lambda0<void>*(NULL));
@@ -970,7 +1084,7 @@ namespace sodium {
 #else
             SODIUM_SHARED_PTR<function<void()>*> pKillInner(new function<void()>*(NULL));
 #endif
-            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = unsafe_new_event();
+            SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = unsafe_new_event("switch_b");
             auto out_target = SODIUM_TUPLE_GET<1>(p);
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* killOuter =
@@ -1011,7 +1125,7 @@ namespace sodium {
         event_ filter_optional_(transaction_impl* trans, const event_& input,
             const std::function<boost::optional<light_ptr>(const light_ptr&)>& f)
         {
-            auto p = impl::unsafe_new_event();
+            auto p = impl::unsafe_new_event("filter_optional");
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* kill = input.listen_raw(trans, SODIUM_TUPLE_GET<1>(p),
                 new lambda3<void, const boost::shared_ptr<sodium::impl::node>&, sodium::impl::transaction_impl*, const sodium::light_ptr&>(
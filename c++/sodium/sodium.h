@@ -10,6 +10,7 @@
 #include <sodium/light_ptr.h>
 #include <sodium/transaction.h>
 #include <functional>
+#include <type_traits>
 #include <boost/optional.hpp>
 #include <memory>
 #include <list>
@@ -20,6 +21,12 @@
 #include <stdexcept>
 #endif
 #include <vector>
+#if !defined(SODIUM_NO_CXX11)
+#include <tuple>
+#endif
+#if defined(SODIUM_COMMITTED_READS)
+#include <thread>
+#endif
 
 #define SODIUM_CONSTANT_OPTIMIZATION
 
@@ -33,6 +40,10 @@ namespace sodium {
     template <class A, class P> class behavior_sink;
     template <class A, class P> class behavior_loop;
     template <class A, class P> class event_loop;
+    template <class S, class P> class pipeline;
+#if defined(SODIUM_INTROSPECTION)
+    class graph_walk;
+#endif
     template <class A, class B, class P EQ_DEF_PART>
 #if defined(SODIUM_NO_CXX11)
     behavior<B, P> apply(const behavior<lambda1<B,const A&>, P>& bf, const behavior<A, P>& ba);
@@ -47,6 +58,8 @@ namespace sodium {
     event<A, P> switch_e(const behavior<event<A, P>, P>& bea);
     template <class P EQ_DEF_PART, class T>
     behavior<typename T::time, P> clock(const T& t);
+    template <class A, class P, class Q>
+    event<A, Q> cross(const event<A, P>& e);
 
     namespace impl {
 
@@ -105,7 +118,8 @@ namespace sodium {
         protected:
 
             /*!
-             * listen to events.
+             * listen to events. Pass pure = true if handle does nothing but send to
+             * target, as with map and filter; see holder::is_pure().
              */
 #if defined(SODIUM_NO_CXX11)
             lambda0<void>* listen_raw(
@@ -119,7 +133,8 @@ namespace sodium {
 #else
                         std::function<void(const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&)>* handle,
 #endif
-                        bool suppressEarlierFirings) const;
+                        bool suppressEarlierFirings,
+                        bool pure = false) const;
 
             /*!
              * This is far more efficient than add_cleanup because it modifies the event
@@ -135,7 +150,7 @@ namespace sodium {
                     reinterpret_cast<listen_impl_func<H_STRONG>*>(p_listen_impl.get()));
                 if (cleanup != NULL) {
                     if (alive(li))
-                        li->cleanups.push_front(cleanup);
+                        li->add_cleanup(cleanup);
                     else {
                         (*cleanup)();
                         delete cleanup;
@@ -158,7 +173,7 @@ namespace sodium {
                     reinterpret_cast<listen_impl_func<H_STRONG>*>(p_listen_impl.get()));
                 if (cleanup1 != NULL) {
                     if (alive(li))
-                        li->cleanups.push_front(cleanup1);
+                        li->add_cleanup(cleanup1);
                     else {
                         (*cleanup1)();
                         delete cleanup1;
@@ -166,7 +181,7 @@ namespace sodium {
                 }
                 if (cleanup2 != NULL) {
                     if (alive(li))
-                        li->cleanups.push_front(cleanup2);
+                        li->add_cleanup(cleanup2);
                     else {
                         (*cleanup2)();
                         delete cleanup2;
@@ -189,7 +204,7 @@ namespace sodium {
                     reinterpret_cast<listen_impl_func<H_STRONG>*>(p_listen_impl.get()));
                 if (cleanup1 != NULL) {
                     if (alive(li))
-                        li->cleanups.push_front(cleanup1);
+                        li->add_cleanup(cleanup1);
                     else {
                         (*cleanup1)();
                         delete cleanup1;
@@ -197,7 +212,7 @@ namespace sodium {
                 }
                 if (cleanup2 != NULL) {
                     if (alive(li))
-                        li->cleanups.push_front(cleanup2);
+                        li->add_cleanup(cleanup2);
                     else {
                         (*cleanup2)();
                         delete cleanup2;
@@ -205,7 +220,7 @@ namespace sodium {
                 }
                 if (cleanup3 != NULL) {
                     if (alive(li))
-                        li->cleanups.push_front(cleanup3);
+                        li->add_cleanup(cleanup3);
                     else {
                         (*cleanup3)();
                         delete cleanup3;
@@ -287,12 +302,13 @@ namespace sodium {
         void send(const SODIUM_SHARED_PTR<node>& n, transaction_impl* trans, const light_ptr& ptr);
 
         /*!
-         * Creates an event, that values can be pushed into using impl::send(). 
+         * Creates an event, that values can be pushed into using impl::send(). kind
+         * names the operator making it, for introspection.
          */
         SODIUM_TUPLE<
                 event_,
                 SODIUM_SHARED_PTR<node>
-            > unsafe_new_event();
+            > unsafe_new_event(const char* kind = "event");
 
         struct behavior_impl {
             behavior_impl();
@@ -303,6 +319,11 @@ namespace sodium {
 
             virtual const light_ptr& sample() const = 0;
             virtual const light_ptr& newValue() const = 0;
+            /*!
+             * Get the value as of the last committed transaction without needing one,
+             * if that can be done. It's safe to call from any thread.
+             */
+            virtual bool sample_committed(light_ptr& out) const { return false; }
 
             event_ updates;  // Having this here allows references to behavior to keep the
                              // underlying event's cleanups alive, and provides access to the
@@ -336,6 +357,7 @@ namespace sodium {
             light_ptr k;
             virtual const light_ptr& sample() const { return k; }
             virtual const light_ptr& newValue() const { return k; }
+            virtual bool sample_committed(light_ptr& out) const { out = k; return true; }
         };
 
         template <class state_t>
@@ -352,6 +374,7 @@ namespace sodium {
 
             virtual const light_ptr& sample() const { return state.sample(); }
             virtual const light_ptr& newValue() const { return state.newValue(); }
+            virtual bool sample_committed(light_ptr& out) const { return state.sample_committed(out); }
         };
 
         struct behavior_impl_loop : behavior_impl {
@@ -372,8 +395,16 @@ namespace sodium {
 
             virtual const light_ptr& sample() const { assertLooped(); return (*pLooped)->sample(); }
             virtual const light_ptr& newValue() const { assertLooped(); return (*pLooped)->newValue(); }
+            virtual bool sample_committed(light_ptr& out) const {
+                return *pLooped && (*pLooped)->sample_committed(out);
+            }
         };
 
+        /*!
+         * current is only changed under its lock from lock_pool, so that
+         * sample_committed() can read it from any thread. The old value is released
+         * after the lock, since that can run a destructor.
+         */
         struct behavior_state {
             behavior_state(const light_ptr& initA) : current(initA) {}
             light_ptr current;
@@ -381,29 +412,59 @@ namespace sodium {
             const light_ptr& sample() const { return current; }
             const light_ptr& newValue() const { return update ? update.get() : current; }
             void finalize() {
-                current = update.get();
+                light_ptr next = update.get();
                 update = boost::optional<light_ptr>();
+                spin_lock* l = spin_get_and_lock(this);
+                std::swap(current, next);
+                l->unlock();
+            }
+            bool sample_committed(light_ptr& out) const {
+                spin_lock* l = spin_get_and_lock(const_cast<behavior_state*>(this));
+                out = current;
+                l->unlock();
+                return true;
             }
         };
 
         struct behavior_state_lazy {
             behavior_state_lazy(const std::function<light_ptr()>& initA)
             : pInitA(new std::function<light_ptr()>(initA)) {}
-            std::function<light_ptr()>* pInitA;
+            /*!
+             * Shared, since the state is copied, and dropped once it has been called,
+             * or when the behavior goes if it never is.
+             */
+            SODIUM_SHARED_PTR<std::function<light_ptr()> > pInitA;
             boost::optional<light_ptr> current;
             boost::optional<light_ptr> update;
             const light_ptr& sample() const {
                 if (!current) {
-                    const_cast<behavior_state_lazy*>(this)->current = boost::optional<light_ptr>((*pInitA)());
-                    delete pInitA;
-                    const_cast<behavior_state_lazy*>(this)->pInitA = NULL;
+                    boost::optional<light_ptr> initA((*pInitA)());
+                    const_cast<behavior_state_lazy*>(this)->pInitA.reset();
+                    spin_lock* l = spin_get_and_lock(const_cast<behavior_state_lazy*>(this));
+                    std::swap(const_cast<behavior_state_lazy*>(this)->current, initA);
+                    l->unlock();
                 }
                 return current.get();
             }
             const light_ptr& newValue() const { return update ? update.get() : sample(); }
             void finalize() {
-                current = update;
+                boost::optional<light_ptr> next = update;
                 update = boost::optional<light_ptr>();
+                spin_lock* l = spin_get_and_lock(this);
+                std::swap(current, next);
+                l->unlock();
+            }
+            /*!
+             * Fails if the initial value hasn't been worked out yet, since that needs a
+             * transaction.
+             */
+            bool sample_committed(light_ptr& out) const {
+                spin_lock* l = spin_get_and_lock(const_cast<behavior_state_lazy*>(this));
+                bool known = (bool)current;
+                if (known)
+                    out = current.get();
+                l->unlock();
+                return known;
             }
         };
 
@@ -438,7 +499,19 @@ namespace sodium {
         template <class S>
         struct collect_state {
             collect_state(const std::function<S()>& s_lazy) : s_lazy(s_lazy) {}
+            /*!
+             * Gives the initial state. After that the state is kept in s, so it can be
+             * replaced without copying it, and accum can share it with its output.
+             */
             std::function<S()> s_lazy;
+            light_ptr s;
+            const S& get() {
+                if (s.value == NULL) {
+                    s = light_ptr::create<S>(s_lazy());
+                    s_lazy = std::function<S()>();
+                }
+                return *s.cast_ptr<S>(NULL);
+            }
         };
 
 #if defined(SODIUM_NO_CXX11)
@@ -494,6 +567,10 @@ namespace sodium {
         friend event<AA, PP> switch_e(const behavior<event<AA, PP>, PP>& bea);
         template <class PP, class TT>
         friend behavior<typename TT::time,PP> clock(const TT& t);
+        template <class SS, class PP> friend class pipeline;
+#if defined(SODIUM_INTROSPECTION)
+        friend class graph_walk;
+#endif
         private:
             behavior(const SODIUM_SHARED_PTR<impl::behavior_impl>& impl)
                 : impl::behavior_(impl)
@@ -526,6 +603,20 @@ namespace sodium {
                 return *impl->sample().template cast_ptr<A>(NULL);
             }
 
+            /*!
+             * Sample the value as of the last transaction committed on the partition,
+             * from any thread, without taking the partition's lock, so it doesn't wait
+             * for a transaction that's running. A behavior whose value hasn't been worked
+             * out yet, such as one made by map() that hasn't changed since, falls back
+             * to sample().
+             */
+            A sample_committed() const {
+                light_ptr a;
+                if (impl->sample_committed(a))
+                    return *a.template cast_ptr<A>(NULL);
+                return sample();
+            }
+
             std::function<A()> sample_lazy() const {
                 const SODIUM_SHARED_PTR<impl::behavior_impl>& impl(this->impl);
                 return [impl] () -> A {
@@ -621,7 +712,7 @@ namespace sodium {
                 SODIUM_SHARED_PTR<impl::collect_state<S> > pState(new impl::collect_state<S>([zbs] () -> S {
                     return SODIUM_TUPLE_GET<1>(zbs());
                 }));
-                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("collect");
 #if defined(SODIUM_NO_CXX11)
                 lambda0<void>* kill = updates().listen_raw(trans.impl(), SODIUM_TUPLE_GET<1>(p),
                     new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&>(
@@ -631,10 +722,9 @@ namespace sodium {
                 auto kill = updates().listen_raw(trans.impl(), SODIUM_TUPLE_GET<1>(p),
                     new std::function<void(const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                         [pState, f] (const SODIUM_SHARED_PTR<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) {
-                            SODIUM_TUPLE<B,S> outsSt = f(*ptr.cast_ptr<A>(NULL), pState->s_lazy());
-                            const S& new_s = SODIUM_TUPLE_GET<1>(outsSt);
-                            pState->s_lazy = [new_s] () { return new_s; };
-                            send(target, trans, light_ptr::create<B>(SODIUM_TUPLE_GET<0>(outsSt)));
+                            SODIUM_TUPLE<B,S> outsSt = f(*ptr.cast_ptr<A>(NULL), pState->get());
+                            pState->s = light_ptr::create<S>(std::move(SODIUM_TUPLE_GET<1>(outsSt)));
+                            send(target, trans, light_ptr::create<B>(std::move(SODIUM_TUPLE_GET<0>(outsSt))));
                         }), false);
 #endif
                 return event<B, P>(SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(kill)).hold_lazy([zbs] () -> B {
@@ -735,6 +825,45 @@ namespace sodium {
     }
 #endif
 
+#if defined(SODIUM_TYPED_HANDLERS)
+    namespace impl {
+        /*!
+         * Handlers for event's map, filter and listen that take the value as an A and
+         * hold the caller's function as its own type F, so the compiler can inline it.
+         * F is mutable because handle() is const, and the caller's function may not
+         * be, as with a mutable lambda. A std::function it's given as has the same
+         * effect. A plain function is held as a pointer to it.
+         */
+        template <class A, class B, class F>
+        struct map_holder : holder {
+            map_holder(const F& f) : holder(NULL, true), f(f) {}
+            mutable typename std::decay<F>::type f;
+            virtual void handle(const SODIUM_SHARED_PTR<node>& target, transaction_impl* trans, const light_ptr& value) const {
+                send(target, trans, light_ptr::create<B>(B(f(*value.cast_ptr<A>(NULL)))));
+            }
+        };
+
+        template <class A, class F>
+        struct filter_holder : holder {
+            filter_holder(const F& pred) : holder(NULL, true), pred(pred) {}
+            mutable typename std::decay<F>::type pred;
+            virtual void handle(const SODIUM_SHARED_PTR<node>& target, transaction_impl* trans, const light_ptr& value) const {
+                if (pred(*value.cast_ptr<A>(NULL)))
+                    send(target, trans, value);
+            }
+        };
+
+        template <class A, class F>
+        struct listen_holder : holder {
+            listen_holder(const F& f) : holder(NULL), f(f) {}
+            mutable typename std::decay<F>::type f;
+            virtual void handle(const SODIUM_SHARED_PTR<node>&, transaction_impl*, const light_ptr& value) const {
+                f(*value.cast_ptr<A>(NULL));
+            }
+        };
+    }
+#endif
+
     template <class A, class P EQ_DEF_PART>
     class event : protected impl::event_ {
         template <class AA, class PP> friend class event;
@@ -746,7 +875,12 @@ namespace sodium {
         template <class AA, class PP> friend event<AA, PP> filter_optional(const event<boost::optional<AA>, PP>& input);
         template <class AA, class PP> friend event<AA, PP> switch_e(const behavior<event<AA, PP>, PP>& bea);
         template <class AA, class PP> friend event<AA, PP> split(const event<std::list<AA>, PP>& e);
+        template <class AA, class PP, class QQ> friend event<AA, QQ> cross(const event<AA, PP>& e);
         template <class AA, class PP> friend class sodium::event_loop;
+        template <class SS, class PP> friend class pipeline;
+#if defined(SODIUM_INTROSPECTION)
+        friend class graph_walk;
+#endif
         public:
             /*!
              * The 'never' event (that never fires).
@@ -754,27 +888,76 @@ namespace sodium {
             event() {}
         protected:
             event(const impl::event_& ev) : impl::event_(ev) {}
+#if defined(SODIUM_TYPED_HANDLERS)
+            /*!
+             * Make a new event fed by the typed handler h listening to this one.
+             */
+            impl::event_ typed_listen_(impl::transaction_impl* trans, impl::holder* h, const char* kind) const {
+                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event(kind);
+                std::function<void()>* kill = listen_impl(trans, std::get<1>(p), SODIUM_SHARED_PTR<impl::holder>(h), false);
+                return std::get<0>(p).unsafe_add_cleanup(kill);
+            }
+#endif
         public:
             /*!
              * High-level interface to obtain an event's value.
              */
 #if defined(SODIUM_NO_CXX11)
             lambda0<void> listen(const lambda1<void, const A&>& handle) const {
+#elif defined(SODIUM_TYPED_HANDLERS)
+            template <class F>
+            std::function<void()> listen(const F& handle) const {
 #else
             std::function<void()> listen(const std::function<void(const A&)>& handle) const {
 #endif
-                transaction<P> trans;
+                return listen_to_(handle, SODIUM_SHARED_PTR<impl::node>(new impl::node(SODIUM_IMPL_RANK_T_MAX)));
+            }
+
+#if defined(SODIUM_LATENCY)
+            /*!
+             * listen(), recording the time from each send to handle being called in the
+             * histogram named latency_name. See sodium/latency.h.
+             */
 #if defined(SODIUM_NO_CXX11)
-                lambda0<void>* pKill = listen_raw(trans.impl(),
+            lambda0<void> listen(const lambda1<void, const A&>& handle, const std::string& latency_name) const {
+#elif defined(SODIUM_TYPED_HANDLERS)
+            template <class F>
+            std::function<void()> listen(const F& handle, const std::string& latency_name) const {
 #else
-                std::function<void()>* pKill = listen_raw(trans.impl(),
+            std::function<void()> listen(const std::function<void(const A&)>& handle,
+                                         const std::string& latency_name) const {
 #endif
-                    SODIUM_SHARED_PTR<impl::node>(new impl::node(SODIUM_IMPL_RANK_T_MAX)),
+                SODIUM_SHARED_PTR<impl::node> n(new impl::node(SODIUM_IMPL_RANK_T_MAX));
+                n->latency = impl::latency_named(latency_name);
+                return listen_to_(handle, n);
+            }
+#endif
+
+        protected:
+            /*!
+             * listen() with the listener node n.
+             */
 #if defined(SODIUM_NO_CXX11)
+            lambda0<void> listen_to_(const lambda1<void, const A&>& handle,
+                                     const SODIUM_SHARED_PTR<impl::node>& n) const {
+#elif defined(SODIUM_TYPED_HANDLERS)
+            template <class F>
+            std::function<void()> listen_to_(const F& handle, const SODIUM_SHARED_PTR<impl::node>& n) const {
+#else
+            std::function<void()> listen_to_(const std::function<void(const A&)>& handle,
+                                             const SODIUM_SHARED_PTR<impl::node>& n) const {
+#endif
+                transaction<P> trans;
+#if defined(SODIUM_TYPED_HANDLERS)
+                std::function<void()>* pKill = listen_impl(trans.impl(), n,
+                    SODIUM_SHARED_PTR<impl::holder>(new impl::listen_holder<A, typename std::decay<F>::type>(handle)), false);
+#elif defined(SODIUM_NO_CXX11)
+                lambda0<void>* pKill = listen_raw(trans.impl(), n,
                     new lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&>(
                         new impl::listen_wrap<A>(handle)
                     ), false);
 #else
+                std::function<void()>* pKill = listen_raw(trans.impl(), n,
                     new std::function<void(const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                         [handle] (const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl* trans, const light_ptr& ptr) {
                             handle(*ptr.cast_ptr<A>(NULL));
@@ -797,10 +980,18 @@ namespace sodium {
 #endif
             };
 
+        public:
             /*!
              * Map a function over this event to modify the output value. The function must be
              * pure (referentially transparent), that is, it must not have effects.
              */
+#if defined(SODIUM_TYPED_HANDLERS)
+            template <class B, class F>
+            event<B, P> map(const F& f) const {
+                transaction<P> trans;
+                return event<B, P>(typed_listen_(trans.impl(), new impl::map_holder<A, B, typename std::decay<F>::type>(f), "map"));
+            }
+#else
             template <class B>
 #if defined(SODIUM_NO_CXX11)
             event<B, P> map(const lambda1<B, const A&>& f) const {
@@ -810,6 +1001,7 @@ namespace sodium {
                 transaction<P> trans;
                 return event<B, P>(impl::map_(trans.impl(), SODIUM_DETYPE_FUNCTION1(A,B,f), *this));
             }
+#endif
 
             /*!
              * Map a function over this event to modify the output value. Effects are allowed.
@@ -912,6 +1104,14 @@ namespace sodium {
              * Filter this event based on the specified predicate, passing through values
              * where the predicate returns true.
              */
+#if defined(SODIUM_TYPED_HANDLERS)
+            template <class F>
+            event<A, P> filter(const F& pred) const
+            {
+                transaction<P> trans;
+                return event<A, P>(typed_listen_(trans.impl(), new impl::filter_holder<A, typename std::decay<F>::type>(pred), "filter"));
+            }
+#else
 #if defined(SODIUM_NO_CXX11)
             event<A, P> filter(const lambda1<bool, const A&>& pred) const
 #else
@@ -929,6 +1129,7 @@ namespace sodium {
 #endif
                   ));
             }
+#endif
 
             /*!
              * Create a behavior that holds at any given time the most recent value
@@ -1029,7 +1230,7 @@ namespace sodium {
             {
                 transaction<P> trans;
                 SODIUM_SHARED_PTR<impl::collect_state<S> > pState(new impl::collect_state<S>(initS));
-                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("collect");
 #if defined(SODIUM_NO_CXX11)
                 lambda0<void>* kill = listen_raw(trans.impl(), SODIUM_TUPLE_GET<1>(p),
                     new impl::collect_handler<A,S,B>(pState, f), false);
@@ -1037,10 +1238,9 @@ namespace sodium {
                 auto kill = listen_raw(trans.impl(), std::get<1>(p),
                     new std::function<void(const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                         [pState, f] (const SODIUM_SHARED_PTR<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) {
-                            auto outsSt = f(*ptr.cast_ptr<A>(NULL), pState->s_lazy());
-                            const S& new_s = SODIUM_TUPLE_GET<1>(outsSt);
-                            pState->s_lazy = [new_s] () { return new_s; };
-                            send(target, trans, light_ptr::create<B>(std::get<0>(outsSt)));
+                            auto outsSt = f(*ptr.cast_ptr<A>(NULL), pState->get());
+                            pState->s = light_ptr::create<S>(std::move(std::get<1>(outsSt)));
+                            send(target, trans, light_ptr::create<B>(std::move(std::get<0>(outsSt))));
                         }), false);
 #endif
                 return SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(kill);
@@ -1075,7 +1275,7 @@ namespace sodium {
             {
                 transaction<P> trans;
                 SODIUM_SHARED_PTR<impl::collect_state<B> > pState(new impl::collect_state<B>(initB));
-                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("accum");
 #if defined(SODIUM_NO_CXX11)
                 lambda0<void>* kill = listen_raw(trans.impl(), SODIUM_TUPLE_GET<1>(p),
                     new impl::accum_handler<A,B>(pState, f)
@@ -1083,9 +1283,10 @@ namespace sodium {
                 auto kill = listen_raw(trans.impl(), SODIUM_TUPLE_GET<1>(p),
                     new std::function<void(const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                         [pState, f] (const SODIUM_SHARED_PTR<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) {
-                            B b = f(*ptr.cast_ptr<A>(NULL), pState->s_lazy());
-                            pState->s_lazy = [b] () { return b; };
-                            send(target, trans, light_ptr::create<B>(b));
+                            // The new state is also the output value, so share it.
+                            light_ptr b = light_ptr::create<B>(f(*ptr.cast_ptr<A>(NULL), pState->get()));
+                            pState->s = b;
+                            send(target, trans, b);
                         })
 #endif
                     , false);
@@ -1176,10 +1377,38 @@ namespace sodium {
             event_sink_impl();
             event_ construct();
             void send(transaction_impl* trans, const light_ptr& ptr) const;
+#if defined(SODIUM_INGRESS_QUEUE)
+            /*!
+             * Send in a transaction of its own, or through the partition's ingress queue
+             * if it has one and this thread isn't in a transaction on it already. done,
+             * if given, is fulfilled once that transaction has been processed.
+             */
+            void send(partition* part, light_ptr ptr,
+                      std::unique_ptr<std::promise<void> > done = std::unique_ptr<std::promise<void> >()) const;
+            /*!
+             * True if sends to part from this thread go through the partition's
+             * ingress queue, as it has one and this thread isn't in a transaction on it.
+             */
+            bool queued(partition* part) const;
+#endif
             SODIUM_SHARED_PTR<impl::node> target;
         };
     }
 
+    /*!
+     * How send_many() delivers its values.
+     */
+    enum send_many_mode {
+        /*!
+         * Each value in a transaction of its own, as if by separate send() calls.
+         */
+        separate_transactions,
+        /*!
+         * All the values as simultaneous firings in a single transaction.
+         */
+        one_transaction
+    };
+
     /*!
      * An event with a send() method to allow values to be pushed into it
      * from the imperative world.
@@ -1187,6 +1416,8 @@ namespace sodium {
     template <class A, class P EQ_DEF_PART>
     class event_sink : public event<A, P>
     {
+        template <class AA, class PP, class QQ>
+        friend event<AA, QQ> cross(const event<AA, PP>& e);
         private:
             impl::event_sink_impl impl;
             event_sink(const impl::event_& e) : event<A, P>(e) {}
@@ -1197,14 +1428,88 @@ namespace sodium {
                 *reinterpret_cast<event<A,P>*>(this) = impl.construct();
             }
 
+#if defined(SODIUM_LATENCY)
+            /*!
+             * A sink that records the time from each send until the listeners it
+             * reaches have run in the histogram named latency_name. See
+             * sodium/latency.h.
+             */
+            explicit event_sink(const std::string& latency_name)
+            {
+                *reinterpret_cast<event<A,P>*>(this) = impl.construct();
+                impl.target->latency = impl::latency_named(latency_name);
+            }
+#endif
+
             void send(const A& a) const {
+#if defined(SODIUM_INGRESS_QUEUE)
+                impl.send(P::part(), light_ptr::create<A>(a));
+#else
                 transaction<P> trans;
                 impl.send(trans.impl(), light_ptr::create<A>(a));
+#endif
             }
 
             void send(A&& a) const {
+#if defined(SODIUM_INGRESS_QUEUE)
+                impl.send(P::part(), light_ptr::create<A>(std::move(a)));
+#else
                 transaction<P> trans;
                 impl.send(trans.impl(), light_ptr::create<A>(std::move(a)));
+#endif
+            }
+
+#if defined(SODIUM_INGRESS_QUEUE)
+            /*!
+             * Send, and return a future that becomes ready once the transaction that
+             * carries the value has been processed. Where send() only queues the value,
+             * as it does from other threads under executor_policy, this is the way to
+             * wait for it.
+             */
+            std::future<void> send_async(const A& a) const {
+                std::unique_ptr<std::promise<void> > done(new std::promise<void>);
+                std::future<void> f = done->get_future();
+                impl.send(P::part(), light_ptr::create<A>(a), std::move(done));
+                return f;
+            }
+#endif
+
+            /*!
+             * Send the values in [first, last). Unlike a loop of send() calls, the
+             * partition is locked once for the whole range, and the transaction
+             * set-up is shared. Pass std::move_iterators to move the values in.
+             * If this thread is already in a transaction on the partition, the
+             * values all fire in that transaction whatever the mode.
+             *
+             * If the partition has an ingress queue, the values are queued as one lot,
+             * so a thread's send() and send_many() calls arrive in the order it made
+             * them.
+             */
+            template <class It>
+            void send_many(It first, It last, send_many_mode mode = separate_transactions) const
+            {
+#if defined(SODIUM_INGRESS_QUEUE)
+                if (impl.queued(P::part())) {
+                    // Behind what this thread has already queued, so they stay in order.
+                    std::vector<light_ptr> values;
+                    for (; first != last; ++first)
+                        values.push_back(light_ptr::create<A>(*first));
+                    P::part()->enqueue(impl.target, std::move(values), mode == one_transaction);
+                    return;
+                }
+#endif
+                if (mode == one_transaction) {
+                    transaction<P> trans;
+                    for (; first != last; ++first)
+                        impl.send(trans.impl(), light_ptr::create<A>(*first));
+                }
+                else {
+                    impl::transaction_series series(P::part());
+                    for (; first != last; ++first) {
+                        impl.send(series.begin(), light_ptr::create<A>(*first));
+                        series.commit();
+                    }
+                }
             }
     };
 
@@ -1241,15 +1546,33 @@ namespace sodium {
         event_sink<A, Q> s;
 #if defined(SODIUM_NO_CXX11)
         lambda0<void> kill = e.listen(new impl::cross_handler<A, P, Q>(s));
+        return s.add_cleanup(kill);
 #else
-        auto kill = e.listen([s] (const A& a) {
-            transaction<P> trans;
-            trans.impl()->part->post([s, a] () {
-                s.send(a);
-            });
-        });
+        // Pass the value across as the same light_ptr, so it isn't copied.
+        std::function<void()>* pKill = e.listen_raw(trans.impl(),
+            SODIUM_SHARED_PTR<impl::node>(new impl::node(SODIUM_IMPL_RANK_T_MAX)),
+            new std::function<void(const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
+                [s] (const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl* trans, const light_ptr& ptr) {
+                    // After this transaction has committed, in the order of the posts.
+                    trans->part->post([s, ptr] () {
+#if defined(SODIUM_INGRESS_QUEUE)
+                        // Queueing for Q's executor can't block, so no lock is taken.
+                        partition* q = Q::part();
+                        if (q->exec.load(std::memory_order_acquire) != NULL) {
+                            q->enqueue(s.impl.target, ptr);
+                            return;
+                        }
 #endif
+                        transaction<Q> trans;
+                        s.impl.send(trans.impl(), ptr);
+                    });
+                }), false);
+        if (pKill == NULL)
+            return s;
+        std::function<void()> kill(std::move(*pKill));
+        delete pKill;
         return s.add_cleanup(kill);
+#endif
     }
 
     /*!
@@ -1320,6 +1643,18 @@ namespace sodium {
                 this->impl = SODIUM_SHARED_PTR<impl::behavior_impl>(hold(trans.impl(), light_ptr::create<A>(std::move(initA)), e));
             }
 
+#if defined(SODIUM_LATENCY)
+            /*!
+             * A sink whose sends are timed as with event_sink(latency_name).
+             */
+            behavior_sink(const A& initA, const std::string& latency_name)
+                : e(latency_name)
+            {
+                transaction<P> trans;
+                this->impl = SODIUM_SHARED_PTR<impl::behavior_impl>(hold(trans.impl(), light_ptr::create<A>(initA), e));
+            }
+#endif
+
             void send(const A& a) const
             {
                 e.send(a);
@@ -1329,6 +1664,16 @@ namespace sodium {
             {
                 e.send(std::move(a));
             }
+
+            /*!
+             * Set the behavior to each of the values in [first, last) in turn. See
+             * event_sink::send_many(). With one_transaction, the last value wins.
+             */
+            template <class It>
+            void send_many(It first, It last, send_many_mode mode = separate_transactions) const
+            {
+                e.send_many(first, last, mode);
+            }
     };
 
     namespace impl {
@@ -1460,7 +1805,7 @@ namespace sodium {
 #endif
                 SODIUM_SHARED_PTR<info> i(new info(pKill));
 
-                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+                SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("loop");
                 i->target = SODIUM_TUPLE_GET<1>(p);
                 *this = event_loop<A, P>(
                     SODIUM_TUPLE_GET<0>(p).unsafe_add_cleanup(
@@ -1583,6 +1928,36 @@ namespace sodium {
         return behavior<A, P>(impl::switch_b(trans.impl(), bba));
     }
 
+#if !defined(SODIUM_NO_CXX11)
+    /*!
+     * Sample several behaviors of one partition as they were after the same
+     * committed transaction, from any thread. Like behavior::sample_committed(),
+     * this doesn't take the partition's lock, but it retries if a transaction
+     * commits while it's reading.
+     */
+    template <class P, class... As>
+    std::tuple<As...> sample_committed(const behavior<As, P>&... bs)
+    {
+#if defined(SODIUM_COMMITTED_READS)
+        partition* part = P::part();
+        // Inside a transaction the values can't change under us.
+        if (policy::get_global()->current_transaction(part) == NULL) {
+            while (true) {
+                unsigned long seq = part->commit_seq.load(std::memory_order_acquire);
+                if ((seq & 1) == 0) {
+                    std::tuple<As...> values(bs.sample_committed()...);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (part->commit_seq.load(std::memory_order_relaxed) == seq)
+                        return values;
+                }
+                std::this_thread::yield();
+            }
+        }
+#endif
+        return std::tuple<As...>(bs.sample()...);
+    }
+#endif
+
 #if defined(SODIUM_NO_CXX11)
     namespace impl {
         template <class A, class B, class C>
@@ -1929,7 +2304,7 @@ namespace sodium {
     template <class A, class P>
     event<A, P> split(const event<std::list<A>, P>& e)
     {
-        SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event();
+        SODIUM_TUPLE<impl::event_,SODIUM_SHARED_PTR<impl::node> > p = impl::unsafe_new_event("split");
         transaction<P> trans;
 #if defined(SODIUM_NO_CXX11)
         lambda0<void>* kill = e.listen_raw(trans.impl(), SODIUM_TUPLE_GET<1>(p),
@@ -1940,11 +2315,18 @@ namespace sodium {
         auto kill = e.listen_raw(trans.impl(), std::get<1>(p),
             new std::function<void(const SODIUM_SHARED_PTR<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                 [] (const SODIUM_SHARED_PTR<impl::node>& target, impl::transaction_impl* trans, const light_ptr& ptr) {
-                    const std::list<A>& la = *ptr.cast_ptr<std::list<A>>(NULL);
-                    trans->part->post([la, target] () {
+                    light_ptr plist(ptr);
+                    trans->part->post([plist, target] () mutable {
+                        // The list's transaction is over by now, so if nothing else holds
+                        // it, its elements can be moved out instead of copied.
+                        std::list<A>& la = *plist.cast_ptr<std::list<A>>(NULL);
+                        bool sole = plist.unique();
                         for (auto it = la.begin(); it != la.end(); ++it) {
                             transaction<P> trans;
-                            send(target, trans.impl(), light_ptr::create<A>(*it));
+                            if (sole)
+                                send(target, trans.impl(), light_ptr::create<A>(std::move(*it)));
+                            else
+                                send(target, trans.impl(), light_ptr::create<A>(*it));
                         }
                     });
                 })
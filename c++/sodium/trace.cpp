@@ -0,0 +1,251 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/trace.h>
+
+#if defined(SODIUM_TRACING)
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+namespace sodium {
+
+    namespace impl {
+        namespace {
+            /*!
+             * One thread's records, overwriting the oldest once it's full. Its thread
+             * writes to it while dumps read it, so both take its lock.
+             */
+            struct trace_ring {
+                trace_ring(unsigned tid, size_t capacity)
+                    : tid(tid), capacity(capacity), next(0), link(NULL) {}
+                spin_lock lock;
+                unsigned tid;
+                size_t capacity;
+                std::vector<trace_record> records;
+                size_t next;
+                trace_ring* link;
+            };
+
+            /*!
+             * Guards the list of rings and the settings.
+             */
+            spin_lock rings_lock;
+            trace_ring* rings = NULL;
+            unsigned ring_count = 0;
+            size_t ring_capacity = 65536;
+#if defined(SODIUM_SINGLE_THREADED)
+            unsigned long every = 0;
+            unsigned long seen = 0;
+            unsigned long last_id = 0;
+            trace_ring* this_ring = NULL;
+            unsigned long posting = 0;
+#elif !defined(SODIUM_NO_CXX11)
+            std::atomic<unsigned long> every(0);
+            std::atomic<unsigned long> seen(0);
+            std::atomic<unsigned long> last_id(0);
+            thread_local trace_ring* this_ring = NULL;
+            thread_local unsigned long posting = 0;
+#else
+            unsigned long every = 0;
+            unsigned long seen = 0;
+            unsigned long last_id = 0;
+            pthread_key_t ring_key;
+            pthread_key_t posting_key;
+            pthread_once_t keys_once = PTHREAD_ONCE_INIT;
+            void make_keys()
+            {
+                pthread_key_create(&ring_key, NULL);
+                pthread_key_create(&posting_key, NULL);
+            }
+#endif
+
+            trace_ring* get_ring()
+            {
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+                trace_ring* ring = this_ring;
+#else
+                pthread_once(&keys_once, make_keys);
+                trace_ring* ring = (trace_ring*)pthread_getspecific(ring_key);
+#endif
+                if (ring == NULL) {
+                    // Rings live for the rest of the program, so what a thread
+                    // recorded can still be dumped after it has finished.
+                    rings_lock.lock();
+                    ring = new trace_ring(++ring_count, ring_capacity);
+                    ring->link = rings;
+                    rings = ring;
+                    rings_lock.unlock();
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+                    this_ring = ring;
+#else
+                    pthread_setspecific(ring_key, ring);
+#endif
+                }
+                return ring;
+            }
+
+            /*!
+             * Decide whether to trace the transaction that's starting, returning its
+             * id if so, or 0.
+             */
+            unsigned long sample()
+            {
+#if defined(SODIUM_NO_CXX11) && !defined(SODIUM_SINGLE_THREADED)
+                rings_lock.lock();
+                unsigned long id = every != 0 && ++seen % every == 0 ? ++last_id : 0;
+                rings_lock.unlock();
+                return id;
+#else
+                unsigned long n = every;
+                if (n == 0)
+                    return 0;
+                return ++seen % n == 0 ? ++last_id : 0;
+#endif
+            }
+
+            struct with_tid {
+                trace_record r;
+                unsigned tid;
+            };
+
+            bool by_begin(const with_tid& a, const with_tid& b)
+            {
+                return a.r.begin_ns < b.r.begin_ns;
+            }
+        }
+
+        void trace(const trace_record& r)
+        {
+            trace_ring* ring = get_ring();
+            ring->lock.lock();
+            if (ring->records.size() < ring->capacity)
+                ring->records.push_back(r);
+            else
+                ring->records[ring->next] = r;
+            ring->next = (ring->next + 1) % ring->capacity;
+            ring->lock.unlock();
+        }
+
+        unsigned long trace_posting()
+        {
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            return posting;
+#else
+            pthread_once(&keys_once, make_keys);
+            return (unsigned long)pthread_getspecific(posting_key);
+#endif
+        }
+
+        void set_trace_posting(unsigned long id)
+        {
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            posting = id;
+#else
+            pthread_once(&keys_once, make_keys);
+            pthread_setspecific(posting_key, (void*)id);
+#endif
+        }
+
+        void transaction_impl::trace_start()
+        {
+            trace_id = sample();
+            trace_begin = trace_id != 0 ? monotonic_ns() : 0;
+        }
+    }
+
+    void set_tracing(unsigned long every, size_t capacity)
+    {
+        impl::rings_lock.lock();
+        impl::every = every;
+        if (capacity != 0 && capacity != impl::ring_capacity) {
+            impl::ring_capacity = capacity;
+            for (impl::trace_ring* ring = impl::rings; ring != NULL; ring = ring->link) {
+                ring->lock.lock();
+                ring->capacity = capacity;
+                ring->records.clear();
+                ring->next = 0;
+                ring->lock.unlock();
+            }
+        }
+        impl::rings_lock.unlock();
+    }
+
+    void clear_trace()
+    {
+        impl::rings_lock.lock();
+        for (impl::trace_ring* ring = impl::rings; ring != NULL; ring = ring->link) {
+            ring->lock.lock();
+            ring->records.clear();
+            ring->next = 0;
+            ring->lock.unlock();
+        }
+        impl::rings_lock.unlock();
+    }
+
+    std::string chrome_trace_json(unsigned long last_transactions)
+    {
+        std::vector<impl::with_tid> all;
+        impl::rings_lock.lock();
+        for (impl::trace_ring* ring = impl::rings; ring != NULL; ring = ring->link) {
+            ring->lock.lock();
+            for (size_t i = 0; i < ring->records.size(); i++) {
+                impl::with_tid w;
+                w.r = ring->records[i];
+                w.tid = ring->tid;
+                all.push_back(w);
+            }
+            ring->lock.unlock();
+        }
+        impl::rings_lock.unlock();
+
+        unsigned long newest = 0;
+        for (size_t i = 0; i < all.size(); i++)
+            newest = std::max(newest, all[i].r.transaction);
+        unsigned long oldest = last_transactions != 0 && newest > last_transactions
+            ? newest - last_transactions + 1 : 0;
+        std::sort(all.begin(), all.end(), impl::by_begin);
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (size_t i = 0; i < all.size(); i++) {
+            const impl::trace_record& r = all[i].r;
+            if (r.transaction < oldest)
+                continue;
+            if (!first)
+                out << ',';
+            first = false;
+            out << "\n{\"name\":\"" << r.name << "\",\"cat\":\"sodium\",\"ph\":\"X\""
+                << ",\"ts\":" << r.begin_ns / 1000.0
+                << ",\"dur\":" << (r.end_ns - r.begin_ns) / 1000.0
+                << ",\"pid\":1,\"tid\":" << all[i].tid
+                << ",\"args\":{\"transaction\":" << r.transaction
+                << ",\"partition\":\"" << (const void*)r.part << '"'
+                << ",\"queued\":" << r.queued;
+            if (r.rank != SODIUM_IMPL_RANK_T_MAX)
+                out << ",\"rank\":" << r.rank;
+            if (r.kind != NULL)
+                out << ",\"kind\":\"" << r.kind << '"';
+            out << "}}";
+        }
+        out << "\n]}\n";
+        return out.str();
+    }
+
+    bool write_chrome_trace(const std::string& path, unsigned long last_transactions)
+    {
+        std::ofstream file(path.c_str());
+        if (!file)
+            return false;
+        file << chrome_trace_json(last_transactions);
+        return file.good();
+    }
+}  // end namespace sodium
+#endif
@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_TRACE_H_
+#define _SODIUM_TRACE_H_
+
+#include <sodium/sodium.h>
+#include <string>
+
+#if defined(SODIUM_TRACING)
+namespace sodium {
+    /*!
+     * Trace one transaction in every 'every', on every partition, or none if it's 0,
+     * which is the default. For a traced transaction, each thread records spans for
+     * the whole transaction, its processing, each prioritized action (with its
+     * target's rank and operator), the actions at the end of the transaction, and
+     * the posts after it, into a buffer that keeps the most recent 'capacity' of
+     * them, so it works as a flight recorder. A capacity of 0 keeps the current
+     * one, which starts at 65536, and changing it empties the buffers.
+     */
+    void set_tracing(unsigned long every, size_t capacity = 0);
+
+    /*!
+     * The recorded spans from all threads as Chrome trace JSON, which Perfetto and
+     * chrome://tracing can load. If last_transactions isn't 0, only the most recent
+     * that many traced transactions are included, as when dumping after a latency
+     * spike.
+     */
+    std::string chrome_trace_json(unsigned long last_transactions = 0);
+
+    /*!
+     * Write chrome_trace_json() to a file, returning false if it couldn't be written.
+     */
+    bool write_chrome_trace(const std::string& path, unsigned long last_transactions = 0);
+
+    /*!
+     * Forget everything recorded so far.
+     */
+    void clear_trace();
+}  // end namespace sodium
+#endif
+
+#endif
@@ -5,6 +5,22 @@
  * C++ implementation courtesy of International Telematics Ltd.
  */
 #include <sodium/sodium.h>
+#include <algorithm>
+#if defined(SODIUM_METRICS) || defined(SODIUM_TRACING) || defined(SODIUM_PROFILING) || \
+    defined(SODIUM_LATENCY)
+#include <time.h>
+#endif
+#if defined(SODIUM_LATENCY)
+#include <sodium/latency.h>
+#endif
+#if defined(SODIUM_INGRESS_QUEUE) || defined(SODIUM_PARALLEL)
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#endif
 
 using namespace std;
 using namespace boost;
@@ -12,49 +28,159 @@ using namespace boost;
 namespace sodium {
 
     namespace impl {
-        
+
+#if defined(SODIUM_ATOMIC_COUNTS)
+        namespace {
+            /*!
+             * What has spilled out of each count_set, by unit, and the lock that goes
+             * with it. A count_set has an entry only while one of its overflow bits is
+             * set, which needs hundreds of thousands of references to one thing.
+             */
+            struct overflows {
+                overflows() { n[0] = n[1] = n[2] = 0; }
+                count_set::word n[3];
+                count_set::word& of(count_set::word unit) {
+                    return n[unit == count_set::strong_unit ? 0 : unit == count_set::event_unit ? 1 : 2];
+                }
+            };
+            spin_lock& overflow_lock()
+            {
+                static spin_lock l;
+                return l;
+            }
+            std::map<const count_set*, overflows>& overflow_table()
+            {
+                static std::map<const count_set*, overflows> t;
+                return t;
+            }
+        }
+
+        void count_set::spill_out(word unit)
+        {
+            overflow_lock().lock();
+            word cur = w.load(std::memory_order_relaxed);
+            word next;
+            do {
+                // Someone else may have spilled it already.
+                if (((cur / unit) & count_mask) < spill_at) {
+                    overflow_lock().unlock();
+                    return;
+                }
+                next = (cur - spill * unit) | (overflow * unit);
+            }
+            while (!w.compare_exchange_weak(cur, next, std::memory_order_relaxed, std::memory_order_relaxed));
+            overflow_table()[this].of(unit) += spill;
+            overflow_lock().unlock();
+        }
+
+        count_set::word count_set::borrow(word unit, bool claim, bool& claimed)
+        {
+            overflow_lock().lock();
+            std::map<const count_set*, overflows>::iterator it = overflow_table().find(this);
+            word cur = w.load(std::memory_order_relaxed);
+            word next;
+            bool borrowed;
+            do {
+                // Increments may have refilled the word since sub() looked.
+                borrowed = ((cur / unit) & count_mask) == 0;
+                next = cur;
+                if (borrowed) {
+                    assert(it != overflow_table().end() && (cur / unit) & overflow);
+                    next += spill * unit;
+                    if (it->second.of(unit) == spill)
+                        next &= ~(overflow * unit);
+                }
+                next -= unit;
+                claimed = claim && !(next & torn_down) && !active(next);
+                if (claimed)
+                    next = (next | torn_down) + strong_unit;
+            }
+            while (!w.compare_exchange_weak(cur, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+            if (borrowed) {
+                it->second.of(unit) -= spill;
+                if (it->second.n[0] == 0 && it->second.n[1] == 0 && it->second.n[2] == 0)
+                    overflow_table().erase(it);
+            }
+            overflow_lock().unlock();
+            return next;
+        }
+
+        unsigned count_set::overflow_count(word unit) const
+        {
+            overflow_lock().lock();
+            std::map<const count_set*, overflows>::iterator it = overflow_table().find(this);
+            unsigned n = it == overflow_table().end() ? 0 : (unsigned)it->second.of(unit);
+            overflow_lock().unlock();
+            return n;
+        }
+#endif
+
         void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_EVENT>* p)
         {
+#if defined(SODIUM_ATOMIC_COUNTS)
+            p->counts.inc_event();
+#else
             spin_lock* l = spin_get_and_lock(p);
             p->counts.inc_event();
             l->unlock();
+#endif
         }
 
         void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_EVENT>* p)
         {
+#if defined(SODIUM_ATOMIC_COUNTS)
+            p->release(count_set::event_unit);
+#else
             spin_lock* l = spin_get_and_lock(p);
             p->counts.dec_event();
             p->update_and_unlock(l);
+#endif
         }
 
         void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p)
         {
+#if defined(SODIUM_ATOMIC_COUNTS)
+            p->counts.inc_strong();
+#else
             spin_lock* l = spin_get_and_lock(p);
             p->counts.inc_strong();
             l->unlock();
+#endif
         }
-        
+
         void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p)
         {
+#if defined(SODIUM_ATOMIC_COUNTS)
+            p->release(count_set::strong_unit);
+#else
             spin_lock* l = spin_get_and_lock(p);
             p->counts.dec_strong();
             p->update_and_unlock(l);
+#endif
         }
 
         void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p)
         {
+#if defined(SODIUM_ATOMIC_COUNTS)
+            p->counts.inc_node();
+#else
             spin_lock* l = spin_get_and_lock(p);
             p->counts.inc_node();
             l->unlock();
+#endif
         }
 
         void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p)
         {
+#if defined(SODIUM_ATOMIC_COUNTS)
+            p->release(count_set::node_unit);
+#else
             spin_lock* l = spin_get_and_lock(p);
             p->counts.dec_node();
             p->update_and_unlock(l);
+#endif
         }
-        
+
         void holder::handle(const SODIUM_SHARED_PTR<node>& target, transaction_impl* trans, const light_ptr& value) const
         {
             if (handler)
@@ -80,22 +206,687 @@ namespace sodium {
     }
 #endif
 
+#if defined(SODIUM_INGRESS_QUEUE)
+    namespace impl {
+        struct ingress_item {
+            ingress_item(const SODIUM_SHARED_PTR<node>& target, light_ptr&& value,
+                         std::unique_ptr<std::promise<void> >&& done)
+                : next(NULL), joined(false), sender(std::this_thread::get_id()), target(target),
+                  value(std::move(value)), done(std::move(done))
+#if defined(SODIUM_LATENCY)
+                  , sent_ns(latency_origin())
+#endif
+                {}
+            ingress_item* next;
+            /*!
+             * True if it goes in the same transaction as the item sent before it.
+             */
+            bool joined;
+            /*!
+             * The thread that sent it, which gets the exception if it ends up draining
+             * the send and the send's transaction throws.
+             */
+            std::thread::id sender;
+            SODIUM_SHARED_PTR<node> target;
+            light_ptr value;
+            std::unique_ptr<std::promise<void> > done;
+#if defined(SODIUM_LATENCY)
+            unsigned long long sent_ns;
+#endif
+        };
+
+        /*!
+         * Whatever drains a partition's ingress queue in place of its senders.
+         */
+        class executor {
+            public:
+                executor(ingress_mode was) : was(was) {}
+                virtual ~executor() {}
+                /*!
+                 * Called by a sender once it has pushed onto the queue, with whether the
+                 * queue was empty before.
+                 */
+                virtual void pushed(bool was_empty) = 0;
+                /*!
+                 * The partition's ingress mode before the executor was attached.
+                 */
+                const ingress_mode was;
+        };
+
+        /*!
+         * A thread that drains a partition's ingress queue whenever there's something
+         * in it, until it's stopped.
+         */
+        class thread_executor : public executor {
+            public:
+                thread_executor(partition* part, ingress_mode was);
+                /*!
+                 * Stop once the queue is empty, and wait for that.
+                 */
+                virtual ~thread_executor();
+                virtual void pushed(bool was_empty)
+                {
+                    // It only sleeps when the queue is empty.
+                    if (was_empty)
+                        wake();
+                }
+
+            private:
+                void wake();
+                void loop();
+                partition* part;
+                std::mutex m;
+                std::condition_variable cv;
+                bool stopping;
+                std::thread thread;
+        };
+
+        thread_executor::thread_executor(partition* part, ingress_mode was)
+            : executor(was), part(part), stopping(false), thread([this] () { loop(); })
+        {
+        }
+
+        thread_executor::~thread_executor()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();
+        }
+
+        void thread_executor::wake()
+        {
+            // Taking the lock means we can't slip in between loop() seeing an empty
+            // queue and waiting, and so the notify can't be lost.
+            {
+                std::lock_guard<std::mutex> lock(m);
+            }
+            cv.notify_one();
+        }
+
+        void thread_executor::loop()
+        {
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    while (!stopping && part->ingress_head.load(std::memory_order_acquire) == NULL)
+                        cv.wait(lock);
+                    if (part->ingress_head.load(std::memory_order_acquire) == NULL &&
+                            part->ingress_pending == NULL)
+                        return;
+                }
+                part->ingress_draining.store(true, std::memory_order_relaxed);
+                // An exception from a transaction goes to the futures of the sends in
+                // it, so nothing thrown by a listener gets out of here.
+                part->drain_ingress();
+            }
+        }
+
+        /*!
+         * The threads of a work_stealing_policy, and their run queues of partitions.
+         */
+        class steal_pool {
+            public:
+                steal_pool(unsigned threads, size_t quantum);
+                /*!
+                 * Finish everything that's queued, then stop the threads.
+                 */
+                ~steal_pool();
+                /*!
+                 * Queue part to be run, onto this thread's run queue if it's one of the
+                 * workers. The caller must own part's ingress queue.
+                 */
+                void schedule(partition* part);
+                /*!
+                 * Wait until part's ingress queue is empty and no worker is inside it.
+                 * Nothing may send to part meanwhile, and it mustn't be called from a
+                 * worker.
+                 */
+                void finish(partition* part);
+                /*!
+                 * Take the exception that got out of draining part, if there was one.
+                 */
+                std::exception_ptr failure(partition* part);
+
+            private:
+                struct worker {
+                    worker() : current(NULL) {}
+                    std::mutex m;
+                    std::deque<partition*> runq;
+                    /*!
+                     * The partition this worker is draining, if any.
+                     */
+                    std::atomic<partition*> current;
+                };
+                bool busy(partition* part);
+                partition* take(unsigned w);
+                void loop(unsigned w);
+                size_t quantum;
+                std::vector<worker*> workers;
+                std::vector<std::thread> threads;
+                std::atomic<size_t> queued;
+                std::atomic<unsigned> idle;
+                std::atomic<unsigned> next;
+                /*!
+                 * How many threads are waiting in finish().
+                 */
+                std::atomic<unsigned> finishing;
+                std::mutex m;
+                std::condition_variable cv;
+                std::condition_variable finished;
+                bool stopping;
+                /*!
+                 * The first exception that got out of draining each partition, guarded
+                 * by m.
+                 */
+                std::map<partition*, std::exception_ptr> failures;
+        };
+
+        namespace {
+            thread_local steal_pool* this_pool = NULL;
+            thread_local unsigned this_worker = 0;
+        }
+
+        steal_pool::steal_pool(unsigned threads, size_t quantum)
+            : quantum(quantum), queued(0), idle(0), next(0), finishing(0), stopping(false)
+        {
+            if (threads == 0)
+                threads = 1;
+            for (unsigned w = 0; w < threads; w++)
+                workers.push_back(new worker);
+            for (unsigned w = 0; w < threads; w++)
+                this->threads.push_back(std::thread([this, w] () { loop(w); }));
+        }
+
+        steal_pool::~steal_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                stopping = true;
+            }
+            cv.notify_all();
+            for (size_t i = 0; i < threads.size(); i++)
+                threads[i].join();
+            for (size_t i = 0; i < workers.size(); i++)
+                delete workers[i];
+        }
+
+        void steal_pool::schedule(partition* part)
+        {
+            unsigned w = this_pool == this
+                ? this_worker
+                : next.fetch_add(1, std::memory_order_relaxed) % (unsigned)workers.size();
+            {
+                std::lock_guard<std::mutex> lock(workers[w]->m);
+                workers[w]->runq.push_back(part);
+            }
+            queued.fetch_add(1);
+            // A worker counts itself idle before it looks at queued for the last time,
+            // so one of us sees the other.
+            if (idle.load() != 0) {
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                }
+                cv.notify_one();
+            }
+        }
+
+        partition* steal_pool::take(unsigned w)
+        {
+            // Our own queue from the front, in the order things were queued, and then
+            // anyone else's from the back.
+            size_t n = workers.size();
+            for (size_t k = 0; k < n; k++) {
+                worker& v = *workers[(w + k) % n];
+                std::lock_guard<std::mutex> lock(v.m);
+                if (!v.runq.empty()) {
+                    partition* part;
+                    if (k == 0) {
+                        part = v.runq.front();
+                        v.runq.pop_front();
+                    }
+                    else {
+                        part = v.runq.back();
+                        v.runq.pop_back();
+                    }
+                    queued.fetch_sub(1);
+                    return part;
+                }
+            }
+            return NULL;
+        }
+
+        void steal_pool::loop(unsigned w)
+        {
+            this_pool = this;
+            this_worker = w;
+            while (true) {
+                partition* part = take(w);
+                if (part != NULL) {
+                    workers[w]->current.store(part);
+                    // If it has more to do, we still own it, so it goes to the back.
+                    bool more;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                    try {
+#endif
+                        more = part->drain_ingress(quantum);
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                    }
+                    catch (...) {
+                        // An exception from a transaction goes to the futures of the
+                        // sends in it, so this is something like bad_alloc. Running the
+                        // same sends again would likely fail the same way, so they
+                        // fail instead, and detach() reports it.
+                        std::exception_ptr failed = std::current_exception();
+                        {
+                            std::lock_guard<std::mutex> lock(m);
+                            failures.insert(std::make_pair(part, failed));
+                        }
+                        part->abandon_ingress(failed);
+                        more = part->release_ingress();
+                    }
+#endif
+                    workers[w]->current.store(NULL);
+                    if (more)
+                        schedule(part);
+                    // As with idle, finish() counts itself before it looks at current
+                    // for the last time, so one of us sees the other.
+                    else if (finishing.load() != 0) {
+                        {
+                            std::lock_guard<std::mutex> lock(m);
+                        }
+                        finished.notify_all();
+                    }
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(m);
+                idle.fetch_add(1);
+                while (!stopping && queued.load() == 0)
+                    cv.wait(lock);
+                idle.fetch_sub(1);
+                if (stopping && queued.load() == 0)
+                    return;
+            }
+        }
+
+        bool steal_pool::busy(partition* part)
+        {
+            // The workers first: a worker clears current after it has let go of the
+            // queue, so once we've seen that, we see the queue let go of as well.
+            for (size_t i = 0; i < workers.size(); i++)
+                if (workers[i]->current.load() == part)
+                    return true;
+            return part->ingress_draining.load() || part->ingress_head.load() != NULL;
+        }
+
+        void steal_pool::finish(partition* part)
+        {
+            finishing.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock(m);
+                while (busy(part))
+                    finished.wait(lock);
+            }
+            finishing.fetch_sub(1);
+        }
+
+        std::exception_ptr steal_pool::failure(partition* part)
+        {
+            std::lock_guard<std::mutex> lock(m);
+            std::map<partition*, std::exception_ptr>::iterator it = failures.find(part);
+            if (it == failures.end())
+                return std::exception_ptr();
+            std::exception_ptr failed = it->second;
+            failures.erase(it);
+            return failed;
+        }
+
+        /*!
+         * Hands a partition to a steal_pool when something is sent to it.
+         */
+        class pool_executor : public executor {
+            public:
+                pool_executor(partition* part, steal_pool* pool, ingress_mode was)
+                    : executor(was), part(part), pool(pool) {}
+                /*!
+                 * Wait for the pool to finish what's queued for the partition.
+                 */
+                virtual ~pool_executor()
+                {
+                    pool->finish(part);
+                }
+                virtual void pushed(bool was_empty)
+                {
+                    // Whoever sets the flag owns the queue until it's empty, so the
+                    // partition is only ever queued or run once at a time.
+                    if (!part->ingress_draining.exchange(true, std::memory_order_acquire))
+                        pool->schedule(part);
+                }
+
+            private:
+                partition* part;
+                steal_pool* pool;
+        };
+
+        void fulfil_at_end(transaction_impl* trans, std::unique_ptr<std::promise<void> > done)
+        {
+            struct fulfil {
+                fulfil(std::unique_ptr<std::promise<void> >&& done) : done(std::move(done)) {}
+                fulfil(fulfil&& other) : done(std::move(other.done)) {}
+                std::unique_ptr<std::promise<void> > done;
+                void operator () () { done->set_value(); done.reset(); }
+            };
+            trans->last(fulfil(std::move(done)));
+        }
+    }
+#endif
+
+#if defined(SODIUM_PARALLEL)
+    namespace impl {
+        /*!
+         * A fixed set of threads that run one job at a time, together with the
+         * thread that hands them the job.
+         */
+        class worker_pool {
+            public:
+                worker_pool(unsigned threads);
+                ~worker_pool();
+                unsigned size() const { return (unsigned)workers.size() + 1; }
+                /*!
+                 * Call job(w) for every w in [0, size()) concurrently, with w = 0 on this
+                 * thread, and return when they have all returned. job mustn't throw.
+                 */
+                void run(const std::function<void(unsigned)>& job);
+
+            private:
+                void loop(unsigned w);
+                std::vector<std::thread> workers;
+                std::mutex m;
+                std::condition_variable started;
+                std::condition_variable finished;
+                const std::function<void(unsigned)>* job;
+                unsigned long generation;
+                unsigned busy;
+                bool stopping;
+        };
+
+        worker_pool::worker_pool(unsigned threads)
+            : job(NULL), generation(0), busy(0), stopping(false)
+        {
+            for (unsigned w = 1; w < threads; w++)
+                workers.push_back(std::thread([this, w] () { loop(w); }));
+        }
+
+        worker_pool::~worker_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                stopping = true;
+            }
+            started.notify_all();
+            for (size_t i = 0; i < workers.size(); i++)
+                workers[i].join();
+        }
+
+        void worker_pool::run(const std::function<void(unsigned)>& job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                this->job = &job;
+                busy = (unsigned)workers.size();
+                generation++;
+            }
+            started.notify_all();
+            job(0);
+            std::unique_lock<std::mutex> lock(m);
+            while (busy != 0)
+                finished.wait(lock);
+            this->job = NULL;
+        }
+
+        void worker_pool::loop(unsigned w)
+        {
+            unsigned long seen = 0;
+            while (true) {
+                const std::function<void(unsigned)>* job;
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    while (!stopping && generation == seen)
+                        started.wait(lock);
+                    if (stopping)
+                        return;
+                    seen = generation;
+                    job = this->job;
+                }
+                (*job)(w);
+                std::lock_guard<std::mutex> lock(m);
+                if (--busy == 0)
+                    finished.notify_one();
+            }
+        }
+
+        /*!
+         * What a transaction_impl needs to run a batch of pure actions in parallel,
+         * kept between batches so it doesn't have to be allocated again.
+         */
+        struct parallel_scratch {
+            static const size_t none = (size_t)-1;
+            /*!
+             * A transaction_impl per thread that records what its actions queue, so it
+             * can be replayed into the real transaction in order afterwards. Its arena
+             * holds those actions until the real transaction is reset.
+             */
+            struct shard {
+                shard(partition* part) : trans(part) { trans.journal = &journal; }
+                transaction_impl trans;
+                std::vector<prioritized_entry> journal;
+            };
+            /*!
+             * Where an action of the batch left its part of a shard's journal.
+             */
+            struct span {
+                span() : shard(0), begin(0), end(0) {}
+                unsigned shard;
+                size_t begin;
+                size_t end;
+            };
+            ~parallel_scratch()
+            {
+                for (size_t i = 0; i < shards.size(); i++)
+                    delete shards[i];
+            }
+            std::vector<shard*> shards;
+            std::vector<task*> batch;
+            /*!
+             * Actions with the same target touch the same node, so they go together, in
+             * order, as a group. The actions are sorted by target and then by their
+             * position in the batch, and groups holds where each group starts, followed by
+             * the end of the last one.
+             */
+            std::vector<std::pair<node*, size_t> > by_target;
+            std::vector<size_t> groups;
+            std::vector<span> spans;
+            std::atomic<size_t> next_group;
+            /*!
+             * The first action in the batch to throw, and what it threw.
+             */
+            std::mutex error_mx;
+            size_t error_at;
+            std::exception_ptr error;
+        };
+
+        const size_t parallel_scratch::none;
+    }
+#endif
+
+#if defined(SODIUM_NODE_REGISTRY) && !defined(SODIUM_SINGLE_THREADED)
+    namespace impl {
+        namespace {
+            /*!
+             * Every live partition. They're function statics so that partitions that
+             * are statics themselves can be made in any order.
+             */
+            mutex& partitions_lock()
+            {
+                static mutex m;
+                return m;
+            }
+
+            std::vector<partition*>& partitions()
+            {
+                static std::vector<partition*> ps;
+                return ps;
+            }
+        }
+
+        std::vector<partition*> lock_partitions(std::vector<partition*> parts)
+        {
+            if (parts.empty()) {
+                partitions_lock().lock();
+                parts = partitions();
+                partitions_lock().unlock();
+            }
+            std::sort(parts.begin(), parts.end());
+            parts.erase(std::unique(parts.begin(), parts.end()), parts.end());
+            if (parts.empty())
+                return parts;
+            size_t first = 0;
+            while (true) {
+                parts[first]->mx.lock();
+                size_t failed = parts.size();
+                for (size_t i = 0; i < parts.size(); i++)
+                    if (i != first && !parts[i]->mx.try_lock()) {
+                        failed = i;
+                        break;
+                    }
+                if (failed == parts.size())
+                    return parts;
+                // Let go of everything, and next time wait for the one we couldn't get.
+                for (size_t i = 0; i < failed; i++)
+                    if (i != first)
+                        parts[i]->mx.unlock();
+                parts[first]->mx.unlock();
+                first = failed;
+            }
+        }
+
+        void unlock_partitions(const std::vector<partition*>& parts)
+        {
+            for (size_t i = 0; i < parts.size(); i++)
+                parts[i]->mx.unlock();
+        }
+    }
+#endif
+
     partition::partition()
         : depth(0),
-          processing_post(false)
+          processing_post(false),
+          regen_count(0),
+          rekey_count(0),
+#if defined(SODIUM_COMMITTED_READS)
+          commit_seq(0),
+#endif
+          spare(NULL)
+#if defined(SODIUM_INGRESS_QUEUE)
+          ,
+          ingress(ingress_off),
+          ingress_batch_limit(0),
+          ingress_share(64),
+          exec(NULL),
+          ingress_head(NULL),
+          ingress_draining(false),
+          ingress_pending(NULL),
+          ingress_offered(false),
+          ingress_handed(false)
+#endif
+#if defined(SODIUM_PARALLEL)
+          ,
+          pool(NULL),
+          parallel_min_batch(0)
+#endif
     {
 #if !defined(SODIUM_SINGLE_THREADED)
         pthread_key_create(&key, NULL);
+#endif
+#if defined(SODIUM_NODE_REGISTRY) && !defined(SODIUM_SINGLE_THREADED)
+        impl::partitions_lock().lock();
+        impl::partitions().push_back(this);
+        impl::partitions_lock().unlock();
 #endif
     }
 
     partition::~partition()
     {
+#if defined(SODIUM_NODE_REGISTRY) && !defined(SODIUM_SINGLE_THREADED)
+        impl::partitions_lock().lock();
+        std::vector<partition*>& ps = impl::partitions();
+        ps.erase(std::find(ps.begin(), ps.end(), this));
+        impl::partitions_lock().unlock();
+#endif
+#if defined(SODIUM_PARALLEL)
+        delete pool;
+#endif
+#if defined(SODIUM_INGRESS_QUEUE)
+        delete exec.load();
+        impl::ingress_item* lists[2] = { ingress_head.load(), ingress_pending };
+        for (int i = 0; i < 2; i++)
+            while (lists[i] != NULL) {
+                impl::ingress_item* next = lists[i]->next;
+                delete lists[i];
+                lists[i] = next;
+            }
+#endif
+#if defined(SODIUM_SINGLE_THREADED) || defined(SODIUM_NO_CXX11)
+        delete spare;
+#else
+        delete spare.load();
+#endif
 #if !defined(SODIUM_SINGLE_THREADED)
         pthread_key_delete(key);
 #endif
     }
 
+    impl::transaction_impl* partition::new_transaction()
+    {
+#if defined(SODIUM_SINGLE_THREADED)
+        impl::transaction_impl* impl = spare;
+        spare = NULL;
+#elif defined(SODIUM_NO_CXX11)
+        mx.lock();
+        impl::transaction_impl* impl = spare;
+        spare = NULL;
+        mx.unlock();
+#else
+        impl::transaction_impl* impl = spare.exchange(NULL);
+#endif
+        return impl != NULL ? impl : new impl::transaction_impl(this);
+    }
+
+    void partition::recycle(impl::transaction_impl* impl)
+    {
+        impl->reset();
+#if defined(SODIUM_SINGLE_THREADED)
+        if (spare == NULL) {
+            spare = impl;
+            impl = NULL;
+        }
+#elif defined(SODIUM_NO_CXX11)
+        mx.lock();
+        if (spare == NULL) {
+            spare = impl;
+            impl = NULL;
+        }
+        mx.unlock();
+#else
+        impl::transaction_impl* expected = NULL;
+        if (spare.compare_exchange_strong(expected, impl))
+            impl = NULL;
+#endif
+        delete impl;
+    }
+
 #if defined(SODIUM_NO_CXX11)
     void partition::post(const lambda0<void>& action)
 #else
@@ -106,6 +897,13 @@ namespace sodium {
         mx.lock();
 #endif
         postQ.push_back(action);
+#if defined(SODIUM_LATENCY)
+        post_origins.push_back(impl::latency_origin());
+#endif
+#if defined(SODIUM_METRICS)
+        if (postQ.size() > counters.post_peak)
+            counters.post_peak = postQ.size();
+#endif
 #if !defined(SODIUM_SINGLE_THREADED)
         mx.unlock();
 #endif
@@ -113,8 +911,18 @@ namespace sodium {
 
     void partition::process_post()
     {
+#if defined(SODIUM_TRACING)
+        // Posts are traced for the transaction this thread has just processed.
+        impl::trace_span span(impl::trace_posting(), this, "post");
+        impl::set_trace_posting(0);
+#endif
 #if !defined(SODIUM_SINGLE_THREADED)
         mx.lock();
+#endif
+#if defined(SODIUM_TRACING)
+        span.r.queued = postQ.size();
+#endif
+#if !defined(SODIUM_SINGLE_THREADED)
         // Prevent it running on multiple threads at the same time, so posts
         // will be handled in order for the partition.
         if (!processing_post) {
@@ -127,190 +935,1112 @@ namespace sodium {
 #if defined(SODIUM_NO_CXX11)
                     lambda0<void> action = *postQ.begin();
 #else
-                    std::function<void()> action = *postQ.begin();
+                    std::function<void()> action = std::move(*postQ.begin());
+#endif
+                    postQ.erase(postQ.begin());
+#if defined(SODIUM_LATENCY)
+                    impl::latency_scope scope(post_origins.front());
+                    post_origins.pop_front();
+#endif
+#if !defined(SODIUM_SINGLE_THREADED)
+                    mx.unlock();
+#endif
+                    action();
+#if !defined(SODIUM_SINGLE_THREADED)
+                    mx.lock();
+#endif
+                }
+                processing_post = false;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            }
+            catch (...) {
+                processing_post = false;
+                throw;
+            }
+#endif
+#if !defined(SODIUM_SINGLE_THREADED)
+        }
+        mx.unlock();
+#endif
+    }
+
+#if defined(SODIUM_INGRESS_QUEUE)
+    void partition::set_ingress(ingress_mode mode, size_t batch_limit)
+    {
+        ingress_batch_limit = batch_limit;
+        ingress.store(mode);
+    }
+
+    void partition::enqueue(const SODIUM_SHARED_PTR<impl::node>& target, light_ptr value,
+                            std::unique_ptr<std::promise<void> > done)
+    {
+        impl::ingress_item* item = new impl::ingress_item(target, std::move(value), std::move(done));
+        push_ingress(item, item);
+    }
+
+    void partition::enqueue(const SODIUM_SHARED_PTR<impl::node>& target, std::vector<light_ptr>&& values,
+                            bool together)
+    {
+        if (values.empty())
+            return;
+        // Chain them up newest first, as they'll sit on the stack.
+        impl::ingress_item* oldest = NULL;
+        impl::ingress_item* newest = NULL;
+        for (size_t i = 0; i < values.size(); i++) {
+            impl::ingress_item* item = new impl::ingress_item(target, std::move(values[i]),
+                std::unique_ptr<std::promise<void> >());
+            item->joined = together && i != 0;
+            item->next = newest;
+            newest = item;
+            if (oldest == NULL)
+                oldest = item;
+        }
+        push_ingress(newest, oldest);
+    }
+
+    void partition::push_ingress(impl::ingress_item* newest, impl::ingress_item* oldest)
+    {
+        impl::ingress_item* head = ingress_head.load(std::memory_order_relaxed);
+        do
+            oldest->next = head;
+        while (!ingress_head.compare_exchange_weak(head, newest,
+                    std::memory_order_release, std::memory_order_relaxed));
+        impl::executor* e = exec.load(std::memory_order_acquire);
+        if (e != NULL) {
+            e->pushed(head == NULL);
+            return;
+        }
+        // Whoever sets the flag drains for everyone, so the producers that lose
+        // the race return straight away, unless the drainer has offered to hand over.
+        if (!ingress_draining.exchange(true, std::memory_order_acquire))
+            drain_for_sender();
+        else if (ingress_offered.load(std::memory_order_relaxed) &&
+                ingress_offered.exchange(false, std::memory_order_acquire)) {
+            // It lets go at the end of its current transaction.
+            while (!ingress_handed.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            ingress_handed.store(false, std::memory_order_relaxed);
+            drain_for_sender();
+        }
+    }
+
+    void partition::drain_for_sender()
+    {
+        std::exception_ptr failed;
+        // Our send is either done already, or in the next lot we take off
+        // ingress_head, or in ingress_pending if we took the queue over. Either way
+        // it's done once we've taken two lots.
+        int lots = 0;
+        size_t transactions = 0;
+        bool offered = false;
+        while (true) {
+            if (offered && !ingress_offered.load(std::memory_order_acquire)) {
+                // Taken by a sender that's waiting for us.
+                ingress_handed.store(true, std::memory_order_release);
+                break;
+            }
+            bool took = false;
+            if (ingress_step(&failed, &took)) {
+                if (took && lots < 2)
+                    lots++;
+                if (lots == 2 && ingress_share != 0 && ++transactions == ingress_share) {
+                    offered = true;
+                    ingress_offered.store(true, std::memory_order_release);
+                }
+                continue;
+            }
+            if (offered) {
+                if (!ingress_offered.exchange(false, std::memory_order_acq_rel)) {
+                    ingress_handed.store(true, std::memory_order_release);
+                    break;
+                }
+                // Nobody came, so it's all ours again.
+                offered = false;
+            }
+            transactions = 0;
+            lots = 2;
+            if (!release_ingress())
+                break;
+        }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+        if (failed)
+            std::rethrow_exception(failed);
+#endif
+    }
+
+    bool partition::drain_ingress(size_t limit)
+    {
+        size_t transactions = 0;
+        while (true) {
+            if (ingress_step()) {
+                transactions++;
+                if (limit != 0 && transactions >= limit &&
+                        (ingress_pending != NULL || ingress_head.load(std::memory_order_relaxed) != NULL))
+                    return true;
+            }
+            else if (!release_ingress())
+                return false;
+        }
+    }
+
+    void partition::abandon_ingress(std::exception_ptr failed)
+    {
+        // Whatever was being fulfilled when it failed is left broken.
+        ingress_done.clear();
+        impl::ingress_item* lists[2] = { ingress_pending, ingress_head.exchange(NULL, std::memory_order_acquire) };
+        ingress_pending = NULL;
+        for (int i = 0; i < 2; i++)
+            while (lists[i] != NULL) {
+                std::unique_ptr<impl::ingress_item> item(lists[i]);
+                lists[i] = item->next;
+                if (item->done)
+                    item->done->set_exception(failed);
+            }
+    }
+
+    bool partition::release_ingress()
+    {
+        ingress_draining.store(false, std::memory_order_release);
+        // A producer may have pushed after we last looked, but seen the flag still
+        // set, so look again before leaving.
+        return ingress_head.load(std::memory_order_acquire) != NULL &&
+            !ingress_draining.exchange(true, std::memory_order_acquire);
+    }
+
+    bool partition::ingress_step(std::exception_ptr* own_failed, bool* took)
+    {
+        if (ingress_pending == NULL) {
+            // The queue is a stack, so reverse it to get the order of the sends.
+            impl::ingress_item* item = ingress_head.exchange(NULL, std::memory_order_acquire);
+            while (item != NULL) {
+                impl::ingress_item* next = item->next;
+                item->next = ingress_pending;
+                ingress_pending = item;
+                item = next;
+            }
+            if (ingress_pending == NULL)
+                return false;
+            if (took != NULL)
+                *took = true;
+        }
+        size_t limit = ingress.load(std::memory_order_relaxed) == ingress_batch ? ingress_batch_limit : 1;
+        bool had_own = false;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+        try {
+#endif
+            impl::transaction_ trans(this);
+            size_t n = 0;
+            // A lot sent together isn't split by the batch limit.
+            while (ingress_pending != NULL && (limit == 0 || n < limit || ingress_pending->joined)) {
+                // The item is released before the transaction closes, so the value
+                // isn't held past it.
+                std::unique_ptr<impl::ingress_item> item(ingress_pending);
+                ingress_pending = item->next;
+                if (own_failed != NULL && item->sender == std::this_thread::get_id())
+                    had_own = true;
+#if defined(SODIUM_LATENCY)
+                trans.impl()->sent(item->target, item->sent_ns);
+#endif
+                impl::send(item->target, trans.impl(), item->value);
+                if (item->done)
+                    ingress_done.push_back(std::move(item->done));
+                n++;
+            }
+            trans.close();
+#if !defined(SODIUM_NO_EXCEPTIONS)
+        }
+        catch (...) {
+            // Whoever sent what's left will still want it sent, so only the sends
+            // in this transaction fail.
+            std::exception_ptr failed = std::current_exception();
+            for (size_t i = 0; i < ingress_done.size(); i++)
+                ingress_done[i]->set_exception(failed);
+            ingress_done.clear();
+            if (had_own && !*own_failed)
+                *own_failed = failed;
+            return true;
+        }
+#endif
+        for (size_t i = 0; i < ingress_done.size(); i++)
+            ingress_done[i]->set_value();
+        ingress_done.clear();
+        return true;
+    }
+#endif
+
+#if defined(SODIUM_PARALLEL)
+    void partition::set_parallel(unsigned threads, size_t min_batch)
+    {
+        delete pool;
+        pool = threads > 1 ? new impl::worker_pool(threads) : NULL;
+        parallel_min_batch = min_batch;
+    }
+#endif
+
+    partition* def_part::part()
+    {
+        static partition part;
+        return &part;
+    }
+
+    namespace impl {
+
+#if defined(SODIUM_NODE_REGISTRY)
+        namespace {
+            /*!
+             * Every live node, newest first, so metrics can be read from them.
+             */
+            spin_lock registry_lock;
+            node* registry_head = NULL;
+            unsigned long registry_serial = 0;
+        }
+
+        void node::register_node()
+        {
+            registry_lock.lock();
+            serial = ++registry_serial;
+            registry_prev = NULL;
+            registry_next = registry_head;
+            if (registry_head != NULL)
+                registry_head->registry_prev = this;
+            registry_head = this;
+            registry_lock.unlock();
+        }
+
+        void visit_nodes(void (*f)(const node& n, void* ctx), void* ctx)
+        {
+            registry_lock.lock();
+            for (node* n = registry_head; n != NULL; n = n->registry_next)
+                f(*n, ctx);
+            registry_lock.unlock();
+        }
+#endif
+
+        node::node() : rank(0), visit_epoch(0), dead_targets(0)
+        {
+#if defined(SODIUM_NODE_REGISTRY)
+            register_node();
+#endif
+#if defined(SODIUM_NODE_KINDS)
+            kind = "node";
+#endif
+#if defined(SODIUM_PROFILING)
+            profile = profile_slot_here(kind);
+#endif
+#if defined(SODIUM_LATENCY)
+            latency = NULL;
+#endif
+        }
+
+        node::node(rank_t rank) : rank(rank), visit_epoch(0), dead_targets(0)
+        {
+#if defined(SODIUM_NODE_REGISTRY)
+            register_node();
+#endif
+#if defined(SODIUM_NODE_KINDS)
+            kind = rank == SODIUM_IMPL_RANK_T_MAX ? "listen" : "node";
+#endif
+#if defined(SODIUM_PROFILING)
+            profile = profile_slot_here(kind);
+#endif
+#if defined(SODIUM_LATENCY)
+            latency = NULL;
+#endif
+        }
+
+        node::~node()
+        {
+#if defined(SODIUM_NODE_REGISTRY)
+            registry_lock.lock();
+            if (registry_prev != NULL)
+                registry_prev->registry_next = registry_next;
+            else
+                registry_head = registry_next;
+            if (registry_next != NULL)
+                registry_next->registry_prev = registry_prev;
+            registry_lock.unlock();
+#endif
+            // A holder can outlive us, but it mustn't keep its target alive after.
+            for (size_t i = 0; i < targets.size(); i++) {
+                holder* h = targets[i].get();
+                if (h != NULL && h->target) {
+                    h->target->remove_source(h->source_slot);
+                    h->target.reset();
+                }
+            }
+        }
+
+        bool node::link(const SODIUM_SHARED_PTR<holder>& h, const SODIUM_SHARED_PTR<node>& targ)
+        {
+            bool changed;
+            if (targ) {
+                changed = targ->rank <= rank
+                    && (lower_below(targ->rank, targ.get()) || targ->ensure_bigger_than(rank));
+                boost::intrusive_ptr<listen_impl_func<H_EVENT> > li(
+                    reinterpret_cast<listen_impl_func<H_EVENT>*>(listen_impl.get()));
+                h->source_slot = targ->sources.size();
+                targ->sources.push_back(source(li, h.get(), this));
+            }
+            else
+                changed = false;
+            h->target = targ;
+            h->slot = targets.size();
+            targets.push_back(h);
+#if defined(SODIUM_NODE_METRICS)
+            fan_out.add(1);
+#endif
+            return changed;
+        }
+
+        void node::unlink(holder* h)
+        {
+            if (h->slot >= targets.size() || targets[h->slot].get() != h)
+                return;
+            dead_targets++;
+#if defined(SODIUM_NODE_METRICS)
+            fan_out.sub(1);
+#endif
+            if (h->target)
+                h->target->remove_source(h->source_slot);
+            // This may be the last reference to h.
+            targets[h->slot].reset();
+            if (dead_targets > 8 && dead_targets * 2 > targets.size())
+                compact_targets();
+        }
+
+        /*!
+         * Order doesn't matter for sources, so the last one is moved into the gap.
+         */
+        void node::remove_source(size_t i)
+        {
+            if (i + 1 != sources.size()) {
+                sources[i] = sources.back();
+                sources[i].h->source_slot = i;
+            }
+            sources.pop_back();
+        }
+
+        void node::compact_targets()
+        {
+            size_t j = 0;
+            for (size_t i = 0; i < targets.size(); i++)
+                if (targets[i]) {
+                    targets[j].swap(targets[i]);
+                    targets[j]->slot = j;
+                    j++;
+                }
+            targets.resize(j);
+            dead_targets = 0;
+        }
+
+        namespace {
+            typedef std::vector<std::pair<node*, rank_t> > walk_stack_t;
+            /*!
+             * Rank walks are numbered, so a node can tell it has been visited by the
+             * current walk from its visit_epoch. The numbers must be unique across
+             * partitions, since walks on different partitions can run at once.
+             */
+#if defined(SODIUM_SINGLE_THREADED)
+            unsigned long last_epoch = 0;
+            unsigned long new_epoch() { return ++last_epoch; }
+            walk_stack_t walk_stack;
+            walk_stack_t lower_region;
+#elif !defined(SODIUM_NO_CXX11)
+            std::atomic<unsigned long> last_epoch(0);
+            unsigned long new_epoch() { return ++last_epoch; }
+            thread_local walk_stack_t walk_stack;
+            thread_local walk_stack_t lower_region;
+#else
+            unsigned long last_epoch = 0;
+            unsigned long new_epoch()
+            {
+                spin_lock* l = spin_get_and_lock(&last_epoch);
+                unsigned long epoch = ++last_epoch;
+                l->unlock();
+                return epoch;
+            }
+#endif
+            /*!
+             * The most nodes lower_below() will move before it gives up.
+             */
+            const size_t lower_budget = 64;
+
+            bool by_rank(const std::pair<node*, rank_t>& a, const std::pair<node*, rank_t>& b)
+            {
+                return a.second < b.second;
+            }
+        }
+
+        /*!
+         * Try to make room for a link from this node to targ, whose rank is limit, by
+         * lowering this node and its ancestors instead of raising targ and its
+         * descendants. Ranks only go up when a link is made, so after switch_e() or
+         * switch_b() has let go of a deep input, the nodes downstream of it are left
+         * higher than they need to be. Here those ranks are given back: every
+         * ancestor ranked limit or more is set to one more than its highest source,
+         * in rank order. That only touches the region between the two ends of the
+         * link, and if it's bigger than lower_budget, if targ turns out to be an
+         * ancestor (a cycle), or if it still doesn't get below limit, the ranks are
+         * put back and it returns false, so the caller raises targ instead.
+         */
+        bool node::lower_below(rank_t limit, const node* targ)
+        {
+            if (limit == 0 || this == targ)
+                return false;
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            walk_stack_t& stack = walk_stack;
+            walk_stack_t& region = lower_region;
+#else
+            walk_stack_t stack;
+            walk_stack_t region;
+#endif
+            unsigned long epoch = new_epoch();
+            bool ok = true;
+            region.clear();
+            stack.clear();
+            visit_epoch = epoch;
+            stack.push_back(std::make_pair(this, rank));
+            while (ok && !stack.empty()) {
+                node* n = stack.back().first;
+                stack.pop_back();
+                region.push_back(std::make_pair(n, n->rank));
+                if (region.size() > lower_budget) {
+                    ok = false;
+                    break;
+                }
+                for (size_t i = 0; i < n->sources.size(); i++) {
+                    node* f = n->sources[i].from;
+                    if (f->rank < limit || f->visit_epoch == epoch)
+                        continue;
+                    if (f == targ) {
+                        ok = false;
+                        break;
+                    }
+                    f->visit_epoch = epoch;
+                    stack.push_back(std::make_pair(f, f->rank));
+                }
+            }
+            stack.clear();
+            if (ok) {
+                // Sources always rank below their targets, so in rank order each node's
+                // sources in the region have already been lowered.
+                std::sort(region.begin(), region.end(), by_rank);
+                for (size_t i = 0; i < region.size(); i++) {
+                    node* n = region[i].first;
+                    rank_t r = 0;
+                    for (size_t j = 0; j < n->sources.size(); j++)
+                        if (n->sources[j].from->rank + 1 > r)
+                            r = n->sources[j].from->rank + 1;
+                    if (r < n->rank)
+                        n->rank = r;
+                }
+                ok = rank < limit;
+            }
+            if (!ok)
+                for (size_t i = 0; i < region.size(); i++)
+                    region[i].first->rank = region[i].second;
+            region.clear();
+            return ok;
+        }
+
+        /*!
+         * Raise the rank of this node and everything downstream of it, so it's bigger
+         * than limit. It walks the graph with an explicit stack instead of recursing,
+         * since chains can be very long, visiting nodes in the same order as a
+         * depth-first recursion and each node at most once.
+         */
+        bool node::ensure_bigger_than(rank_t limit)
+        {
+            if (rank > limit)
+                return false;
+#if defined(SODIUM_SINGLE_THREADED) || !defined(SODIUM_NO_CXX11)
+            walk_stack_t& stack = walk_stack;
+#else
+            walk_stack_t stack;
+#endif
+            unsigned long epoch = new_epoch();
+            stack.push_back(std::make_pair(this, limit));
+            while (!stack.empty()) {
+                node* n = stack.back().first;
+                rank_t lim = stack.back().second;
+                stack.pop_back();
+                if (n->rank > lim || n->visit_epoch == epoch)
+                    continue;
+                n->visit_epoch = epoch;
+                n->rank = lim + 1;
+                // In reverse, so they're popped in order.
+                for (size_t i = n->targets.size(); i-- > 0; ) {
+                    holder* h = n->targets[i].get();
+                    if (h != NULL && h->target)
+                        stack.push_back(std::make_pair(h->target.get(), n->rank));
+                }
+            }
+            return true;
+        }
+
+#if defined(SODIUM_METRICS) || defined(SODIUM_TRACING) || defined(SODIUM_PROFILING) || \
+    defined(SODIUM_LATENCY)
+        unsigned long long monotonic_ns()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+#endif
+
+        rank_t rankOf(const SODIUM_SHARED_PTR<node>& target)
+        {
+            if (target.get() != NULL)
+                return target->rank;
+            else
+                return SODIUM_IMPL_RANK_T_MAX;
+        }
+
+        transaction_impl::transaction_impl(partition* part)
+            : part(part),
+              to_regen(false)
+#if defined(SODIUM_TRACING)
+              ,
+              trace_id(0),
+              trace_begin(0)
 #endif
-                    postQ.erase(postQ.begin());
-#if !defined(SODIUM_SINGLE_THREADED)
-                    mx.unlock();
+#if defined(SODIUM_LATENCY)
+              ,
+              requested_ns(0),
+              origin_ns(0)
 #endif
-                    action();
-#if !defined(SODIUM_SINGLE_THREADED)
-                    mx.lock();
+#if defined(SODIUM_PARALLEL)
+              ,
+              journal(NULL),
+              scratch(NULL)
 #endif
-                }
-                processing_post = false;
-#if !defined(SODIUM_NO_EXCEPTIONS)
-            }
-            catch (...) {
-                processing_post = false;
-                throw;
-            }
+        {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+            account(memory_transactions, 1, sizeof(*this));
+            part->memory.add(1, sizeof(*this));
+            mem.tally = &part->memory;
 #endif
-#if !defined(SODIUM_SINGLE_THREADED)
         }
-        mx.unlock();
+
+        arena::arena()
+            :
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+              tally(NULL),
 #endif
-    }
+              blocks(NULL), ptr(NULL), end(NULL)
+        {
+        }
 
-    partition* def_part::part()
-    {
-        static partition part;
-        return &part;
-    }
+        arena::~arena()
+        {
+            while (blocks != NULL) {
+                block* next = blocks->next;
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                account(memory_transactions, 0, -(long)blocks->size);
+                if (tally != NULL)
+                    tally->add(0, -(long)blocks->size);
+#endif
+                ::operator delete(blocks);
+                blocks = next;
+            }
+        }
 
-    namespace impl {
+        void* arena::grow(size_t size)
+        {
+            size_t header = (sizeof(block) + alignment - 1) & ~(alignment - 1);
+            size_t block_size = blocks != NULL ? blocks->size * 2 : 1024;
+            while (block_size < header + size)
+                block_size *= 2;
+            block* b = (block*)::operator new(block_size);
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+            // reset() merges the blocks, keeping the total, so only growing and
+            // destroying change it.
+            account(memory_transactions, 0, (long)block_size);
+            if (tally != NULL)
+                tally->add(0, (long)block_size);
+#endif
+            b->next = blocks;
+            b->size = block_size;
+            blocks = b;
+            ptr = (char*)b + header + size;
+            end = (char*)b + block_size;
+            return (char*)b + header;
+        }
 
-        node::node() : rank(0) {}
-        node::node(rank_t rank) : rank(rank) {}
-        node::~node()
+        void arena::reset()
         {
-            for (SODIUM_FORWARD_LIST<node::target>::iterator it = targets.begin(); it != targets.end(); it++) {
-                SODIUM_SHARED_PTR<node> targ = it->n;
-                if (targ) {
-                    boost::intrusive_ptr<listen_impl_func<H_EVENT> > li(
-                        reinterpret_cast<listen_impl_func<H_EVENT>*>(listen_impl.get()));
-                    targ->sources.remove(li);
+            if (blocks == NULL)
+                return;
+            if (blocks->next != NULL) {
+                // Replace the blocks with one that's big enough for all of them, so the
+                // next transaction of the same size doesn't need to grow.
+                size_t total = 0;
+                while (blocks != NULL) {
+                    block* next = blocks->next;
+                    total += blocks->size;
+                    ::operator delete(blocks);
+                    blocks = next;
                 }
+                block* b = (block*)::operator new(total);
+                b->next = NULL;
+                b->size = total;
+                blocks = b;
             }
+            size_t header = (sizeof(block) + alignment - 1) & ~(alignment - 1);
+            ptr = (char*)blocks + header;
+            end = (char*)blocks + blocks->size;
         }
 
-        bool node::link(void* holder, const SODIUM_SHARED_PTR<node>& targ)
+        void prioritized_queue::push(rank_t rank, entryID id, const prioritized_entry& entry)
         {
-            bool changed;
-            if (targ) {
-                std::set<node*> visited;
-                changed = targ->ensure_bigger_than(visited, rank);
-                boost::intrusive_ptr<listen_impl_func<H_EVENT> > li(
-                    reinterpret_cast<listen_impl_func<H_EVENT>*>(listen_impl.get()));
-                targ->sources.push_front(li);
+            size_t slot;
+            if (free_slots.empty()) {
+                slot = slots.size();
+                slots.push_back(entry);
             }
-            else
-                changed = false;
-            targets.push_front(target(holder, targ));
-            return changed;
+            else {
+                slot = free_slots.back();
+                free_slots.pop_back();
+                slots[slot] = entry;
+            }
+            heap.push_back(key(rank, id, slot));
+            sift_up(heap.size() - 1);
         }
 
-        void node::unlink(void* holder)
+        task* prioritized_queue::pop()
         {
-#if defined(SODIUM_NO_CXX11)
-            for (std::list<node::target>::iterator this_it = targets.begin(); this_it != targets.end(); ++this_it) {
-#else
-            SODIUM_FORWARD_LIST<node::target>::iterator this_it;
-            for (SODIUM_FORWARD_LIST<node::target>::iterator last_it = targets.before_begin(); true; last_it = this_it) {
-                this_it = last_it;
-                ++this_it;
-                if (this_it == targets.end())
-                    break;
-#endif
-                if (this_it->h == holder) {
-                    SODIUM_SHARED_PTR<node> targ = this_it->n;
-#if defined(SODIUM_NO_CXX11)
-                    targets.erase(this_it);
-#else
-                    targets.erase_after(last_it);
-#endif
-                    if (targ) {
-                        boost::intrusive_ptr<listen_impl_func<H_EVENT> > li(
-                            reinterpret_cast<listen_impl_func<H_EVENT>*>(listen_impl.get()));
-                        targ->sources.remove(li);
-                    }
-                    break;
-                }
+            assert(!heap.empty());
+            size_t slot = heap.front().slot;
+            heap.front() = heap.back();
+            heap.pop_back();
+            if (!heap.empty())
+                sift_down(0);
+            prioritized_entry& entry = slots[slot];
+            task* action = entry.action;
+            entry.action = NULL;
+            entry.target.reset();
+            if (heap.empty()) {
+                slots.clear();
+                free_slots.clear();
             }
+            else
+                free_slots.push_back(slot);
+            return action;
         }
 
-        bool node::ensure_bigger_than(std::set<node*>& visited, rank_t limit)
+        void prioritized_queue::clear()
         {
-            if (rank > limit || visited.find(this) != visited.end())
-                return false;
+            for (size_t i = 0; i < heap.size(); i++)
+                slots[heap[i].slot].action->destroy();
+            heap.clear();
+            slots.clear();
+            free_slots.clear();
+        }
+
+        size_t prioritized_queue::regen()
+        {
+            stale.clear();
+            bool lowered = false;
+            for (size_t i = 0; i < heap.size(); i++) {
+                rank_t rank = rankOf(slots[heap[i].slot].target);
+                if (rank != heap[i].rank) {
+                    if (rank < heap[i].rank)
+                        lowered = true;
+                    heap[i].rank = rank;
+                    stale.push_back(i);
+                }
+            }
+            if (lowered) {
+                if (heap.size() > 1)
+                    for (size_t i = (heap.size() - 2) / 4 + 1; i-- > 0; )
+                        sift_down(i);
+            }
             else {
-                visited.insert(this);
-                rank = limit + 1;
-                for (SODIUM_FORWARD_LIST<node::target>::iterator it = targets.begin(); it != targets.end(); ++it)
-                    if (it->n)
-                        it->n->ensure_bigger_than(visited, rank);
-                return true;
+                // Ranks only went up, so the heap is only out of order below the stale
+                // keys. Sifting them down from the bottom of the heap upwards means the
+                // subtrees below each one are already in order when we get to it.
+                for (size_t j = stale.size(); j-- > 0; )
+                    sift_down(stale[j]);
             }
+            return stale.size();
         }
 
-        rank_t rankOf(const SODIUM_SHARED_PTR<node>& target)
+        void prioritized_queue::sift_up(size_t i)
         {
-            if (target.get() != NULL)
-                return target->rank;
-            else
-                return SODIUM_IMPL_RANK_T_MAX;
+            key k = heap[i];
+            while (i > 0) {
+                size_t parent = (i - 1) / 4;
+                if (!(k < heap[parent]))
+                    break;
+                heap[i] = heap[parent];
+                i = parent;
+            }
+            heap[i] = k;
         }
 
-        transaction_impl::transaction_impl(partition* part)
-            : part(part),
-              to_regen(false)
+        void prioritized_queue::sift_down(size_t i)
         {
+            size_t n = heap.size();
+            key k = heap[i];
+            while (true) {
+                size_t first = i * 4 + 1;
+                if (first >= n)
+                    break;
+                size_t last = first + 4 < n ? first + 4 : n;
+                size_t least = first;
+                for (size_t c = first + 1; c < last; c++)
+                    if (heap[c] < heap[least])
+                        least = c;
+                if (!(heap[least] < k))
+                    break;
+                heap[i] = heap[least];
+                i = least;
+            }
+            heap[i] = k;
         }
 
         void transaction_impl::check_regen() {
             if (to_regen) {
                 to_regen = false;
-                prioritizedQ.clear();
-                for (std::map<entryID, prioritized_entry>::iterator it = entries.begin(); it != entries.end(); ++it)
-                    prioritizedQ.insert(pair<rank_t, entryID>(rankOf(it->second.target), it->first));
+                part->regen_count++;
+                part->rekey_count += prioritizedQ.regen();
             }
         }
 
         transaction_impl::~transaction_impl()
         {
+            prioritizedQ.clear();
+            for (size_t i = 0; i < lastQ.size(); i++)
+                if (lastQ[i] != NULL)
+                    lastQ[i]->destroy();
+#if defined(SODIUM_PARALLEL)
+            // Only now, because the queues can hold actions from the shards' arenas.
+            delete scratch;
+#endif
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+            account(memory_transactions, -1, -(long)sizeof(*this));
+            part->memory.add(-1, -(long)sizeof(*this));
+#endif
+        }
+
+        namespace {
+            /*!
+             * Destroys a task taken out of a queue, even if running it throws.
+             */
+            struct task_deleter {
+                task_deleter(task* t) : t(t) {}
+                ~task_deleter() { t->destroy(); }
+                task* t;
+            };
+
+#if defined(SODIUM_COMMITTED_READS)
+            /*!
+             * Makes the partition's commit_seq odd for as long as it exists, even if
+             * an action throws.
+             */
+            struct commit_writer {
+                commit_writer(partition* part)
+                    : part(part), seq(part->commit_seq.load(std::memory_order_relaxed))
+                {
+                    part->commit_seq.store(seq + 1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+                }
+                ~commit_writer()
+                {
+                    part->commit_seq.store(seq + 2, std::memory_order_release);
+                }
+                partition* part;
+                unsigned long seq;
+            };
+#endif
         }
 
         void transaction_impl::process_transactional()
         {
-            while (true) {
-                check_regen();
-                std::multiset<pair<rank_t, entryID>>::iterator pit = prioritizedQ.begin();
-                if (pit == prioritizedQ.end()) break;
-                std::map<entryID, prioritized_entry>::iterator eit = entries.find(pit->second);
-                assert(eit != entries.end());
-#if defined(SODIUM_NO_CXX11)
-                lambda1<void, transaction_impl*> action = eit->second.action;
-#else
-                std::function<void(transaction_impl*)> action = eit->second.action;
+#if defined(SODIUM_METRICS)
+            part->counters.transactions++;
 #endif
-                prioritizedQ.erase(pit);
-                entries.erase(eit);
-                action(this);
+#if defined(SODIUM_TRACING)
+            set_trace_posting(trace_id);
+            trace_span whole(trace_id, part, "transaction", 0, trace_begin);
+            trace_span processing(trace_id, part, "process", prioritizedQ.size());
+#endif
+#if defined(SODIUM_LATENCY)
+            // Posts and transactions on other partitions started from here carry
+            // the latency on.
+            latency_scope scope(origin_ns);
+#endif
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            try {
+#endif
+                while (true) {
+                    check_regen();
+                    if (prioritizedQ.empty()) break;
+#if defined(SODIUM_PARALLEL)
+                    if (part->pool != NULL && prioritizedQ.top().action->pure) {
+#if defined(SODIUM_TRACING)
+                        trace_span batch(trace_id, part, "batch", prioritizedQ.size());
+#endif
+                        run_batch();
+                        continue;
+                    }
+#endif
+#if defined(SODIUM_TRACING)
+                    trace_span run(trace_id, part, "run", prioritizedQ.size());
+                    if (run.active()) {
+                        const SODIUM_SHARED_PTR<node>& target = prioritizedQ.top().target;
+                        run.r.rank = rankOf(target);
+                        run.r.kind = target ? target->kind : NULL;
+                    }
+#endif
+                    task_deleter action(prioritizedQ.pop());
+                    action.t->run(this);
+                }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            }
+            catch (...) {
+                // Drop the rest, but still run the last actions, which wind up what
+                // has been done so far, such as clearing firings and updating holds,
+                // so the partition is fit for the next transaction.
+                prioritizedQ.clear();
+                process_last();
+                throw;
             }
-            while (lastQ.begin() != lastQ.end()) {
-                (*lastQ.begin())();
-                lastQ.erase(lastQ.begin());
+#endif
+#if defined(SODIUM_LATENCY)
+            if (!timed_sends.empty()) {
+                // The listeners have all run.
+                unsigned long long now = monotonic_ns();
+                for (size_t i = 0; i < timed_sends.size(); i++)
+                    timed_sends[i].first->record(now - timed_sends[i].second);
+                timed_sends.clear();
             }
+#endif
+            process_last();
         }
 
-        void transaction_impl::prioritized(const SODIUM_SHARED_PTR<node>& target,
-#if defined(SODIUM_NO_CXX11)
-                                           const lambda1<void, transaction_impl*>& f)
-#else
-                                           const std::function<void(transaction_impl*)>& f)
+        void transaction_impl::process_last()
+        {
+            if (lastQ.empty())
+                return;
+#if defined(SODIUM_TRACING)
+            trace_span last(trace_id, part, "last", lastQ.size());
+#endif
+#if defined(SODIUM_COMMITTED_READS)
+            // This is where behaviors take their new values.
+            commit_writer writer(part);
+#endif
+            // Actions may queue more actions while we're going, so lastQ can grow.
+            for (size_t i = 0; i < lastQ.size(); i++) {
+                task_deleter action(lastQ[i]);
+                lastQ[i] = NULL;
+                action.t->run(this);
+            }
+#if defined(SODIUM_METRICS)
+            if (lastQ.size() > part->counters.last_peak)
+                part->counters.last_peak = lastQ.size();
+            part->counters.last_total += lastQ.size();
+#endif
+            lastQ.clear();
+        }
+
+        void transaction_impl::reset()
+        {
+            prioritizedQ.clear();
+            for (size_t i = 0; i < lastQ.size(); i++)
+                if (lastQ[i] != NULL)
+                    lastQ[i]->destroy();
+            lastQ.clear();
+#if defined(SODIUM_PARALLEL)
+            if (scratch != NULL)
+                for (size_t i = 0; i < scratch->shards.size(); i++)
+                    scratch->shards[i]->trans.reset();
+#endif
+            mem.reset();
+            next_entry_id = entryID();
+            to_regen = false;
+#if defined(SODIUM_TRACING)
+            trace_id = 0;
+#endif
+#if defined(SODIUM_LATENCY)
+            requested_ns = 0;
+            origin_ns = 0;
+            timed_sends.clear();
+#endif
+        }
+
+#if defined(SODIUM_LATENCY)
+        void transaction_impl::sent(const SODIUM_SHARED_PTR<node>& sink, unsigned long long sent_ns)
+        {
+            if (sent_ns == 0)
+                sent_ns = origin_ns == 0 && requested_ns != 0 ? requested_ns : monotonic_ns();
+            if (origin_ns == 0 || sent_ns < origin_ns)
+                origin_ns = sent_ns;
+            if (sink->latency != NULL)
+                timed_sends.push_back(std::make_pair(sink->latency, sent_ns));
+        }
 #endif
+
+        void transaction_impl::prioritized_(const SODIUM_SHARED_PTR<node>& target, task* action)
         {
+#if defined(SODIUM_PARALLEL)
+            if (journal != NULL) {
+                journal->push_back(prioritized_entry(target, action));
+                return;
+            }
+#endif
             entryID id = next_entry_id;
             next_entry_id = next_entry_id.succ();
-            entries.insert(pair<entryID, prioritized_entry>(id, prioritized_entry(target, f)));
-            prioritizedQ.insert(pair<rank_t, entryID>(rankOf(target), id));
+            prioritizedQ.push(rankOf(target), id, prioritized_entry(target, action));
+#if defined(SODIUM_METRICS)
+            if (prioritizedQ.size() > part->counters.prioritized_peak)
+                part->counters.prioritized_peak = prioritizedQ.size();
+#endif
         }
 
-#if defined(SODIUM_NO_CXX11)
-        void transaction_impl::last(const lambda0<void>& action)
-#else
-        void transaction_impl::last(const std::function<void()>& action)
-#endif
+#if defined(SODIUM_PARALLEL)
+        /*!
+         * Take the pure actions at the front of the queue that share a rank, and run
+         * them. They're what serial processing would run next, and none of them can
+         * queue anything of the same rank or lower, since a target always has a
+         * higher rank than its source. If there are enough of them, they're run in
+         * parallel, and what they queue is replayed in the order serial processing
+         * would have queued it, so the transaction comes out the same either way.
+         */
+        void transaction_impl::run_batch()
         {
-            lastQ.push_back(action);
+            if (scratch == NULL)
+                scratch = new parallel_scratch;
+            parallel_scratch& s = *scratch;
+            s.batch.clear();
+            s.by_target.clear();
+            rank_t rank = prioritizedQ.top_rank();
+            do {
+                s.by_target.push_back(std::make_pair(prioritizedQ.top().target.get(), s.batch.size()));
+                s.batch.push_back(prioritizedQ.pop());
+            }
+            while (!prioritizedQ.empty() && prioritizedQ.top_rank() == rank &&
+                   prioritizedQ.top().action->pure);
+            size_t n = s.batch.size();
+
+            if (n < part->parallel_min_batch) {
+                size_t i = 0;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                try {
+#endif
+                    for (; i < n; i++) {
+                        task_deleter action(s.batch[i]);
+                        action.t->run(this);
+                    }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                }
+                catch (...) {
+                    while (++i < n)
+                        s.batch[i]->destroy();
+                    throw;
+                }
+#endif
+                return;
+            }
+
+            std::sort(s.by_target.begin(), s.by_target.end());
+            s.groups.clear();
+            for (size_t k = 0; k < n; k++)
+                if (k == 0 || s.by_target[k].first != s.by_target[k - 1].first)
+                    s.groups.push_back(k);
+            s.groups.push_back(n);
+            s.spans.assign(n, parallel_scratch::span());
+            while (s.shards.size() < part->pool->size())
+                s.shards.push_back(new parallel_scratch::shard(part));
+            s.next_group.store(0);
+            s.error_at = parallel_scratch::none;
+            s.error = std::exception_ptr();
+
+            part->pool->run([&s] (unsigned w) {
+                parallel_scratch::shard& sh = *s.shards[w];
+                while (true) {
+                    size_t g = s.next_group.fetch_add(1);
+                    if (g + 1 >= s.groups.size())
+                        break;
+                    bool failed = false;
+                    for (size_t k = s.groups[g]; k < s.groups[g + 1]; k++) {
+                        size_t i = s.by_target[k].second;
+                        task_deleter action(s.batch[i]);
+                        // Nothing later in a group runs once one has thrown.
+                        if (failed)
+                            continue;
+                        parallel_scratch::span& sp = s.spans[i];
+                        sp.shard = w;
+                        sp.begin = sh.journal.size();
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                        try {
+#endif
+                            action.t->run(&sh.trans);
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                        }
+                        catch (...) {
+                            failed = true;
+                            std::lock_guard<std::mutex> lock(s.error_mx);
+                            if (i < s.error_at) {
+                                s.error_at = i;
+                                s.error = std::current_exception();
+                            }
+                        }
+#endif
+                        sp.end = sh.journal.size();
+                    }
+                }
+            });
+
+            for (size_t i = 0; i < n; i++) {
+                const parallel_scratch::span& sp = s.spans[i];
+                std::vector<prioritized_entry>& journal = s.shards[sp.shard]->journal;
+                for (size_t j = sp.begin; j < sp.end; j++) {
+                    if (journal[j].target)
+                        prioritized_(journal[j].target, journal[j].action);
+                    else
+                        lastQ.push_back(journal[j].action);
+                }
+            }
+            for (size_t w = 0; w < s.shards.size(); w++) {
+                parallel_scratch::shard& sh = *s.shards[w];
+                if (sh.trans.to_regen) {
+                    sh.trans.to_regen = false;
+                    to_regen = true;
+                }
+                sh.journal.clear();
+            }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            if (s.error)
+                std::rethrow_exception(s.error);
+#endif
+        }
+#endif
+
+        namespace {
+            /*!
+             * Takes the partition's depth back down once its transaction has been
+             * processed, even if an action throws.
+             */
+            struct depth_restorer {
+                depth_restorer(partition* part) : part(part) {}
+                ~depth_restorer() { part->depth--; }
+                partition* part;
+            };
         }
 
         transaction_::transaction_(partition* part)
             : impl_(policy::get_global()->current_transaction(part))
         {
             if (impl_ == NULL) {
-                impl_ = new transaction_impl(part);
+                impl_ = part->new_transaction();
+#if defined(SODIUM_LATENCY)
+                impl_->requested_ns = latency_origin();
+#endif
                 policy::get_global()->initiate(impl_);
+#if defined(SODIUM_TRACING)
+                impl_->trace_start();
+#endif
             }
             part->depth++;
         }
@@ -320,8 +2050,8 @@ namespace sodium {
             process_trans_handler(transaction_impl* impl_) : impl_(impl_) {}
             transaction_impl* impl_;
             virtual void operator () () const {
+                depth_restorer restore(impl_->part);
                 impl_->process_transactional();
-                impl_->part->depth--;
             }
         };
         struct process_post_handler : i_lambda0<void> {
@@ -329,7 +2059,7 @@ namespace sodium {
             transaction_impl* impl_;
             virtual void operator () () const {
                 partition* part = impl_->part;
-                delete impl_;
+                part->recycle(impl_);
                 part->process_post();
             }
         };
@@ -354,12 +2084,12 @@ namespace sodium {
                         new process_post_handler(impl_)
 #else
                         [impl_] () {
+                            depth_restorer restore(impl_->part);
                             impl_->process_transactional();
-                            impl_->part->depth--;
                         },
                         [impl_] () {
                             partition* part = impl_->part;
-                            delete impl_;
+                            part->recycle(impl_);
                             part->process_post();
                         }
 #endif
@@ -369,6 +2099,86 @@ namespace sodium {
                     part->depth--;
             }
         }
+
+        transaction_series::transaction_series(partition* part)
+            : part(part),
+              impl_(policy::get_global()->current_transaction(part)),
+              nested(impl_ != NULL),
+              open(false)
+        {
+            if (!nested) {
+#if !defined(SODIUM_SINGLE_THREADED)
+                // The mutex is recursive, so this keeps other threads out between
+                // the transactions without getting in the way of initiate().
+                part->mx.lock();
+#endif
+                impl_ = part->new_transaction();
+            }
+        }
+
+        transaction_series::~transaction_series()
+        {
+            if (open)
+                commit();
+            if (!nested) {
+                part->recycle(impl_);
+#if !defined(SODIUM_SINGLE_THREADED)
+                part->mx.unlock();
+#endif
+            }
+        }
+
+#if defined(SODIUM_NO_CXX11)
+        struct series_post_handler : i_lambda0<void> {
+            series_post_handler(transaction_impl* impl_) : impl_(impl_) {}
+            transaction_impl* impl_;
+            virtual void operator () () const {
+                impl_->reset();
+                impl_->part->process_post();
+            }
+        };
+#endif
+
+        transaction_impl* transaction_series::begin()
+        {
+            if (!nested && !open) {
+#if defined(SODIUM_LATENCY)
+                impl_->requested_ns = latency_origin();
+#endif
+                policy::get_global()->initiate(impl_);
+#if defined(SODIUM_TRACING)
+                impl_->trace_start();
+#endif
+                part->depth++;
+                open = true;
+            }
+            return impl_;
+        }
+
+        void transaction_series::commit()
+        {
+            if (!open)
+                return;
+            open = false;
+            transaction_impl* impl_(this->impl_);
+            policy::get_global()->dispatch(
+                impl_,
+#if defined(SODIUM_NO_CXX11)
+                new process_trans_handler(impl_),
+                new series_post_handler(impl_)
+#else
+                [impl_] () {
+                    depth_restorer restore(impl_->part);
+                    impl_->process_transactional();
+                },
+                // Keep impl_ for the next step rather than recycling it.
+                [impl_] () {
+                    impl_->reset();
+                    impl_->part->process_post();
+                }
+#endif
+            );
+        }
     };  // end namespace impl
 
     static policy* global_policy = new simple_policy;
@@ -413,6 +2223,27 @@ namespace sodium {
         impl->part->mx.lock();
         pthread_setspecific(impl->part->key, impl);
 #endif
+#if defined(SODIUM_METRICS)
+        impl->part->counters.locked_at = impl::monotonic_ns();
+#endif
+    }
+
+    namespace {
+        /*!
+         * Let other threads into impl's partition once it has been processed.
+         */
+        void release_partition(impl::transaction_impl* impl)
+        {
+#if defined(SODIUM_METRICS)
+            impl->part->counters.lock_ns += impl::monotonic_ns() - impl->part->counters.locked_at;
+#endif
+#if defined(SODIUM_SINGLE_THREADED)
+            global_transaction = NULL;
+#else
+            pthread_setspecific(impl->part->key, NULL);
+            impl->part->mx.unlock();
+#endif
+        }
     }
 
     void simple_policy::dispatch(impl::transaction_impl* impl,
@@ -424,15 +2255,109 @@ namespace sodium {
         const std::function<void()>& post)
 #endif
     {
-        transactional();
-#if defined(SODIUM_SINGLE_THREADED)
-        global_transaction = NULL;
-#else
-        pthread_setspecific(impl->part->key, NULL);
-        impl->part->mx.unlock();
+#if !defined(SODIUM_NO_EXCEPTIONS)
+        try {
+#endif
+            transactional();
+#if !defined(SODIUM_NO_EXCEPTIONS)
+        }
+        catch (...) {
+            // Leave the partition as if the transaction had finished.
+            release_partition(impl);
+            post();
+            throw;
+        }
+#endif
+        release_partition(impl);
+        post();  // note: recycles 'impl'
+    }
+
+#if defined(SODIUM_INGRESS_QUEUE)
+    executor_policy::executor_policy()
+    {
+    }
+
+    executor_policy::~executor_policy()
+    {
+        while (!started.empty())
+            stop(started.back());
+    }
+
+    void executor_policy::start(partition* part)
+    {
+        if (part->exec.load() != NULL)
+            return;
+        ingress_mode was = part->ingress.load();
+        if (was == ingress_off)
+            part->set_ingress(ingress_per_send, part->ingress_batch_limit);
+        part->exec.store(new impl::thread_executor(part, was), std::memory_order_release);
+        started.push_back(part);
+    }
+
+    void executor_policy::stop(partition* part)
+    {
+        std::vector<partition*>::iterator it = std::find(started.begin(), started.end(), part);
+        if (it == started.end())
+            return;
+        started.erase(it);
+        impl::executor* e = part->exec.load();
+        ingress_mode was = e->was;
+        delete e;  // drains the queue first
+        part->exec.store(NULL, std::memory_order_release);
+        part->set_ingress(was, part->ingress_batch_limit);
+    }
+
+    work_stealing_policy::work_stealing_policy(unsigned threads, size_t quantum)
+        : pool(new impl::steal_pool(threads, quantum))
+    {
+    }
+
+    work_stealing_policy::~work_stealing_policy()
+    {
+        while (!attached.empty()) {
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            try {
+#endif
+                detach(attached.back());
+#if !defined(SODIUM_NO_EXCEPTIONS)
+            }
+            catch (...) {
+                // It has been detached, and a destructor can't pass it on.
+            }
+#endif
+        }
+        delete pool;
+    }
+
+    void work_stealing_policy::attach(partition* part)
+    {
+        if (part->exec.load() != NULL)
+            return;
+        ingress_mode was = part->ingress.load();
+        if (was == ingress_off)
+            part->set_ingress(ingress_per_send, part->ingress_batch_limit);
+        part->exec.store(new impl::pool_executor(part, pool, was), std::memory_order_release);
+        attached.push_back(part);
+    }
+
+    void work_stealing_policy::detach(partition* part)
+    {
+        std::vector<partition*>::iterator it = std::find(attached.begin(), attached.end(), part);
+        if (it == attached.end())
+            return;
+        attached.erase(it);
+        impl::executor* e = part->exec.load();
+        ingress_mode was = e->was;
+        delete e;  // waits for the pool to finish with the partition
+        part->exec.store(NULL, std::memory_order_release);
+        part->set_ingress(was, part->ingress_batch_limit);
+#if !defined(SODIUM_NO_EXCEPTIONS)
+        std::exception_ptr failed = pool->failure(part);
+        if (failed)
+            std::rethrow_exception(failed);
 #endif
-        post();  // note: deletes 'impl'
     }
+#endif
 
 };  // end namespace sodium
 
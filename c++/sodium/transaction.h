@@ -16,8 +16,11 @@
 #include <sodium/unit.h>
 #include <map>
 #include <set>
+#include <string>
 #include <list>
 #include <memory>
+#include <new>
+#include <vector>
 #ifdef __linux
 #include <pthread.h>
 #else
@@ -29,8 +32,13 @@
 #include <boost/fusion/adapted/boost_tuple.hpp>
 #include <boost/fusion/include/boost_tuple.hpp>
 #else
+#include <atomic>
+#include <exception>
 #include <forward_list>
+#include <future>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #endif
 
 namespace sodium {
@@ -137,6 +145,10 @@ namespace sodium {
         {
             pthread_mutex_lock(&mx);
         }
+        bool try_lock()
+        {
+            return pthread_mutex_trylock(&mx) == 0;
+        }
         void unlock()
         {
             pthread_mutex_unlock(&mx);
@@ -144,6 +156,164 @@ namespace sodium {
     };
 #endif
 
+    namespace impl {
+        struct transaction_impl;
+        class node;
+        struct ingress_item;
+        class executor;
+        class steal_pool;
+        class worker_pool;
+        struct parallel_scratch;
+    }
+
+#if defined(SODIUM_INGRESS_QUEUE)
+    /*!
+     * What event_sink::send() does on a partition when the calling thread isn't
+     * already inside one of the partition's transactions.
+     */
+    enum ingress_mode {
+        /*!
+         * Run a transaction for the send on the calling thread, waiting for the
+         * partition's lock. This is the default.
+         */
+        ingress_off,
+        /*!
+         * Push the send onto a lock-free queue and return. Whichever sending thread
+         * finds the queue idle drains it, giving each send its own transaction, so
+         * the semantics are the same as ingress_off, except that send() may return
+         * before the value has been processed. send_many() queues its values too, so
+         * each thread's sends still arrive in the order it made them.
+         *
+         * The draining thread runs other threads' sends until its own has gone
+         * through and it has run the partition's ingress share of transactions
+         * after that. Then it offers the queue to the next thread to send, which
+         * waits for the end of the current transaction to take it over. If a
+         * transaction throws, the exception goes to the send_async() futures of
+         * the sends in it, and to the draining thread's send() only if that thread
+         * sent one of them. Otherwise it's lost, as nobody is waiting for it.
+         */
+        ingress_per_send,
+        /*!
+         * Like ingress_per_send, except that each burst of queued sends, up to the
+         * batch limit, is delivered in one transaction. Sends to the same event_sink
+         * then appear as simultaneous firings.
+         */
+        ingress_batch
+    };
+#endif
+
+#if defined(SODIUM_METRICS) || defined(SODIUM_TRACING) || defined(SODIUM_PROFILING) || \
+    defined(SODIUM_LATENCY)
+    namespace impl {
+        /*!
+         * Nanoseconds on a monotonic clock.
+         */
+        unsigned long long monotonic_ns();
+    }
+#endif
+
+#if defined(SODIUM_METRICS) || defined(SODIUM_PROFILING) || defined(SODIUM_LATENCY)
+    namespace impl {
+
+        /*!
+         * A count that another thread can read while it's being added to.
+         */
+        class metric_count {
+            public:
+                metric_count() : n(0) {}
+#if defined(SODIUM_ATOMIC_COUNTS)
+                void add(unsigned long long d) { n.fetch_add(d, std::memory_order_relaxed); }
+                void sub(unsigned long long d) { n.fetch_sub(d, std::memory_order_relaxed); }
+                unsigned long long get() const { return n.load(std::memory_order_relaxed); }
+            private:
+                std::atomic<unsigned long long> n;
+#else
+                void add(unsigned long long d) { n += d; }
+                void sub(unsigned long long d) { n -= d; }
+                unsigned long long get() const { return n; }
+            private:
+                unsigned long long n;
+#endif
+        };
+    }
+#endif
+
+#if defined(SODIUM_PROFILING)
+    namespace impl {
+        /*!
+         * A place nodes are made, as named by a creation_site. See sodium/profile.h.
+         */
+        struct profile_site;
+
+        /*!
+         * The sampled handler time of the nodes of one kind made at one site.
+         */
+        struct profile_slot {
+            profile_slot(const profile_site* site, const char* kind) : site(site), kind(kind) {}
+            const profile_site* site;
+            const char* kind;
+            metric_count ns;
+            metric_count samples;
+        };
+
+        /*!
+         * The slot for nodes of the given kind made at this thread's current site.
+         */
+        profile_slot* profile_slot_here(const char* kind);
+
+        /*!
+         * How many handler runs this one should count for if it's to be timed, or 0
+         * if it isn't. One in every set_profiling() runs on each thread is timed.
+         */
+        unsigned long profile_weight();
+    }
+#endif
+
+#if defined(SODIUM_LATENCY)
+    class latency_histogram;
+
+    namespace impl {
+        /*!
+         * The histogram registered under name, made the first time it's asked for.
+         * See sodium/latency.h.
+         */
+        latency_histogram* latency_named(const std::string& name);
+
+        /*!
+         * When the sends behind the work this thread is doing were made, as set by
+         * the innermost latency_scope, or now if there isn't one. Transactions
+         * started from inside a transaction or a post on another partition take it
+         * as their start, so their latency includes the time it took to get there.
+         */
+        unsigned long long latency_origin();
+
+        struct latency_scope {
+            latency_scope(unsigned long long origin);
+            ~latency_scope();
+            unsigned long long previous;
+        };
+    }
+#endif
+
+#if defined(SODIUM_METRICS)
+    namespace impl {
+        /*!
+         * What a partition counts with SODIUM_METRICS. It's only touched while holding
+         * the partition's lock.
+         */
+        struct partition_counters {
+            partition_counters();
+            unsigned long transactions;
+            size_t prioritized_peak;
+            size_t last_peak;
+            unsigned long long last_total;
+            size_t post_peak;
+            unsigned long long lock_ns;
+            unsigned long long locked_at;
+        };
+    }
+#endif
+
     struct partition {
         partition();
         ~partition();
@@ -155,14 +325,163 @@ namespace sodium {
         pthread_key_t key;
 #endif
         bool processing_post;
+        /*!
+         * The number of times a transaction on this partition has had to re-rank its
+         * queue because the graph was re-linked during the transaction, and the total
+         * number of queued entries whose rank actually changed as a result.
+         */
+        unsigned long regen_count;
+        unsigned long rekey_count;
+#if defined(SODIUM_METRICS)
+        impl::partition_counters counters;
+#endif
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+        /*!
+         * The memory held by this partition's transactions, including their arenas.
+         */
+        impl::memory_tally memory;
+#endif
+#if defined(SODIUM_COMMITTED_READS)
+        /*!
+         * A seqlock count for reading behaviors' committed values from outside the
+         * partition. It's odd while a transaction is updating them.
+         */
+        std::atomic<unsigned long> commit_seq;
+#endif
+        /*!
+         * A finished transaction_impl kept for the next transaction on this partition,
+         * so its queues and arena don't have to be allocated again.
+         */
+#if defined(SODIUM_SINGLE_THREADED) || defined(SODIUM_NO_CXX11)
+        impl::transaction_impl* spare;
+#else
+        std::atomic<impl::transaction_impl*> spare;
+#endif
+        impl::transaction_impl* new_transaction();
+        void recycle(impl::transaction_impl* impl);
 #if defined(SODIUM_NO_CXX11)
         std::list<lambda0<void> > postQ;
         void post(const lambda0<void>& action);
 #else
         std::list<std::function<void()>> postQ;
         void post(const std::function<void()>& action);
+#endif
+#if defined(SODIUM_LATENCY)
+        /*!
+         * The latency_origin() of each post in postQ, restored while it runs.
+         */
+        std::list<unsigned long long> post_origins;
 #endif
         void process_post();
+#if defined(SODIUM_INGRESS_QUEUE)
+        /*!
+         * Set how event_sink::send() delivers values to this partition. batch_limit is
+         * the most sends per transaction for ingress_batch, with 0 meaning no limit.
+         * Change it only while nothing is sending.
+         */
+        void set_ingress(ingress_mode mode, size_t batch_limit = 0);
+        std::atomic<ingress_mode> ingress;
+        size_t ingress_batch_limit;
+        /*!
+         * How many transactions a sending thread runs for others, once its own send
+         * has gone through, before it offers the queue to the next sender. 0 means
+         * it never does. Change it only while nothing is sending.
+         */
+        size_t ingress_share;
+        /*!
+         * Queue a send of value to target. If the partition has an executor, wake it if
+         * needed and return, otherwise drain the queue on this thread unless another
+         * thread is already draining it. If done is given, it's fulfilled once the
+         * transaction the value goes into has been processed, or given the exception
+         * if processing it threw.
+         */
+        void enqueue(const SODIUM_SHARED_PTR<impl::node>& target, light_ptr value,
+                     std::unique_ptr<std::promise<void> > done = std::unique_ptr<std::promise<void> >());
+        /*!
+         * Queue sends of values to target as one lot, so no other send comes between
+         * them, and drain or wake as enqueue() does. If together is true, they all go
+         * in the same transaction.
+         */
+        void enqueue(const SODIUM_SHARED_PTR<impl::node>& target, std::vector<light_ptr>&& values,
+                     bool together);
+        /*!
+         * Push the items from newest to oldest onto ingress_head in one go, then wake
+         * the executor or drain.
+         */
+        void push_ingress(impl::ingress_item* newest, impl::ingress_item* oldest);
+        /*!
+         * Send what's in the queue, one transaction per send or per batch. If limit
+         * isn't 0, stop after that many transactions and return true if there's more to
+         * do, in which case this thread still owns the queue and must drain it again.
+         * An exception from a transaction goes to the promises of its sends only.
+         */
+        bool drain_ingress(size_t limit = 0);
+        /*!
+         * Run the next transaction from the queue, which this thread owns, and
+         * return false if the queue is empty. If own_failed is given and the
+         * transaction throws, it's set to the exception if one of the sends came
+         * from this thread and it isn't set already. took is set to true if it took
+         * a new lot of sends off ingress_head.
+         */
+        bool ingress_step(std::exception_ptr* own_failed = NULL, bool* took = NULL);
+        /*!
+         * Let go of the queue, unless something was pushed in the meantime that the
+         * sender left for us, in which case take it back and return true.
+         */
+        bool release_ingress();
+        /*!
+         * Drain the queue for the sender on this thread, handing it over to the next
+         * sender after the ingress share, then throw the exception from this
+         * thread's sends, if any.
+         */
+        void drain_for_sender();
+        /*!
+         * Drop everything queued, giving failed to the sends' futures, for a drainer
+         * that can't go on. Only the thread that is draining calls it.
+         */
+        void abandon_ingress(std::exception_ptr failed);
+        /*!
+         * What drains this partition's ingress queue under executor_policy or
+         * work_stealing_policy, or NULL if senders drain it themselves. Senders on any
+         * thread read it, so the policies set it with a release store.
+         */
+        std::atomic<impl::executor*> exec;
+        std::atomic<impl::ingress_item*> ingress_head;
+        std::atomic<bool> ingress_draining;
+        /*!
+         * Items taken off ingress_head, in order, that haven't been sent yet. Only
+         * touched by the thread that is draining.
+         */
+        impl::ingress_item* ingress_pending;
+        /*!
+         * The promises of the transaction being drained, kept until it's been
+         * processed. Only touched by the thread that is draining.
+         */
+        std::vector<std::unique_ptr<std::promise<void> > > ingress_done;
+        /*!
+         * Set by a sender that has run its share of transactions and would like to
+         * hand the queue over, and cleared by the sender that takes it.
+         */
+        std::atomic<bool> ingress_offered;
+        /*!
+         * Set once the sender that offered the queue has finished its transaction
+         * and let go of it.
+         */
+        std::atomic<bool> ingress_handed;
+#endif
+#if defined(SODIUM_PARALLEL)
+        /*!
+         * Run transactions on 'threads' threads, counting the one that closes the
+         * transaction, where at least min_batch pure actions of the same rank are
+         * queued together. Pure actions are the functions given to map() and filter(),
+         * which must then be safe to call concurrently and must not start transactions
+         * of their own. 0 or 1 threads turns it off. Change it only while nothing is
+         * sending.
+         */
+        void set_parallel(unsigned threads, size_t min_batch = 64);
+        impl::worker_pool* pool;
+        size_t parallel_min_batch;
+#endif
     };
 
     /*!
@@ -195,35 +514,86 @@ namespace sodium {
                 const std::shared_ptr<impl::node>&,
                 const SODIUM_SHARED_PTR<holder>&,
                 bool)> closure;
+#endif
+#if defined(SODIUM_NO_CXX11)
+            typedef lambda0<void> cleanup;
+#else
+            typedef std::function<void()> cleanup;
 #endif
             listen_impl_func(closure* func)
-                : func(func) {}
+                : func(func)
+            {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                account(memory_closures, 1, sizeof(*this) + (func != NULL ? sizeof(closure) : 0));
+#endif
+            }
             ~listen_impl_func()
             {
                 assert(cleanups.begin() == cleanups.end() && func == NULL);
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                account(memory_closures, -1, -(long)sizeof(*this));
+#endif
             }
             count_set counts;
             closure* func;
+#if defined(SODIUM_INTROSPECTION)
+            /*!
+             * The node the event is fired from, for walking the graph from an event.
+             */
+            SODIUM_WEAK_PTR<node> introspect_node;
+#endif
+            SODIUM_FORWARD_LIST<cleanup*> cleanups;
+            void add_cleanup(cleanup* c)
+            {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                account(memory_cleanups, 1, sizeof(cleanup));
+#endif
+                cleanups.push_front(c);
+            }
+            /*!
+             * Run the cleanups and destroy the function, once nothing that can fire the
+             * event is left.
+             */
+            void teardown() {
 #if defined(SODIUM_NO_CXX11)
-            SODIUM_FORWARD_LIST<lambda0<void>*> cleanups;
+                for (std::list<lambda0<void>*>::iterator it = cleanups.begin(); it != cleanups.end(); ++it) {
 #else
-            SODIUM_FORWARD_LIST<std::function<void()>*> cleanups;
+                for (auto it = cleanups.begin(); it != cleanups.end(); ++it) {
 #endif
+                    (**it)();
+                    delete *it;
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                    account(memory_cleanups, -1, -(long)sizeof(cleanup));
+#endif
+                }
+                cleanups.clear();
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                if (func != NULL)
+                    account(memory_closures, 0, -(long)sizeof(closure));
+#endif
+                delete func;
+                func = NULL;
+            }
+#if defined(SODIUM_ATOMIC_COUNTS)
+            /*!
+             * Drop one count of the given unit, tearing down and deleting as needed.
+             */
+            inline void release(count_set::word unit) {
+                bool claimed;
+                count_set::word w = counts.dec_and_claim(unit, claimed);
+                if (claimed) {
+                    teardown();
+                    w = counts.end_teardown();
+                }
+                if (!count_set::alive(w))
+                    delete this;
+            }
+#else
             inline void update_and_unlock(spin_lock* l) {
                 if (func && !counts.active()) {
                     counts.inc_strong();
                     l->unlock();
-#if defined(SODIUM_NO_CXX11)
-                    for (std::list<lambda0<void>*>::iterator it = cleanups.begin(); it != cleanups.end(); ++it) {
-#else
-                    for (auto it = cleanups.begin(); it != cleanups.end(); ++it) {
-#endif
-                        (**it)();
-                        delete *it;
-                    }
-                    cleanups.clear();
-                    delete func;
-                    func = NULL;
+                    teardown();
                     l->lock();
                     counts.dec_strong();
                 }
@@ -234,27 +604,66 @@ namespace sodium {
                 else
                     l->unlock();
             }
+#endif
         };
 
         class holder {
             public:
                 holder(
 #if defined(SODIUM_NO_CXX11)
-                    lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>* handler
+                    lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>* handler,
 #else
-                    std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler
+                    std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler,
+#endif
+                    bool pure = false
+                ) : slot(0), source_slot(0), handler(handler), pure(pure)
+                {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                    account(memory_closures, 1, accounted_size());
+#endif
+                }
+                virtual ~holder() {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                    account(memory_closures, -1, -accounted_size());
 #endif
-                ) : handler(handler) {}
-                ~holder() {
                     delete handler;
                 }
-                void handle(const SODIUM_SHARED_PTR<node>& target, transaction_impl* trans, const light_ptr& value) const;
+                /*!
+                 * Typed handlers (see SODIUM_TYPED_HANDLERS) override this and leave
+                 * handler NULL.
+                 */
+                virtual void handle(const SODIUM_SHARED_PTR<node>& target, transaction_impl* trans, const light_ptr& value) const;
+                /*!
+                 * True if the handler only sends to its target, so it can run in parallel
+                 * with other pure handlers whose targets are different.
+                 */
+                bool is_pure() const { return pure; }
+
+                /*!
+                 * Set by node::link(): the node this holder's handler sends to, this
+                 * holder's index in the source node's targets, and its source entry's
+                 * index in the target node's sources, so unlink() doesn't have to search.
+                 */
+                SODIUM_SHARED_PTR<node> target;
+                size_t slot;
+                size_t source_slot;
 
             private:
 #if defined(SODIUM_NO_CXX11)
                 lambda3<void, const SODIUM_SHARED_PTR<impl::node>&, transaction_impl*, const light_ptr&>* handler;
 #else
                 std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler;
+#endif
+                bool pure;
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                /*!
+                 * The holder and its handler, though not what the handler's captures
+                 * allocate, nor what typed handlers add to the holder.
+                 */
+                long accounted_size() const
+                {
+                    return sizeof(holder) + (handler != NULL ? sizeof(*handler) : 0);
+                }
 #endif
         };
 
@@ -280,15 +689,22 @@ namespace sodium {
         class node
         {
             public:
-                struct target {
-                    target(
-                        void* h,
-                        const SODIUM_SHARED_PTR<node>& n
-                    ) : h(h),
-                        n(n) {}
-
-                    void* h;
-                    SODIUM_SHARED_PTR<node> n;
+                /*!
+                 * Keeps a source's listen_impl alive for as long as a link from it to
+                 * this node exists.
+                 */
+                struct source {
+                    source(
+                        const boost::intrusive_ptr<listen_impl_func<H_EVENT> >& li,
+                        holder* h,
+                        node* from
+                    ) : li(li),
+                        h(h),
+                        from(from) {}
+
+                    boost::intrusive_ptr<listen_impl_func<H_EVENT> > li;
+                    holder* h;
+                    node* from;
                 };
 
             public:
@@ -297,16 +713,71 @@ namespace sodium {
                 ~node();
 
                 rank_t rank;
-                SODIUM_FORWARD_LIST<node::target> targets;
-                SODIUM_FORWARD_LIST<light_ptr> firings;
-                SODIUM_FORWARD_LIST<boost::intrusive_ptr<listen_impl_func<H_EVENT> > > sources;
+                /*!
+                 * The last rank walk that visited this node. See ensure_bigger_than().
+                 */
+                unsigned long visit_epoch;
+                /*!
+                 * The holders linked to this node, oldest first. An unlinked holder
+                 * leaves NULL behind, so the order is kept, and the NULLs are squeezed
+                 * out once they're half of the vector. The node shares ownership of
+                 * them, so a listener's holder outlives the node's destructor even if
+                 * the listener is unregistered on another thread meanwhile.
+                 */
+                std::vector<SODIUM_SHARED_PTR<holder> > targets;
+                size_t dead_targets;
+                /*!
+                 * Values fired in the current transaction, oldest first. It's cleared at
+                 * the end of the transaction, but keeps its capacity.
+                 */
+                std::vector<light_ptr> firings;
+                std::vector<source> sources;
                 boost::intrusive_ptr<listen_impl_func<H_NODE> > listen_impl;
+#if defined(SODIUM_NODE_REGISTRY)
+                /*!
+                 * Numbered in order of creation, from 1.
+                 */
+                unsigned long serial;
+                node* registry_prev;
+                node* registry_next;
+#endif
+#if defined(SODIUM_NODE_METRICS)
+                metric_count fired;
+                metric_count handler_ns;
+                metric_count fan_out;
+#endif
+#if defined(SODIUM_NODE_KINDS)
+                /*!
+                 * The operator that made it, such as "map", or "listen" for a listener.
+                 */
+                const char* kind;
+#endif
+#if defined(SODIUM_PROFILING)
+                /*!
+                 * Where its handler time goes, fixed once its kind is set.
+                 */
+                profile_slot* profile;
+#endif
+#if defined(SODIUM_LATENCY)
+                /*!
+                 * For a listener, where the latency of the values it's handed goes, and
+                 * for a sink, where the latency of the values sent on it goes, or NULL
+                 * if it isn't timed.
+                 */
+                latency_histogram* latency;
+#endif
 
-                bool link(void* holder, const SODIUM_SHARED_PTR<node>& target);
-                void unlink(void* holder);
+                bool link(const SODIUM_SHARED_PTR<holder>& h, const SODIUM_SHARED_PTR<node>& target);
+                void unlink(holder* h);
 
             private:
-                bool ensure_bigger_than(std::set<node*>& visited, rank_t limit);
+#if defined(SODIUM_NODE_REGISTRY)
+                void register_node();
+#endif
+                bool ensure_bigger_than(rank_t limit);
+                bool lower_below(rank_t limit, const node* targ);
+                void remove_source(size_t i);
+                void compact_targets();
         };
     }
 }
@@ -331,23 +802,159 @@ namespace sodium {
 
         rank_t rankOf(const SODIUM_SHARED_PTR<node>& target);
 
-        struct prioritized_entry {
-#if defined(SODIUM_NO_CXX11)
-            prioritized_entry(const SODIUM_SHARED_PTR<node>& target,
-                              const lambda1<void, transaction_impl*>& action)
-#else
-            prioritized_entry(const SODIUM_SHARED_PTR<node>& target,
-                              const std::function<void(transaction_impl*)>& action)
+#if defined(SODIUM_NODE_REGISTRY)
+        /*!
+         * Call f for every live node, with the registry of nodes locked, so f mustn't
+         * make or destroy any.
+         */
+        void visit_nodes(void (*f)(const node& n, void* ctx), void* ctx);
+#endif
+#if defined(SODIUM_NODE_REGISTRY) && !defined(SODIUM_SINGLE_THREADED)
+        /*!
+         * Lock each of parts, or every live partition if it's empty, and return the
+         * partitions locked. It only waits for a lock while it holds none, so it can't
+         * deadlock with a thread that holds one partition and opens a transaction on
+         * another.
+         */
+        std::vector<partition*> lock_partitions(std::vector<partition*> parts);
+        void unlock_partitions(const std::vector<partition*>& parts);
+#endif
+
+        /*!
+         * A monotonic allocator for objects that only live as long as a transaction.
+         * Allocation bumps a pointer, and memory is only given back all at once by
+         * reset(), which keeps it for the next transaction. If more than one block
+         * was needed, reset() replaces them with a single block big enough for all
+         * of them.
+         */
+        class arena {
+            public:
+                static const size_t alignment = 16;
+                arena();
+                ~arena();
+                void* allocate(size_t size)
+                {
+                    size = (size + alignment - 1) & ~(alignment - 1);
+                    if ((size_t)(end - ptr) < size)
+                        return grow(size);
+                    void* p = ptr;
+                    ptr += size;
+                    return p;
+                }
+                void reset();
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+                /*!
+                 * Where to account the blocks besides memory_transactions, if anywhere.
+                 */
+                memory_tally* tally;
+#endif
+
+            private:
+                arena(const arena& other) {}
+                arena& operator = (const arena& other) { return *this; }
+                struct block {
+                    block* next;
+                    size_t size;
+                };
+                block* blocks;
+                char* ptr;
+                char* end;
+                void* grow(size_t size);
+        };
+
+        /*!
+         * A type-erased action allocated in a transaction's arena. The arena doesn't
+         * run destructors, so whoever takes a task out of a queue must destroy it
+         * with destroy().
+         */
+        struct task {
+            task() : pure(false) {}
+            virtual ~task() {}
+            virtual void run(transaction_impl* trans) = 0;
+            void destroy() { this->~task(); }
+            /*!
+             * Set for the actions of pure handlers. See holder::is_pure().
+             */
+            bool pure;
+        };
+
+        template <class F>
+        struct prioritized_task : task {
+            prioritized_task(const F& f) : f(f) {}
+#if !defined(SODIUM_NO_CXX11)
+            prioritized_task(F&& f) : f(std::move(f)) {}
+#endif
+            F f;
+            virtual void run(transaction_impl* trans) { f(trans); }
+        };
+
+        template <class F>
+        struct last_task : task {
+            last_task(const F& f) : f(f) {}
+#if !defined(SODIUM_NO_CXX11)
+            last_task(F&& f) : f(std::move(f)) {}
 #endif
+            F f;
+            virtual void run(transaction_impl* trans) { f(); }
+        };
+
+        struct prioritized_entry {
+            prioritized_entry(const SODIUM_SHARED_PTR<node>& target, task* action)
                 : target(target), action(action)
             {
             }
             SODIUM_SHARED_PTR<node> target;
-#if defined(SODIUM_NO_CXX11)
-            lambda1<void, transaction_impl*> action;
-#else
-            std::function<void(transaction_impl*)> action;
-#endif
+            task* action;
+        };
+
+        /*!
+         * The queue of prioritized actions for a transaction, ordered by rank, and
+         * then by the order they were queued in. It's a 4-ary heap of small keys in
+         * contiguous storage that refer to a slot array of entries, so once the
+         * vectors have grown, queueing and popping don't touch the allocator.
+         */
+        class prioritized_queue {
+            public:
+                prioritized_queue() {}
+                bool empty() const { return heap.empty(); }
+                size_t size() const { return heap.size(); }
+                /*!
+                 * The entry that comes first, and its rank. The queue must not be empty.
+                 */
+                const prioritized_entry& top() const { return slots[heap.front().slot]; }
+                rank_t top_rank() const { return heap.front().rank; }
+                void push(rank_t rank, entryID id, const prioritized_entry& entry);
+                /*!
+                 * Remove the entry that comes first and give its action to the caller.
+                 */
+                task* pop();
+                /*!
+                 * Destroy the actions of any entries that are still queued.
+                 */
+                void clear();
+                /*!
+                 * Re-read the rank of every entry's target, re-key the entries whose
+                 * rank has changed, and restore heap order. Returns the number of
+                 * entries that were re-keyed.
+                 */
+                size_t regen();
+
+            private:
+                struct key {
+                    key(rank_t rank, entryID id, size_t slot) : rank(rank), id(id), slot(slot) {}
+                    rank_t rank;
+                    entryID id;
+                    size_t slot;
+                    inline bool operator < (const key& other) const {
+                        return rank < other.rank || (rank == other.rank && id < other.id);
+                    }
+                };
+                std::vector<key> heap;
+                std::vector<prioritized_entry> slots;
+                std::vector<size_t> free_slots;
+                std::vector<size_t> stale;
+                void sift_up(size_t i);
+                void sift_down(size_t i);
         };
 
         struct transaction_impl {
@@ -355,27 +962,179 @@ namespace sodium {
             ~transaction_impl();
             partition* part;
             entryID next_entry_id;
-            std::map<entryID, prioritized_entry> entries;
-            std::multiset<std::pair<rank_t, entryID>> prioritizedQ;
-#if defined(SODIUM_NO_CXX11)
-            std::list<lambda0<void> > lastQ;
-#else
-            std::list<std::function<void()>> lastQ;
-#endif
+            /*!
+             * Backs the actions in prioritizedQ and lastQ. It is emptied when the
+             * transaction_impl is recycled for the partition's next transaction.
+             */
+            arena mem;
+            prioritized_queue prioritizedQ;
+            std::vector<task*> lastQ;
             bool to_regen;
+#if defined(SODIUM_TRACING)
+            /*!
+             * The number of this transaction among those sampled for tracing, or 0 if
+             * it isn't being traced, and when it started.
+             */
+            unsigned long trace_id;
+            unsigned long long trace_begin;
+            void trace_start();
+#endif
+#if defined(SODIUM_LATENCY)
+            /*!
+             * When the transaction was asked for, before waiting for the partition's
+             * lock, and the earliest send in it, or 0 if nothing has been sent.
+             */
+            unsigned long long requested_ns;
+            unsigned long long origin_ns;
+            /*!
+             * The sends on sinks with a latency name, recorded once the listeners
+             * have run.
+             */
+            std::vector<std::pair<latency_histogram*, unsigned long long> > timed_sends;
+            /*!
+             * Note a send on sink made at sent_ns, or if that's 0, at the start of the
+             * transaction for its first send and now for the others.
+             */
+            void sent(const SODIUM_SHARED_PTR<node>& sink, unsigned long long sent_ns = 0);
+#endif
+#if defined(SODIUM_PARALLEL)
+            /*!
+             * If set, actions are recorded here in the order they're queued, instead of
+             * going into prioritizedQ and lastQ, with last() actions having no target.
+             * Used for the shards that run pure actions in parallel.
+             */
+            std::vector<prioritized_entry>* journal;
+            parallel_scratch* scratch;
+#endif
 
-            void prioritized(const SODIUM_SHARED_PTR<impl::node>& target,
 #if defined(SODIUM_NO_CXX11)
-                             const lambda1<void, impl::transaction_impl*>& action);
-            void last(const lambda0<void>& action);
+            task* prioritized(const SODIUM_SHARED_PTR<impl::node>& target,
+                              const lambda1<void, impl::transaction_impl*>& action)
+            {
+                typedef prioritized_task<lambda1<void, impl::transaction_impl*> > T;
+                T* t = new (mem.allocate(sizeof(T))) T(action);
+                prioritized_(target, t);
+                return t;
+            }
+            void last(const lambda0<void>& action)
+            {
+                typedef last_task<lambda0<void> > T;
+                last_(new (mem.allocate(sizeof(T))) T(action));
+            }
 #else
-                             const std::function<void(impl::transaction_impl*)>& action);
-            void last(const std::function<void()>& action);
+            /*!
+             * Queue an action, callable as f(transaction_impl*), to run in rank order.
+             */
+            template <class F>
+            task* prioritized(const SODIUM_SHARED_PTR<impl::node>& target, F&& f)
+            {
+                typedef prioritized_task<typename std::decay<F>::type> T;
+                static_assert(alignof(T) <= arena::alignment, "task over-aligned for arena");
+                T* t = new (mem.allocate(sizeof(T))) T(std::forward<F>(f));
+                prioritized_(target, t);
+                return t;
+            }
+            /*!
+             * Queue an action, callable as f(), to run after all prioritized actions.
+             */
+            template <class F>
+            void last(F&& f)
+            {
+                typedef last_task<typename std::decay<F>::type> T;
+                static_assert(alignof(T) <= arena::alignment, "task over-aligned for arena");
+                last_(new (mem.allocate(sizeof(T))) T(std::forward<F>(f)));
+            }
 #endif
 
             void check_regen();
             void process_transactional();
+            /*!
+             * Discard any remaining actions and make this ready for another transaction.
+             */
+            void reset();
+
+        private:
+            void process_last();
+            void prioritized_(const SODIUM_SHARED_PTR<impl::node>& target, task* action);
+            void last_(task* action)
+            {
+#if defined(SODIUM_PARALLEL)
+                if (journal != NULL) {
+                    journal->push_back(prioritized_entry(SODIUM_SHARED_PTR<node>(), action));
+                    return;
+                }
+#endif
+                lastQ.push_back(action);
+            }
+#if defined(SODIUM_PARALLEL)
+            void run_batch();
+#endif
+        };
+
+#if defined(SODIUM_TRACING)
+        /*!
+         * A span of time spent on a traced transaction. See sodium/trace.h.
+         */
+        struct trace_record {
+            const char* name;
+            unsigned long transaction;
+            const partition* part;
+            unsigned long long begin_ns;
+            unsigned long long end_ns;
+            /*!
+             * For an action, the rank and operator of its target, and otherwise
+             * SODIUM_IMPL_RANK_T_MAX and NULL.
+             */
+            rank_t rank;
+            const char* kind;
+            /*!
+             * How many actions were queued when the span began.
+             */
+            size_t queued;
         };
+
+        /*!
+         * Add a record to this thread's trace buffer.
+         */
+        void trace(const trace_record& r);
+
+        /*!
+         * The id of the last traced transaction this thread processed, until its
+         * posts are done, or 0.
+         */
+        unsigned long trace_posting();
+        void set_trace_posting(unsigned long id);
+
+        /*!
+         * Records the time from its construction, or from begin_ns, until it's
+         * destroyed, if transaction isn't 0.
+         */
+        class trace_span {
+            public:
+                trace_span(unsigned long transaction, const partition* part, const char* name,
+                           size_t queued = 0, unsigned long long begin_ns = 0)
+                {
+                    r.transaction = transaction;
+                    if (transaction != 0) {
+                        r.name = name;
+                        r.part = part;
+                        r.begin_ns = begin_ns != 0 ? begin_ns : monotonic_ns();
+                        r.rank = SODIUM_IMPL_RANK_T_MAX;
+                        r.kind = NULL;
+                        r.queued = queued;
+                    }
+                }
+                ~trace_span()
+                {
+                    if (r.transaction != 0) {
+                        r.end_ns = monotonic_ns();
+                        trace(r);
+                    }
+                }
+                bool active() const { return r.transaction != 0; }
+                trace_record r;
+        };
+#endif
     };
 
     class policy {
@@ -396,7 +1155,7 @@ namespace sodium {
 
         /*!
          * Dispatch the processing for this transaction according to the policy.
-         * Note that post() will delete impl, so don't reference it after that.
+         * Note that post() will recycle impl, so don't reference it after that.
          */
 #if defined(SODIUM_NO_CXX11)
         virtual void dispatch(impl::transaction_impl* impl,
@@ -410,6 +1169,14 @@ namespace sodium {
     };
 
     namespace impl {
+#if defined(SODIUM_INGRESS_QUEUE)
+        /*!
+         * Fulfil done once trans has been processed, or break it if trans is
+         * abandoned.
+         */
+        void fulfil_at_end(transaction_impl* trans, std::unique_ptr<std::promise<void> > done);
+#endif
+
         class transaction_ {
         private:
             transaction_impl* impl_;
@@ -419,9 +1186,39 @@ namespace sodium {
             transaction_(partition* part);
             ~transaction_();
             impl::transaction_impl* impl() const { return impl_; }
-        protected:
+            /*!
+             * Close the transaction before the destructor does, so that an exception
+             * from processing it can be caught.
+             */
             void close();
         };
+
+        /*!
+         * Runs a series of separate transactions on one partition, holding the
+         * partition's lock and one transaction_impl across the whole series, for
+         * sending many values at once. If the thread is already in a transaction on
+         * the partition, every step joins that transaction instead.
+         */
+        class transaction_series {
+        private:
+            partition* part;
+            transaction_impl* impl_;
+            bool nested;
+            bool open;
+            transaction_series(const transaction_series& other) {}
+            transaction_series& operator = (const transaction_series& other) { return *this; };
+        public:
+            transaction_series(partition* part);
+            ~transaction_series();
+            /*!
+             * Start the next transaction of the series.
+             */
+            transaction_impl* begin();
+            /*!
+             * Process the transaction started with begin(), then run the partition's posts.
+             */
+            void commit();
+        };
     };
 
     template <class P EQ_DEF_PART>
@@ -455,6 +1252,79 @@ namespace sodium {
             const std::function<void()>& post);
 #endif
     };
+
+#if defined(SODIUM_INGRESS_QUEUE)
+    /*!
+     * A policy where a partition can be owned by an executor thread of its own. Sends
+     * to it from any other thread, outside a transaction on it, are queued for that
+     * thread and return straight away (see event_sink::send_async() to wait for one),
+     * and cross() to it pushes onto its queue without taking any lock. Transactions
+     * opened explicitly still run on the thread that opens them, under the
+     * partition's mutex, as with simple_policy.
+     */
+    class executor_policy : public simple_policy
+    {
+    public:
+        executor_policy();
+        virtual ~executor_policy();
+        /*!
+         * Give part an executor thread. Its ingress mode becomes ingress_per_send if it
+         * was ingress_off. Call it only while nothing is sending to part.
+         */
+        void start(partition* part);
+        /*!
+         * Let part's executor finish what's queued, then stop it and put part's
+         * ingress mode back. Call it only while nothing is sending to part.
+         */
+        void stop(partition* part);
+    private:
+        std::vector<partition*> started;
+    };
+
+    /*!
+     * A policy that shares a fixed pool of threads between any number of partitions.
+     * A partition that's been attached is run by a worker whenever something is sent
+     * to it from outside a transaction on it, with at most one worker inside it at a
+     * time, so its sends and posts keep their order. Each worker has its own run queue
+     * of partitions, and takes from the others' when its own is empty. As with
+     * executor_policy, sends queue and return straight away, cross() to an attached
+     * partition doesn't take a lock, and explicit transactions run on the thread
+     * that opens them.
+     *
+     * The pool is reached through attach() and the partitions' ingress queues, not
+     * through initiate() and dispatch(), which are simple_policy's, because a
+     * transaction is built on the thread that opens it. Setting it as the global
+     * policy without attaching anything runs nothing on the pool.
+     */
+    class work_stealing_policy : public simple_policy
+    {
+    public:
+        /*!
+         * quantum is how many transactions a worker runs on one partition before it
+         * lets others have a turn, with 0 meaning as many as it takes to empty it.
+         */
+        work_stealing_policy(unsigned threads, size_t quantum = 64);
+        virtual ~work_stealing_policy();
+        /*!
+         * Have the pool run part. Its ingress mode becomes ingress_per_send if it was
+         * ingress_off. Call it only while nothing is sending to part.
+         */
+        void attach(partition* part);
+        /*!
+         * Wait for the pool to finish what's queued for part, then let it go, putting
+         * its ingress mode back. Call it only while nothing is sending to part.
+         *
+         * If something other than a transaction's exception, such as bad_alloc, got
+         * out of a worker while it was draining part, the sends queued at the time
+         * were failed with it, and detach() throws the first such exception. The
+         * destructor detaches what's still attached without throwing.
+         */
+        void detach(partition* part);
+    private:
+        impl::steal_pool* pool;
+        std::vector<partition*> attached;
+    };
+#endif
 }  // end namespace sodium
 
 #endif
@@ -0,0 +1,54 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_TESTS_LIVE_HEAP_H_
+#define _SODIUM_TESTS_LIVE_HEAP_H_
+
+/*!
+ * Replaces the global allocator to count the blocks allocated and not yet freed,
+ * so a memory test can check itself without valgrind. Include it in one file of
+ * the program only.
+ */
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+static std::atomic<long> live_blocks(0);
+
+void* operator new(size_t size)
+{
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    live_blocks.fetch_add(1, std::memory_order_relaxed);
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p != NULL) {
+        live_blocks.fetch_sub(1, std::memory_order_relaxed);
+        free(p);
+    }
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#endif
@@ -1,61 +1,88 @@
+#include "live_heap.h"
 #include <sodium/sodium.h>
-#include <unistd.h>
+#include <sodium/memory.h>
 
 using namespace sodium;
 using namespace std;
 
 /*!
- * Run:
- *     valgrind --tool=massif --time-unit=ms memory/release-sink-machinery
- *     massif-visualizer massif.out.*
+ * Checks that the machinery behind switch_b is all released once both the sinks
+ * and the switched behaviors are destroyed. It exits non-zero if it isn't.
  *
- * What you should see:
- *
- *   +--+
- *   |  |
- *   |  |
- *   |  |
- *   |  |
- *   |  |
- *   |  |
- *   |  |
- *   |  +--+
- *   |     |
- *   +     +---+
+ * Blocks that light_ptr's per-thread cache holds on to aren't freed, so the heap
+ * only has to come back to within the cache's size of where it started. With
+ * SODIUM_MEMORY_ACCOUNTING, everything Sodium accounts has to come back exactly,
+ * except the arena the partition's spare transaction keeps for next time.
  */
+static void construct_and_release(int n)
+{
+    behavior_sink<behavior<string>>** ss = new behavior_sink<behavior<string>>*[n];
+    behavior<string>** s = new behavior<string>*[n];
+    {
+        transaction<def_part> t;
+        for (int i = 0; i < n; i++) {
+            ss[i] = new behavior_sink<behavior<string>>(behavior<string>(string()));
+            s[i] = new behavior<string>(switch_b(*ss[i]));
+        }
+    }
+    for (int i = 0; i < n; i++)
+        delete ss[i];
+    for (int i = 0; i < n; i++)
+        delete s[i];
+    delete[] ss;
+    delete[] s;
+}
+
 int main(int argc, char* argv[])
 {
     #define N 1000
+    #define CACHE_SLACK 1024
+    // Warm up, so the partition and its spare transaction exist.
+    construct_and_release(1);
+    long heap0 = live_blocks.load();
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    memory_snapshot m0 = snapshot_memory();
+#endif
     behavior_sink<behavior<string>>* ss[N];
     behavior<string>* s[N];
     {
-        printf("constructing\n");
         transaction<def_part> t;
         for (int i = 0; i < N; i++) {
             ss[i] = new behavior_sink<behavior<string>>(behavior<string>(string()));
             s[i] = new behavior<string>(switch_b(*ss[i]));
         }
-        printf("done\n");
     }
-    for (int i = 0; i < 200; i++) {
-        free(malloc(5));
-        usleep(10000);
-    }
-    printf("deleting 1\n");
+    long heap1 = live_blocks.load();
+    CHECK(heap1 - heap0 > N);
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    memory_snapshot m1 = snapshot_memory();
+    CHECK(m1.nodes.count - m0.nodes.count >= N);
+    CHECK(m1.operators["switch_b"].count - m0.operators["switch_b"].count == N);
+#endif
     for (int i = 0; i < N; i++)
         delete ss[i];
-    printf("done\n");
-    for (int i = 0; i < 200; i++) {
-        free(malloc(5));
-        usleep(10000);
-    }
-    printf("deleting 2\n");
+    // The switched behaviors still hold what they were switched to.
+    CHECK(live_blocks.load() > heap0 + CACHE_SLACK);
     for (int i = 0; i < N; i++)
         delete s[i];
-    printf("done\n");
-    for (int i = 0; i < 200; i++) {
-        free(malloc(5));
-        usleep(10000);
-    }
-    return 0;
+    long heap2 = live_blocks.load();
+    printf("live heap blocks: %ld before, %ld constructed, %ld released\n", heap0, heap1, heap2);
+    CHECK(heap2 - heap0 <= CACHE_SLACK);
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    memory_snapshot m2 = snapshot_memory();
+    printf("accounted bytes: %ld before, %ld constructed, %ld released, %ld of them in transactions\n",
+        m0.total().bytes, m1.total().bytes, m2.total().bytes, m2.transactions.bytes);
+    CHECK(m2.nodes.count == m0.nodes.count);
+    CHECK(m2.nodes.bytes == m0.nodes.bytes);
+    CHECK(m2.payloads.count == m0.payloads.count);
+    CHECK(m2.payloads.bytes == m0.payloads.bytes);
+    CHECK(m2.closures.count == m0.closures.count);
+    CHECK(m2.closures.bytes == m0.closures.bytes);
+    CHECK(m2.cleanups.count == m0.cleanups.count);
+    CHECK(m2.cleanups.bytes == m0.cleanups.bytes);
+    // The spare transaction keeps the arena it grew for the big one.
+    CHECK(m2.transactions.count == m0.transactions.count);
+    CHECK(m2.operators["switch_b"].count == m0.operators["switch_b"].count);
+#endif
+    return failures == 0 ? 0 : 1;
 }
@@ -1,21 +1,19 @@
+#include "live_heap.h"
 #include <sodium/sodium.h>
-#include <unistd.h>
+#include <sodium/memory.h>
 
 using namespace sodium;
 using namespace std;
 
 /*!
- * Run:
- *     valgrind --tool=massif memory/switch-memory
- *     massif-visualizer massif.out.*
- *
- * What you should see:
- *
- *     flat memory usage profile (no leak)
+ * Checks that switching behaviors back and forth doesn't leak: after a few rounds
+ * to warm up, memory use has to stay flat. It exits non-zero if it doesn't.
  */
 int main(int argc, char* argv[])
 {
     #define N 100
+    #define WARM_UP 10
+    #define ROUNDS 100
     behavior<string>* as[N];
     behavior_sink<string>* bs[N];
     behavior_sink<behavior<string>>* ss[N];
@@ -28,16 +26,42 @@ int main(int argc, char* argv[])
             bs[i] = new behavior_sink<string>("world");
             ss[i] = new behavior_sink<behavior<string>>(*as[i]);
             os[i] = new behavior<string>(switch_b(*ss[i]));
-            os[i]->updates().listen([] (const string& s) {
-                //printf("%s\n", s.c_str());
-            });
+            unlistens[i] = os[i]->updates().listen([] (const string& s) {});
         }
     }
-    for (int iter = 0; iter < 100; iter++) {
+    long heap0 = 0;
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    memory_snapshot m0;
+#endif
+    for (int iter = 0; iter < ROUNDS; iter++) {
+        if (iter == WARM_UP) {
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+            m0 = snapshot_memory();
+#endif
+            heap0 = live_blocks.load();
+        }
         for (int i = 0; i < N; i++)
             ss[i]->send(*as[i]);
         for (int i = 0; i < N; i++)
             ss[i]->send(*bs[i]);
     }
-    return 0;
+    long heap1 = live_blocks.load();
+    printf("live heap blocks: %ld after warming up, %ld after %d rounds\n", heap0, heap1, ROUNDS);
+    CHECK(heap1 == heap0);
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    memory_snapshot m1 = snapshot_memory();
+    printf("accounted bytes: %ld after warming up, %ld after %d rounds\n",
+        m0.total().bytes, m1.total().bytes, ROUNDS);
+    CHECK(m1.total().count == m0.total().count);
+    CHECK(m1.total().bytes == m0.total().bytes);
+    CHECK(m1.operators["switch_b"].count == m0.operators["switch_b"].count);
+#endif
+    for (int i = 0; i < N; i++) {
+        unlistens[i]();
+        delete os[i];
+        delete ss[i];
+        delete bs[i];
+        delete as[i];
+    }
+    return failures == 0 ? 0 : 1;
 }
@@ -7,12 +7,29 @@
 
 #include "test_sodium.h"
 #include <sodium/sodium.h>
+#include <sodium/pipeline.h>
+#include <sodium/metrics.h>
+#include <sodium/introspect.h>
+#include <sodium/memory.h>
+#include <sodium/trace.h>
+#include <sodium/profile.h>
+#include <sodium/latency.h>
 #include <boost/optional.hpp>
 
 #include <cppunit/ui/text/TestRunner.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <ctype.h>
+#include <array>
+#include <condition_variable>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
 
 using namespace std;
 using namespace sodium;
@@ -1150,6 +1167,1532 @@ void test_sodium::lift_from_simultaneous()
     CPPUNIT_ASSERT(vector<int>({ 10 }) == *out);
 }
 
+void test_sodium::simultaneous_order()
+{
+    event_sink<int> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.map<int>([] (const int& x) { return x * 2; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+    vector<int> shouldBe;
+    {
+        transaction<> trans;
+        for (int i = 0; i < 100; i++) {
+            e.send(i);
+            shouldBe.push_back(i * 2);
+        }
+    }
+    kill();
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::loop_rank_raised_in_transaction()
+{
+    // The merge's output node gets an entry queued at its initial rank, and
+    // then loop() raises it, so the queued entry must be re-keyed.
+    partition* part = def_part::part();
+    unsigned long rekeys0 = part->rekey_count;
+    auto out = std::make_shared<vector<int>>();
+    std::function<void()> kill;
+    {
+        transaction<> trans;
+        event_sink<int> s;
+        event_loop<int> lp;
+        kill = lp.merge(s).listen([out] (const int& x) { out->push_back(x); });
+        s.send(1);
+        lp.loop(s.map<int>([] (const int& x) { return x + 1; })
+                 .map<int>([] (const int& x) { return x + 1; })
+                 .map<int>([] (const int& x) { return x + 1; }));
+    }
+    kill();
+    vector<int> shouldBe = { 4, 1 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+    CPPUNIT_ASSERT(part->rekey_count > rekeys0);
+}
+
+struct counted {
+    counted(int* live) : live(live) { (*live)++; }
+    counted(const counted& other) : live(other.live) { (*live)++; }
+    ~counted() { (*live)--; }
+    int* live;
+};
+
+struct alignas(64) over_aligned {
+    over_aligned(int* live) : c(live) {}
+    counted c;
+};
+
+void test_sodium::light_ptr_lifetime()
+{
+    int live = 0;
+    {
+        light_ptr a = light_ptr::create<counted>(counted(&live));
+        light_ptr b = light_ptr::create<over_aligned>(over_aligned(&live));
+        CPPUNIT_ASSERT_EQUAL(2, live);
+        CPPUNIT_ASSERT_EQUAL((size_t)0, (size_t)b.cast_ptr<over_aligned>(NULL) % alignof(over_aligned));
+        light_ptr a2 = a;
+        a = b;
+        CPPUNIT_ASSERT_EQUAL(2, live);
+        CPPUNIT_ASSERT(a2.cast_ptr<counted>(NULL)->live == &live);
+    }
+    CPPUNIT_ASSERT_EQUAL(0, live);
+    {
+        // Small trivially copyable values live inside the light_ptr.
+        light_ptr i = light_ptr::create<int>(123);
+        light_ptr j = i;
+        CPPUNIT_ASSERT(j.cast_ptr<int>(NULL) != i.cast_ptr<int>(NULL));
+        CPPUNIT_ASSERT((char*)j.cast_ptr<int>(NULL) >= (char*)&j &&
+                       (char*)j.cast_ptr<int>(NULL) < (char*)(&j + 1));
+        i = light_ptr::create<int>(456);
+        CPPUNIT_ASSERT_EQUAL(123, *j.cast_ptr<int>(NULL));
+        CPPUNIT_ASSERT_EQUAL(456, *i.cast_ptr<int>(NULL));
+        // All units share one instance.
+        light_ptr u1 = light_ptr::create<unit>(unit());
+        light_ptr u2 = light_ptr::create<unit>(unit());
+        CPPUNIT_ASSERT(u1.cast_ptr<unit>(NULL) == u2.cast_ptr<unit>(NULL));
+    }
+}
+
+void test_sodium::send_many_separate()
+{
+    event_sink<int> e;
+    behavior<int> b = e.hold(0);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.snapshot<int, int>(b, [] (const int& x, const int& y) { return x * 10 + y; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+    vector<int> xs = { 1, 2, 3 };
+    e.send_many(xs.begin(), xs.end());
+    kill();
+    // Each value sees the state left by the one before it.
+    vector<int> shouldBe = { 10, 21, 32 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+    CPPUNIT_ASSERT_EQUAL(3, b.sample());
+}
+
+void test_sodium::send_many_one_transaction()
+{
+    event_sink<int> e;
+    behavior<int> b = e.hold(0);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.snapshot<int, int>(b, [] (const int& x, const int& y) { return x * 10 + y; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+    vector<int> xs = { 1, 2, 3 };
+    e.send_many(xs.begin(), xs.end(), one_transaction);
+    kill();
+    vector<int> shouldBe = { 10, 20, 30 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+    CPPUNIT_ASSERT_EQUAL(3, b.sample());
+}
+
+void test_sodium::send_many_behavior()
+{
+    behavior_sink<string> b("a");
+    auto out = std::make_shared<vector<string>>();
+    transaction<> trans;
+    auto kill = b.value().listen([out] (const string& x) { out->push_back(x); });
+    trans.close();
+    vector<string> xs = { "b", "c", "d" };
+    b.send_many(std::make_move_iterator(xs.begin()), std::make_move_iterator(xs.end()));
+    kill();
+    vector<string> shouldBe = { "a", "b", "c", "d" };
+    CPPUNIT_ASSERT(shouldBe == *out);
+    CPPUNIT_ASSERT_EQUAL(string("d"), b.sample());
+}
+
+void test_sodium::sample_committed_value()
+{
+    behavior_sink<int> b(1);
+    behavior<int> m = b.map<int>([] (const int& x) { return x * 10; });
+    behavior<int> k(7);
+    CPPUNIT_ASSERT_EQUAL(1, b.sample_committed());
+    CPPUNIT_ASSERT_EQUAL(10, m.sample_committed());
+    CPPUNIT_ASSERT_EQUAL(7, k.sample_committed());
+    b.send(2);
+    CPPUNIT_ASSERT_EQUAL(2, b.sample_committed());
+    CPPUNIT_ASSERT_EQUAL(20, m.sample_committed());
+}
+
+static int triple(const int& x) { return x * 3; }
+static bool is_even(const int& x) { return x % 2 == 0; }
+
+void test_sodium::pipeline_chain()
+{
+    event_sink<int> e;
+    event<string> es = pipe(e)
+        .map([] (const int& x) { return x * 3; })
+        .filter([] (const int& x) { return x % 2 == 0; })
+        .map([] (const int& x) { return std::to_string(x); });
+    event<int> fanned = pipe(es).map([] (const string& s) { return (int)s.size(); });
+    std::shared_ptr<vector<string>> out(new vector<string>);
+    std::shared_ptr<vector<int>> sizes(new vector<int>);
+    auto kill1 = es.listen([out] (const string& s) { out->push_back(s); });
+    auto kill2 = fanned.listen([sizes] (const int& n) { sizes->push_back(n); });
+    for (int i = 1; i <= 6; i++)
+        e.send(i);
+    kill1();
+    kill2();
+    CPPUNIT_ASSERT(vector<string>({ "6", "12", "18" }) == *out);
+    CPPUNIT_ASSERT(vector<int>({ 1, 2, 2 }) == *sizes);
+
+    // Stages can be mutable, as they can with event::map() and filter().
+    int count = 0;
+    event<int> numbered = pipe(e)
+        .map([count] (const int& x) mutable { return ++count * 100 + x; })
+        .filter([count] (const int&) mutable { return ++count % 2 == 1; });
+    std::shared_ptr<vector<int>> nums(new vector<int>);
+    auto kill3 = numbered.listen([nums] (const int& n) { nums->push_back(n); });
+    for (int i = 1; i <= 4; i++)
+        e.send(i);
+    kill3();
+    CPPUNIT_ASSERT(vector<int>({ 101, 303 }) == *nums);
+
+    // Plain functions work as stages too.
+    event<int> named = pipe(e).map(triple).filter(is_even);
+    std::shared_ptr<vector<int>> evens(new vector<int>);
+    auto kill4 = named.listen([evens] (const int& n) { evens->push_back(n); });
+    for (int i = 1; i <= 4; i++)
+        e.send(i);
+    kill4();
+    CPPUNIT_ASSERT(vector<int>({ 6, 12 }) == *evens);
+}
+
+void test_sodium::pipeline_filter_optional_gate()
+{
+    event_sink<int> e;
+    behavior_sink<bool> open(true);
+    event<int> ev = pipe(e)
+        .map([] (const int& x) { return x > 0 ? boost::optional<int>(x) : boost::optional<int>(); })
+        .filter_optional()
+        .gate(open);
+    std::shared_ptr<vector<int>> out(new vector<int>);
+    auto kill = ev.listen([out] (const int& x) { out->push_back(x); });
+    e.send(1);
+    e.send(-2);
+    open.send(false);
+    e.send(3);
+    {
+        transaction<> trans;
+        open.send(true);
+        e.send(4);  // Still closed: the behavior changes at the end of the transaction
+    }
+    e.send(5);
+    kill();
+    CPPUNIT_ASSERT(vector<int>({ 1, 5 }) == *out);
+}
+
+void test_sodium::unlisten_many()
+{
+    event_sink<int> e;
+    std::shared_ptr<vector<int>> out(new vector<int>);
+    vector<std::function<void()>> kills;
+    for (int i = 0; i < 100; i++)
+        kills.push_back(e.listen([out, i] (const int& x) { out->push_back(i * 1000 + x); }));
+    // Enough to make the sink's targets get compacted.
+    for (int i = 0; i < 100; i++)
+        if (i % 4 != 1)
+            kills[i]();
+    e.send(7);
+    for (int i = 1; i < 100; i += 4)
+        kills[i]();
+    e.send(8);
+    vector<int> shouldBe;
+    for (int i = 97; i >= 1; i -= 4)
+        shouldBe.push_back(i * 1000 + 7);
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::loop_raises_long_chain()
+{
+    // Looping raises the rank of every node in the chain, which would go too deep
+    // for a recursive walk.
+    const int length = 100000;
+    auto out = std::make_shared<vector<int>>();
+    std::function<void()> kill;
+    event_sink<int> s;
+    {
+        transaction<> trans;
+        event_loop<int> lp;
+        event<int> chain = lp;
+        for (int i = 0; i < length; i++)
+            chain = chain.map<int>([] (const int& x) { return x + 1; });
+        kill = chain.listen([out] (const int& x) { out->push_back(x); });
+        lp.loop(s.map<int>([] (const int& x) { return x + 1; })
+                 .map<int>([] (const int& x) { return x + 1; }));
+    }
+    s.send(0);
+    kill();
+    vector<int> shouldBe = { length + 2 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::relink_lowers_inflated_input()
+{
+    // x is left ranked above a deep chain it no longer listens to, so linking it
+    // to w lowers x rather than raising w and everything after it.
+    event_sink<int> ea;
+    event<int> deep = ea;
+    for (int i = 0; i < 20; i++)
+        deep = deep.map<int>([] (const int& x) { return x + 1; });
+    behavior_sink<event<int>> bsw1(deep);
+    event<int> x = switch_e(bsw1);
+    bsw1.send(ea);
+    behavior_sink<event<int>> bsw2(ea.map<int>([] (const int& a) { return a * 10; }));
+    event<int> w = switch_e(bsw2);
+    behavior<int> bw = w.hold(0);
+    behavior<int> bx = x.hold(0);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = lift<int, int, int>([] (const int& a, const int& b) { return a * 100 + b; }, bw, bx)
+        .updates().listen([out] (const int& v) { out->push_back(v); });
+    ea.send(1);
+    bsw2.send(x.map<int>([] (const int& a) { return a + 1; }));
+    ea.send(2);
+    ea.send(3);
+    kill();
+    vector<int> shouldBe = { 1001, 302, 403 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::arena_reuse()
+{
+    impl::arena a;
+    void* first = a.allocate(100);
+    a.reset();
+    // Rewound, not freed.
+    CPPUNIT_ASSERT_EQUAL(first, a.allocate(100));
+    // Bigger than a block, so it grows, and reset() merges the blocks into one
+    // that the next round of the same size fits in.
+    char* big = (char*)a.allocate(5000);
+    memset(big, 1, 5000);
+    a.reset();
+    char* again = (char*)a.allocate(100);
+    char* big2 = (char*)a.allocate(5000);
+    memset(big2, 2, 5000);
+    CPPUNIT_ASSERT(big2 == again + 112);
+}
+
+struct recycle_part {
+    static partition* part()
+    {
+        static partition p;
+        return &p;
+    }
+};
+
+void test_sodium::transaction_recycled()
+{
+    impl::transaction_impl* first;
+    {
+        transaction<recycle_part> trans;
+        first = trans.impl();
+    }
+    {
+        transaction<recycle_part> trans;
+        // The finished one is kept for the next.
+        CPPUNIT_ASSERT_EQUAL(first, trans.impl());
+        {
+            // Nested transactions join it.
+            transaction<recycle_part> nested;
+            CPPUNIT_ASSERT_EQUAL(first, nested.impl());
+#if !defined(SODIUM_SINGLE_THREADED)
+            // Another partition's is its own.
+            transaction<> other;
+            CPPUNIT_ASSERT(other.impl() != first);
+#endif
+        }
+        CPPUNIT_ASSERT_EQUAL(first, trans.impl());
+    }
+    // Nothing is left queued from one to the next.
+    event_sink<int, recycle_part> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.map<int>([] (const int& x) { return x * 2; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+    for (int i = 0; i < 3; i++)
+        e.send(i);
+    {
+        transaction<recycle_part> trans;
+        CPPUNIT_ASSERT_EQUAL(first, trans.impl());
+        e.send(3);
+        e.send(4);
+    }
+    kill();
+    vector<int> shouldBe = { 0, 2, 4, 6, 8 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::transaction_throws()
+{
+    event_sink<int> e;
+    behavior<int> b = e.hold(0);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.listen([out] (const int& x) {
+        if (x == 1)
+            throw std::runtime_error("bang");
+        out->push_back(x);
+    });
+    e.send(0);
+    bool caught = false;
+    try {
+        transaction<> trans;
+        e.send(1);
+        trans.close();
+    }
+    catch (const std::runtime_error&) {
+        caught = true;
+    }
+    CPPUNIT_ASSERT(caught);
+    // The rest of the transaction is dropped, but what it did is wound up, so
+    // the firing isn't replayed to a new listener.
+    auto replayed = std::make_shared<vector<int>>();
+    auto kill2 = e.listen([replayed] (const int& x) { replayed->push_back(x); });
+    CPPUNIT_ASSERT(replayed->empty());
+    // The partition is usable afterwards, from this thread and others.
+    e.send(2);
+    std::thread([e] () { e.send(3); }).join();
+    kill();
+    kill2();
+    vector<int> shouldBe = { 0, 2, 3 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+    CPPUNIT_ASSERT_EQUAL(3, b.sample());
+}
+
+void test_sodium::transaction_large_closure()
+{
+    // Closures bigger than an arena block, queued in consecutive transactions.
+    std::array<int, 1024> big;
+    for (size_t i = 0; i < big.size(); i++)
+        big[i] = (int)i;
+    auto sum = std::make_shared<long>(0);
+    for (int round = 0; round < 3; round++) {
+        transaction<> trans;
+        trans.impl()->prioritized(SODIUM_SHARED_PTR<impl::node>(), [big, sum] (impl::transaction_impl*) {
+            for (size_t i = 0; i < big.size(); i++)
+                *sum += big[i];
+        });
+        trans.impl()->last([big, sum] () {
+            *sum += big[big.size() - 1];
+        });
+    }
+    CPPUNIT_ASSERT_EQUAL(3 * (1023L * 1024 / 2 + 1023), *sum);
+}
+
+#if defined(SODIUM_ATOMIC_COUNTS)
+struct counted_atomic {
+    counted_atomic(std::atomic<int>* live) : live(live) { (*live)++; }
+    counted_atomic(const counted_atomic& other) : live(other.live) { (*live)++; }
+    ~counted_atomic() { (*live)--; }
+    std::atomic<int>* live;
+};
+
+void test_sodium::light_ptr_threaded_copy()
+{
+    std::atomic<int> live(0);
+    {
+        light_ptr p = light_ptr::create<counted_atomic>(counted_atomic(&live));
+        vector<std::thread> threads;
+        for (int t = 0; t < 4; t++)
+            threads.push_back(std::thread([&p] () {
+                for (int i = 0; i < 100000; i++) {
+                    light_ptr a(p);
+                    light_ptr b;
+                    b = a;
+                    a = b;
+                }
+            }));
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+        CPPUNIT_ASSERT_EQUAL(1, live.load());
+    }
+    CPPUNIT_ASSERT_EQUAL(0, live.load());
+    // Whichever thread drops the last copy destroys the value, exactly once.
+    for (int i = 0; i < 1000; i++) {
+        light_ptr p = light_ptr::create<counted_atomic>(counted_atomic(&live));
+        light_ptr q1 = p, q2 = p;
+        std::thread t1([&q1] () { q1 = light_ptr(); });
+        std::thread t2([&q2] () { q2 = light_ptr(); });
+        p = light_ptr();
+        t1.join();
+        t2.join();
+        CPPUNIT_ASSERT_EQUAL(0, live.load());
+    }
+}
+
+void test_sodium::listen_threaded()
+{
+    event_sink<int> e;
+    std::atomic<int> fired(0);
+    auto token = std::make_shared<int>(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([e, token, &fired] () {
+            for (int i = 0; i < 2000; i++) {
+                std::function<void()> kill = e.map<int>([token] (const int& x) { return x + 1; })
+                                              .listen([token, &fired] (const int&) { fired++; });
+                e.send(i);
+                kill();
+            }
+        }));
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+    // Each listener sees at least its own thread's send.
+    CPPUNIT_ASSERT(fired.load() >= 4 * 2000);
+    CPPUNIT_ASSERT_EQUAL(1L, token.use_count());
+}
+
+/*
+ * Drop the last event, the listener and the sink on three threads at once, so
+ * that the node and event counts race each other to zero and to the teardown.
+ */
+void test_sodium::listen_teardown_race()
+{
+    auto token = std::make_shared<int>(0);
+    for (int i = 0; i < 2000; i++) {
+        event_sink<int> e;
+        event<int> m = e.map<int>([token] (const int& x) { return x; });
+        std::function<void()> kill = m.listen([token] (const int&) {});
+        e.send(i);
+        std::thread a([&m] () { m = event<int>(); });
+        std::thread b([&kill] () { kill(); kill = std::function<void()>(); });
+        std::thread c([&e] () { e = event_sink<int>(); });
+        a.join();
+        b.join();
+        c.join();
+        CPPUNIT_ASSERT_EQUAL(1L, token.use_count());
+    }
+}
+
+/*
+ * The counts in a count_set go past what fits in its word, without carrying
+ * into their neighbours, and come back down again, from any number of threads.
+ */
+void test_sodium::count_set_capacity()
+{
+    impl::count_set cs;
+    const unsigned n = 3000000;
+    for (unsigned i = 0; i < n; i++)
+        cs.inc_event();
+    cs.inc_node();
+    CPPUNIT_ASSERT_EQUAL(n, cs.event_count());
+    CPPUNIT_ASSERT_EQUAL(0u, cs.strong_count());
+    CPPUNIT_ASSERT_EQUAL(1u, cs.node_count());
+    bool claimed = false;
+    bool claimedEarly = false;
+    for (unsigned i = 0; i + 1 < n; i++) {
+        cs.dec_and_claim(impl::count_set::event_unit, claimed);
+        claimedEarly = claimedEarly || claimed;
+    }
+    CPPUNIT_ASSERT(!claimedEarly);
+    CPPUNIT_ASSERT_EQUAL(1u, cs.event_count());
+    cs.dec_and_claim(impl::count_set::event_unit, claimed);
+    // Dropping the last event count left it inactive, so that step claimed the teardown.
+    CPPUNIT_ASSERT(claimed);
+    CPPUNIT_ASSERT_EQUAL(1u, cs.strong_count());
+    CPPUNIT_ASSERT_EQUAL(0u, cs.event_count());
+    CPPUNIT_ASSERT(impl::count_set::alive(cs.end_teardown()));
+    cs.dec_and_claim(impl::count_set::node_unit, claimed);
+    CPPUNIT_ASSERT(!claimed);
+
+    impl::count_set shared;
+    vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([&shared] () {
+            for (int i = 0; i < 400000; i++)
+                shared.inc_node();
+        }));
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+    CPPUNIT_ASSERT_EQUAL(1600000u, shared.node_count());
+    CPPUNIT_ASSERT_EQUAL(0u, shared.event_count());
+    threads.clear();
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([&shared] () {
+            for (int i = 0; i < 400000; i++) {
+                shared.inc_strong();
+                shared.dec(impl::count_set::node_unit);
+                shared.dec(impl::count_set::strong_unit);
+            }
+        }));
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+    CPPUNIT_ASSERT_EQUAL(0u, shared.node_count());
+    CPPUNIT_ASSERT_EQUAL(0u, shared.strong_count());
+}
+#endif
+
+struct tracked {
+    tracked(int v, int* copies) : v(v), copies(copies) {}
+    tracked(const tracked& other) : v(other.v), copies(other.copies) { (*copies)++; }
+    tracked(tracked&& other) : v(other.v), copies(other.copies) { other.v = -1; }
+    tracked& operator = (const tracked& other) { v = other.v; copies = other.copies; (*copies)++; return *this; }
+    int v;
+    int* copies;
+};
+
+static list<tracked> tracked_list(int* copies)
+{
+    list<tracked> l;
+    for (int i = 1; i <= 3; i++)
+        l.push_back(tracked(i, copies));
+    return l;
+}
+
+void test_sodium::split_moves_when_unique()
+{
+    int copies = 0;
+    event_sink<list<tracked>> ea;
+    auto out = std::make_shared<vector<int>>();
+    auto unlisten = split(event<list<tracked>>(ea)).listen([out] (const tracked& t) { out->push_back(t.v); });
+    ea.send(tracked_list(&copies));
+    unlisten();
+    CPPUNIT_ASSERT(vector<int>({ 1, 2, 3 }) == *out);
+    CPPUNIT_ASSERT_EQUAL(0, copies);
+}
+
+void test_sodium::split_copies_when_shared()
+{
+    int copies = 0;
+    event_sink<list<tracked>> ea;
+    // The behavior still holds the list when split's post runs.
+    behavior<list<tracked>> held = ea.hold(list<tracked>());
+    auto out = std::make_shared<vector<int>>();
+    auto unlisten = split(event<list<tracked>>(ea)).listen([out] (const tracked& t) { out->push_back(t.v); });
+    ea.send(tracked_list(&copies));
+    unlisten();
+    CPPUNIT_ASSERT(vector<int>({ 1, 2, 3 }) == *out);
+    CPPUNIT_ASSERT_EQUAL(3, copies);
+    list<tracked> l = held.sample();
+    vector<int> vs;
+    for (list<tracked>::const_iterator it = l.begin(); it != l.end(); ++it)
+        vs.push_back(it->v);
+    CPPUNIT_ASSERT(vector<int>({ 1, 2, 3 }) == vs);
+}
+
+void test_sodium::collect_state_handoff()
+{
+    event_sink<string> ea;
+    event<string> ec = ea.collect<string, string>(string("collected so far:"), [] (const string& a, const string& s) {
+        string next = s + " " + a;
+        return std::make_tuple(next, next);
+    });
+    behavior<string> held = ec.hold(string());
+    auto out = std::make_shared<vector<string>>();
+    auto unlisten = ec.listen([out] (const string& x) { out->push_back(x); });
+    ea.send("alpha");
+    ea.send("beta");
+    ea.send("gamma");
+    unlisten();
+    CPPUNIT_ASSERT(vector<string>({ string("collected so far: alpha"),
+                                    string("collected so far: alpha beta"),
+                                    string("collected so far: alpha beta gamma") }) == *out);
+    CPPUNIT_ASSERT_EQUAL(string("collected so far: alpha beta gamma"), held.sample());
+}
+
+/*
+ * accum shares its state with the value it outputs, so split mustn't move the
+ * elements out from under it.
+ */
+void test_sodium::accum_state_handoff()
+{
+    event_sink<string> ea;
+    event<list<string>> acc = ea.accum_e<list<string>>(list<string>(), [] (const string& a, const list<string>& l) {
+        list<string> next = l;
+        next.push_back(a);
+        return next;
+    });
+    auto out = std::make_shared<vector<string>>();
+    auto unlisten = split(acc).listen([out] (const string& x) { out->push_back(x); });
+    string a("the first string, long enough to be on the heap");
+    string b("the second string, long enough to be on the heap");
+    string c("the third string, long enough to be on the heap");
+    ea.send(a);
+    ea.send(b);
+    ea.send(c);
+    unlisten();
+    CPPUNIT_ASSERT(vector<string>({ a, a, b, a, b, c }) == *out);
+}
+
+struct offset_counter {
+    offset_counter() : n(0) {}
+    int operator () (const int& x) { return x + n++; }
+    int n;
+};
+
+/*
+ * Functions that change their own state, which map, filter and listen must
+ * call on their own copy whether or not the handlers are typed.
+ */
+void test_sodium::mutable_handlers()
+{
+    event_sink<int> e;
+    auto out = std::make_shared<vector<int>>();
+    int count = 0;
+    int total = 0;
+    auto kill = e.map<int>(offset_counter())
+                 .filter([count] (const int&) mutable { return ++count % 2 == 1; })
+                 .listen([out, total] (const int& x) mutable { total += x; out->push_back(total); });
+    e.send(10);
+    e.send(20);
+    e.send(30);
+    e.send(40);
+    kill();
+    CPPUNIT_ASSERT(vector<int>({ 10, 42 }) == *out);
+}
+
+void test_sodium::std_function_handlers()
+{
+    event_sink<int> e;
+    auto out = std::make_shared<vector<int>>();
+    std::function<int(const int&)> f = [] (const int& x) { return x * 2; };
+    std::function<bool(const int&)> pred = [] (const int& x) { return x > 2; };
+    std::function<void(const int&)> handle = [out] (const int& x) { out->push_back(x); };
+    auto kill = e.map<int>(f).filter(pred).listen(handle);
+    e.send(1);
+    e.send(2);
+    e.send(3);
+    kill();
+    CPPUNIT_ASSERT(vector<int>({ 4, 6 }) == *out);
+}
+
+static int twice(const int& x) { return x * 2; }
+static bool over_two(const int& x) { return x > 2; }
+static vector<int> plain_out;
+static void record(const int& x) { plain_out.push_back(x); }
+
+void test_sodium::plain_function_handlers()
+{
+    event_sink<int> e;
+    plain_out.clear();
+    auto kill = e.map<int>(twice).filter(over_two).listen(record);
+    e.send(1);
+    e.send(2);
+    e.send(3);
+    kill();
+    CPPUNIT_ASSERT(vector<int>({ 4, 6 }) == plain_out);
+}
+
+#if defined(SODIUM_COMMITTED_READS)
+void test_sodium::sample_committed_during_transaction()
+{
+    behavior_sink<int> b(1);
+    transaction<> trans;
+    b.send(5);
+    // Mustn't wait for the transaction this thread holds open.
+    std::future<int> f = std::async(std::launch::async, [b] () { return b.sample_committed(); });
+    bool ready = f.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+    trans.close();
+    CPPUNIT_ASSERT(ready);
+    CPPUNIT_ASSERT_EQUAL(1, f.get());
+    CPPUNIT_ASSERT_EQUAL(5, b.sample_committed());
+}
+
+void test_sodium::sample_committed_consistent()
+{
+    behavior_sink<int> b1(0);
+    behavior_sink<int> b2(0);
+    std::atomic<bool> done(false);
+    std::thread writer([&b1, &b2, &done] () {
+        for (int i = 1; i <= 2000; i++) {
+            transaction<> trans;
+            b1.send(i);
+            b2.send(-i);
+        }
+        done = true;
+    });
+    bool consistent = true;
+    while (!done) {
+        std::tuple<int, int> v = sample_committed(b1, b2);
+        if (std::get<0>(v) != -std::get<1>(v))
+            consistent = false;
+    }
+    writer.join();
+    CPPUNIT_ASSERT(consistent);
+    CPPUNIT_ASSERT(std::make_tuple(2000, -2000) == sample_committed(b1, b2));
+}
+#endif
+
+#if defined(SODIUM_PARALLEL)
+struct parallel_part {
+    static partition* part()
+    {
+        static partition p;
+        return &p;
+    }
+};
+
+/*
+ * A wide fan-out of map/filter chains, some of which fire twice in a transaction.
+ */
+template <class P>
+static vector<int> fan_out()
+{
+    event_sink<int, P> e;
+    auto out = std::make_shared<vector<int>>();
+    vector<std::function<void()>> kills;
+    for (int i = 0; i < 100; i++) {
+        event<int, P> ev = e.template map<int>([i] (const int& x) { return x * 1000 + i; });
+        if (i % 3 == 0)
+            ev = ev.filter([] (const int& x) { return x % 2 == 0; });
+        ev = ev.template map<int>([] (const int& x) { return x + 1; });
+        kills.push_back(ev.listen([out] (const int& x) { out->push_back(x); }));
+    }
+    vector<int> xs = { 1, 2, 3 };
+    e.send_many(xs.begin(), xs.end(), one_transaction);
+    e.send(4);
+    for (size_t i = 0; i < kills.size(); i++)
+        kills[i]();
+    return *out;
+}
+
+void test_sodium::parallel_same_rank()
+{
+    vector<int> serial = fan_out<def_part>();
+    parallel_part::part()->set_parallel(4, 8);
+    vector<int> parallel = fan_out<parallel_part>();
+    parallel_part::part()->set_parallel(0);
+    CPPUNIT_ASSERT_EQUAL((size_t)((66 + 17) * 4), serial.size());
+    CPPUNIT_ASSERT(serial == parallel);
+}
+#endif
+
+#if defined(SODIUM_INGRESS_QUEUE)
+struct ingress_part {
+    static partition* part()
+    {
+        static partition p;
+        return &p;
+    }
+};
+
+void test_sodium::ingress_queue_per_send()
+{
+    partition* part = ingress_part::part();
+    part->set_ingress(sodium::ingress_per_send);
+    event_sink<int, ingress_part> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.listen([out] (const int& x) { out->push_back(x); });
+    vector<std::thread> producers;
+    for (int t = 0; t < 4; t++)
+        producers.push_back(std::thread([e, t] () {
+            for (int i = 0; i < 1000; i++)
+                e.send(t * 1000 + i);
+        }));
+    for (size_t t = 0; t < producers.size(); t++)
+        producers[t].join();
+    kill();
+    part->set_ingress(ingress_off);
+    CPPUNIT_ASSERT_EQUAL((size_t)4000, out->size());
+    // Each producer's values arrive in the order it sent them.
+    int last[4] = { -1, -1, -1, -1 };
+    for (size_t i = 0; i < out->size(); i++) {
+        int x = (*out)[i];
+        CPPUNIT_ASSERT(x > last[x / 1000]);
+        last[x / 1000] = x;
+    }
+}
+
+void test_sodium::ingress_queue_batch()
+{
+    partition* part = ingress_part::part();
+    part->set_ingress(sodium::ingress_batch, 3);
+    event_sink<int, ingress_part> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.coalesce([] (const int& a, const int& b) { return a + b; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+    // Pretend another thread is draining, so the sends queue up.
+    part->ingress_draining.store(true);
+    for (int i = 1; i <= 5; i++)
+        e.send(i);
+    CPPUNIT_ASSERT(out->empty());
+    part->drain_ingress();
+    kill();
+    part->set_ingress(ingress_off);
+    vector<int> shouldBe = { 1 + 2 + 3, 4 + 5 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::ingress_queue_send_many()
+{
+    partition* part = ingress_part::part();
+    part->set_ingress(sodium::ingress_per_send);
+    event_sink<int, ingress_part> e;
+    behavior<int, ingress_part> b = e.hold(0);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.snapshot<int, int>(b, [] (const int& x, const int& y) { return x * 10 + y; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+    // Pretend another thread is draining, so send_many has to queue behind send.
+    part->ingress_draining.store(true);
+    e.send(1);
+    vector<int> xs = { 2, 3 };
+    e.send_many(xs.begin(), xs.end());
+    vector<int> ys = { 4, 5 };
+    e.send_many(ys.begin(), ys.end(), one_transaction);
+    e.send(6);
+    CPPUNIT_ASSERT(out->empty());
+    part->drain_ingress();
+    kill();
+    part->set_ingress(ingress_off);
+    vector<int> shouldBe = { 10, 21, 32, 43, 53, 65 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::ingress_queue_throws()
+{
+    partition* part = ingress_part::part();
+    part->set_ingress(sodium::ingress_per_send);
+    event_sink<int, ingress_part> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.listen([out] (const int& x) {
+        if (x < 0)
+            throw std::runtime_error("bang");
+        out->push_back(x);
+    });
+    // Pretend another thread is draining, so the other thread's sends queue up.
+    part->ingress_draining.store(true);
+    std::future<void> failed;
+    std::thread([e, &failed] () {
+        e.send(-1);
+        e.send(2);
+        failed = e.send_async(-2);
+        e.send(3);
+    }).join();
+    part->ingress_draining.store(false);
+    // This thread drains them, but the exceptions aren't its own, and what comes
+    // after them still goes through.
+    e.send(1);
+    bool caught = false;
+    try {
+        failed.get();
+    }
+    catch (const std::runtime_error&) {
+        caught = true;
+    }
+    CPPUNIT_ASSERT(caught);
+    caught = false;
+    try {
+        e.send(-3);
+    }
+    catch (const std::runtime_error&) {
+        caught = true;
+    }
+    CPPUNIT_ASSERT(caught);
+    e.send(4);
+    kill();
+    part->set_ingress(ingress_off);
+    vector<int> shouldBe = { 2, 3, 1, 4 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::ingress_queue_hand_over()
+{
+    partition* part = ingress_part::part();
+    part->set_ingress(sodium::ingress_per_send);
+    part->ingress_share = 1;
+    event_sink<int, ingress_part> e;
+    auto out = std::make_shared<vector<std::pair<int, std::thread::id>>>();
+    std::thread last;
+    auto kill = e.listen([e, out, part, &last] (const int& x) {
+        out->push_back(std::make_pair(x, std::this_thread::get_id()));
+        // These sends queue up behind this one, as this thread is draining.
+        if (x == 0)
+            std::thread([e] () { e.send(20); }).join();
+        else if (x == 20)
+            std::thread([e] () { e.send(21); }).join();
+        // By now this thread has run its share and offered the queue, so the
+        // next sender takes it over.
+        else if (x == 21) {
+            last = std::thread([e] () { e.send(30); });
+            while (part->ingress_offered.load())
+                std::this_thread::yield();
+        }
+    });
+    e.send(0);
+    last.join();
+    kill();
+    part->ingress_share = 64;
+    part->set_ingress(ingress_off);
+    CPPUNIT_ASSERT_EQUAL((size_t)4, out->size());
+    int shouldBe[4] = { 0, 20, 21, 30 };
+    for (int i = 0; i < 4; i++)
+        CPPUNIT_ASSERT_EQUAL(shouldBe[i], (*out)[i].first);
+    CPPUNIT_ASSERT((*out)[2].second == std::this_thread::get_id());
+    CPPUNIT_ASSERT((*out)[3].second != std::this_thread::get_id());
+}
+
+struct executor_part {
+    static partition* part()
+    {
+        static partition p;
+        return &p;
+    }
+};
+
+void test_sodium::executor_send()
+{
+    executor_policy* ex = new executor_policy;
+    policy::set_global(ex);
+    ex->start(executor_part::part());
+    event_sink<int, executor_part> e;
+    auto out = std::make_shared<vector<int>>();
+    auto threads = std::make_shared<std::set<std::thread::id>>();
+    auto kill = e.listen([out, threads] (const int& x) {
+        out->push_back(x);
+        threads->insert(std::this_thread::get_id());
+    });
+    for (int i = 0; i < 100; i++)
+        e.send(i);
+    e.send_async(100).wait();
+    kill();
+    ex->stop(executor_part::part());
+    policy::set_global(new simple_policy);
+    CPPUNIT_ASSERT_EQUAL((size_t)101, out->size());
+    for (int i = 0; i <= 100; i++)
+        CPPUNIT_ASSERT_EQUAL(i, (*out)[i]);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, threads->size());
+    CPPUNIT_ASSERT(*threads->begin() != std::this_thread::get_id());
+}
+
+void test_sodium::executor_send_many_order()
+{
+    executor_policy* ex = new executor_policy;
+    policy::set_global(ex);
+    ex->start(executor_part::part());
+    event_sink<int, executor_part> e;
+    behavior<int, executor_part> b = e.hold(0);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.snapshot<int, int>(b, [] (const int& x, const int& y) { return x * 10 + y; })
+                 .listen([out] (const int& x) {
+        // Hold the executor up, so this thread gets well ahead of it.
+        if (x == 10)
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        out->push_back(x);
+    });
+    e.send(1);
+    e.send(2);
+    vector<int> xs = { 3, 4 };
+    e.send_many(xs.begin(), xs.end());
+    vector<int> ys = { 5, 6 };
+    e.send_many(ys.begin(), ys.end(), one_transaction);
+    e.send_async(7).wait();
+    kill();
+    ex->stop(executor_part::part());
+    policy::set_global(new simple_policy);
+    vector<int> shouldBe = { 10, 21, 32, 43, 54, 64, 76 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::executor_throws()
+{
+    executor_policy* ex = new executor_policy;
+    policy::set_global(ex);
+    ex->start(executor_part::part());
+    event_sink<int, executor_part> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.listen([out] (const int& x) {
+        if (x < 0)
+            throw std::runtime_error("bang");
+        out->push_back(x);
+    });
+    e.send(-1);
+    e.send_async(1).get();
+    bool caught = false;
+    try {
+        e.send_async(-2).get();
+    }
+    catch (const std::runtime_error&) {
+        caught = true;
+    }
+    CPPUNIT_ASSERT(caught);
+    // The executor carries on.
+    e.send_async(2).get();
+    kill();
+    ex->stop(executor_part::part());
+    policy::set_global(new simple_policy);
+    vector<int> shouldBe = { 1, 2 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+void test_sodium::executor_cross()
+{
+    executor_policy* ex = new executor_policy;
+    policy::set_global(ex);
+    ex->start(executor_part::part());
+    event_sink<string> e;
+    event_sink<string, executor_part> fence;
+    auto out = std::make_shared<vector<string>>();
+    auto kill = cross<string, def_part, executor_part>(e)
+        .map<string>([] (const string& x) { return x + "!"; })
+        .listen([out] (const string& x) { out->push_back(x); });
+    e.send("a");
+    e.send("b");
+    // The queue is FIFO, so once this has been through, so have the crossings.
+    fence.send_async("").wait();
+    {
+        // Nothing crosses until the transaction it was sent in has committed, so
+        // even the end of the transaction is too early.
+        transaction<> trans;
+        e.send("c");
+        auto early = std::make_shared<size_t>(0);
+        trans.impl()->last([fence, out, early] () {
+            fence.send_async("").wait();
+            *early = out->size();
+        });
+        trans.close();
+        CPPUNIT_ASSERT_EQUAL((size_t)2, *early);
+    }
+    fence.send_async("").wait();
+    kill();
+    ex->stop(executor_part::part());
+    policy::set_global(new simple_policy);
+    vector<string> shouldBe = { "a!", "b!", "c!" };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+
+template <int I>
+struct stealing_part {
+    static partition* part()
+    {
+        static partition p;
+        return &p;
+    }
+};
+
+struct stealing_record {
+    stealing_record() : inside(0), overlapped(false) {}
+    std::atomic<int> inside;
+    bool overlapped;
+    vector<int> values;
+};
+
+template <int I>
+static void stealing_graph(work_stealing_policy* ws, vector<std::function<void(int)>>& sends,
+    vector<std::function<std::future<void>()>>& fences, vector<std::function<void()>>& kills,
+    const std::shared_ptr<stealing_record>& rec)
+{
+    ws->attach(stealing_part<I>::part());
+    event_sink<int, stealing_part<I>> e;
+    kills.push_back(e.listen([rec] (const int& x) {
+        if (rec->inside.fetch_add(1) != 0)
+            rec->overlapped = true;
+        rec->values.push_back(x);
+        rec->inside.fetch_sub(1);
+    }));
+    sends.push_back([e] (int x) { e.send(x); });
+    fences.push_back([e] () { return e.send_async(-1); });
+}
+
+void test_sodium::work_stealing()
+{
+    work_stealing_policy* ws = new work_stealing_policy(3, 4);
+    policy::set_global(ws);
+    vector<std::function<void(int)>> sends;
+    vector<std::function<std::future<void>()>> fences;
+    vector<std::function<void()>> kills;
+    vector<std::shared_ptr<stealing_record>> recs;
+    for (int i = 0; i < 8; i++)
+        recs.push_back(std::make_shared<stealing_record>());
+    stealing_graph<0>(ws, sends, fences, kills, recs[0]);
+    stealing_graph<1>(ws, sends, fences, kills, recs[1]);
+    stealing_graph<2>(ws, sends, fences, kills, recs[2]);
+    stealing_graph<3>(ws, sends, fences, kills, recs[3]);
+    stealing_graph<4>(ws, sends, fences, kills, recs[4]);
+    stealing_graph<5>(ws, sends, fences, kills, recs[5]);
+    stealing_graph<6>(ws, sends, fences, kills, recs[6]);
+    stealing_graph<7>(ws, sends, fences, kills, recs[7]);
+    vector<std::thread> producers;
+    for (int t = 0; t < 2; t++)
+        producers.push_back(std::thread([&sends, t] () {
+            for (int i = 0; i < 200; i++)
+                for (size_t p = 0; p < sends.size(); p++)
+                    sends[p](t * 1000 + i);
+        }));
+    for (size_t t = 0; t < producers.size(); t++)
+        producers[t].join();
+    for (size_t p = 0; p < fences.size(); p++)
+        fences[p]().wait();
+    for (size_t p = 0; p < kills.size(); p++)
+        kills[p]();
+    policy::set_global(new simple_policy);
+    for (size_t p = 0; p < recs.size(); p++) {
+        const stealing_record& rec = *recs[p];
+        CPPUNIT_ASSERT(!rec.overlapped);
+        CPPUNIT_ASSERT_EQUAL((size_t)401, rec.values.size());
+        CPPUNIT_ASSERT_EQUAL(-1, rec.values.back());
+        int last[2] = { -1, -1 };
+        for (size_t i = 0; i + 1 < rec.values.size(); i++) {
+            int x = rec.values[i];
+            CPPUNIT_ASSERT(x % 1000 > last[x / 1000]);
+            last[x / 1000] = x % 1000;
+        }
+    }
+}
+
+void test_sodium::work_stealing_detach()
+{
+    work_stealing_policy* ws = new work_stealing_policy(2, 4);
+    policy::set_global(ws);
+    partition* part = stealing_part<8>::part();
+    ws->attach(part);
+    event_sink<int, stealing_part<8>> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.listen([out] (const int& x) { out->push_back(x); });
+    for (int i = 0; i < 1000; i++)
+        e.send(i);
+    // Waits for the pool to run everything queued.
+    ws->detach(part);
+    CPPUNIT_ASSERT_EQUAL((size_t)1000, out->size());
+    CPPUNIT_ASSERT_EQUAL(999, out->back());
+    CPPUNIT_ASSERT(part->exec.load() == NULL);
+    // Sends are this thread's own again.
+    e.send(1000);
+    CPPUNIT_ASSERT_EQUAL(1000, out->back());
+    kill();
+    policy::set_global(new simple_policy);
+}
+
+void test_sodium::work_stealing_throws()
+{
+    work_stealing_policy* ws = new work_stealing_policy(2, 4);
+    policy::set_global(ws);
+    partition* part = stealing_part<9>::part();
+    ws->attach(part);
+    event_sink<int, stealing_part<9>> e;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = e.listen([out] (const int& x) {
+        if (x < 0)
+            throw std::runtime_error("bang");
+        out->push_back(x);
+    });
+    for (int i = 0; i < 10; i++)
+        e.send(i % 2 == 0 ? i : -i);
+    e.send_async(10).get();
+    bool caught = false;
+    try {
+        e.send_async(-11).get();
+    }
+    catch (const std::runtime_error&) {
+        caught = true;
+    }
+    CPPUNIT_ASSERT(caught);
+    e.send(12);
+    // The worker let go of the partition, so this doesn't wait forever.
+    ws->detach(part);
+    kill();
+    policy::set_global(new simple_policy);
+    vector<int> shouldBe = { 0, 2, 4, 6, 8, 10, 12 };
+    CPPUNIT_ASSERT(shouldBe == *out);
+}
+#endif
+
+#if defined(SODIUM_METRICS)
+void test_sodium::metrics_partition()
+{
+    event_sink<int> e;
+    behavior<int> b = e.hold(0);
+    auto kill = e.merge(e.map<int>([] (const int& x) { return x + 1; }))
+        .listen([] (const int&) {});
+    metrics_snapshot m0 = snapshot_metrics();
+    for (int i = 0; i < 10; i++)
+        e.send(i);
+    metrics_snapshot m1 = snapshot_metrics();
+    // Snapshots don't touch the partition, so one reader can't disturb another's rate.
+    metrics_snapshot m2 = snapshot_metrics();
+    kill();
+    CPPUNIT_ASSERT_EQUAL(m0.partition.transactions + 10, m1.partition.transactions);
+    CPPUNIT_ASSERT(m1.partition.prioritized_peak >= 2);
+    CPPUNIT_ASSERT(m1.partition.last_peak >= 1);
+    CPPUNIT_ASSERT(m1.partition.lock_seconds > 0);
+    CPPUNIT_ASSERT(transactions_per_sec(m0, m1) > 0);
+    CPPUNIT_ASSERT_EQUAL(m1.partition.transactions, m2.partition.transactions);
+    CPPUNIT_ASSERT(transactions_per_sec(m0, m2) > 0);
+    CPPUNIT_ASSERT_EQUAL(0.0, transactions_per_sec(m1, m2));
+    std::string text = to_prometheus(m1, "p\"1");
+    CPPUNIT_ASSERT(text.find("# TYPE sodium_transactions_total counter\n") != std::string::npos);
+    std::ostringstream line;
+    line << "sodium_transactions_total{partition=\"p\\\"1\"} " << m1.partition.transactions << "\n";
+    CPPUNIT_ASSERT(text.find(line.str()) != std::string::npos);
+}
+#endif
+
+#if defined(SODIUM_NODE_METRICS)
+void test_sodium::metrics_nodes()
+{
+    event_sink<int> e;
+    event<int> ea = e.map<int>([] (const int& x) { return x * 2; });
+    auto kill1 = ea.listen([] (const int&) {});
+    auto kill2 = ea.listen([] (const int&) {});
+    for (int i = 0; i < 7; i++)
+        e.send(i);
+    metrics_snapshot m = snapshot_metrics();
+    kill1();
+    kill2();
+    // Nodes from other tests can still be alive, but only ea fired 7 times into
+    // two listeners.
+    int found = 0;
+    for (size_t i = 0; i < m.nodes.size(); i++)
+        if (m.nodes[i].fan_out == 2 && m.nodes[i].firings == 7) {
+            found++;
+            CPPUNIT_ASSERT(m.nodes[i].handler_seconds > 0);
+        }
+    CPPUNIT_ASSERT_EQUAL(1, found);
+    CPPUNIT_ASSERT(to_prometheus(m).find("sodium_node_fan_out{node=\"") != std::string::npos);
+}
+#endif
+
+#if defined(SODIUM_INTROSPECTION)
+void test_sodium::introspect_walk()
+{
+    event_sink<int> e;
+    event<int> m = e.map<int>([] (const int& x) { return x + 1; });
+    event<int> f = m.filter([] (const int& x) { return x > 0; });
+    behavior<int> b = m.hold(0);
+    auto kill = f.listen([] (const int&) {});
+    // From the behavior, the walk goes up to e and back down to f's listener.
+    graph g = graph_walk().add(b).run();
+    kill();
+    std::map<std::string, const graph_node*> by_kind;
+    for (size_t i = 0; i < g.nodes.size(); i++)
+        by_kind[g.nodes[i].kind] = &g.nodes[i];
+    CPPUNIT_ASSERT(by_kind.count("sink") && by_kind.count("map") && by_kind.count("filter") && by_kind.count("listen"));
+    const graph_node& sink = *by_kind["sink"];
+    const graph_node& mapped = *by_kind["map"];
+    CPPUNIT_ASSERT(mapped.rank > sink.rank);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, sink.targets);
+    CPPUNIT_ASSERT_EQUAL((size_t)2, mapped.targets);  // the filter and hold's listener
+    CPPUNIT_ASSERT_EQUAL((size_t)1, mapped.sources);
+    bool edge = false;
+    for (size_t i = 0; i < g.edges.size(); i++)
+        if (g.edges[i].from == sink.id && g.edges[i].to == mapped.id)
+            edge = true;
+    CPPUNIT_ASSERT(edge);
+    std::ostringstream dot_edge;
+    dot_edge << "n" << sink.id << " -> n" << mapped.id << ";";
+    CPPUNIT_ASSERT(to_dot(g).find(dot_edge.str()) != std::string::npos);
+    std::string json = to_json(g);
+    CPPUNIT_ASSERT(json.find("\"kind\":\"filter\"") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"rank\":null") != std::string::npos);
+    // With no roots, it's every live node, which includes these.
+    CPPUNIT_ASSERT(graph_walk().run().nodes.size() >= g.nodes.size());
+}
+
+#if !defined(SODIUM_SINGLE_THREADED)
+struct walk_part {
+    static partition* part()
+    {
+        static partition p;
+        return &p;
+    }
+};
+
+void test_sodium::introspect_walk_partition()
+{
+    event_sink<int, walk_part> e;
+    event<int, walk_part> m = e.map<int>([] (const int& x) { return x + 1; });
+    auto kill = m.listen([] (const int&) {});
+    // Another thread holds the default partition in a transaction. The walk only
+    // needs walk_part, where its roots are, so it mustn't wait for that thread.
+    std::mutex mx;
+    std::condition_variable cv;
+    bool held = false, done = false;
+    std::thread t([&] {
+        transaction<> trans;
+        std::unique_lock<std::mutex> lock(mx);
+        held = true;
+        cv.notify_all();
+        cv.wait(lock, [&] { return done; });
+    });
+    {
+        std::unique_lock<std::mutex> lock(mx);
+        cv.wait(lock, [&] { return held; });
+    }
+    graph g = graph_walk().add(m).run();
+    {
+        std::unique_lock<std::mutex> lock(mx);
+        done = true;
+        cv.notify_all();
+    }
+    t.join();
+    kill();
+    CPPUNIT_ASSERT_EQUAL((size_t)3, g.nodes.size());  // the sink, the map and the listener
+}
+#endif
+#endif
+
+#if defined(SODIUM_TRACING)
+static size_t count_of(const std::string& s, const std::string& sub)
+{
+    size_t n = 0;
+    for (size_t i = s.find(sub); i != std::string::npos; i = s.find(sub, i + 1))
+        n++;
+    return n;
+}
+
+void test_sodium::trace_chrome_json()
+{
+    event_sink<int> e;
+    auto kill = e.map<int>([] (const int& x) { return x * 2; })
+                 .listen([] (const int&) {});
+    set_tracing(2, 1024);
+    clear_trace();
+    for (int i = 0; i < 6; i++)
+        e.send(i);
+    set_tracing(0);
+    kill();
+    e.send(6);
+    // Half of the six sends were traced.
+    std::string json = chrome_trace_json();
+    CPPUNIT_ASSERT_EQUAL((size_t)3, count_of(json, "\"name\":\"transaction\""));
+    CPPUNIT_ASSERT(json.find("\"name\":\"run\"") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"kind\":\"map\"") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"ph\":\"X\"") != std::string::npos);
+    // The flight recorder view keeps only the latest.
+    CPPUNIT_ASSERT_EQUAL((size_t)1, count_of(chrome_trace_json(1), "\"name\":\"transaction\""));
+    // The file gets the same JSON.
+    char path[] = "/tmp/sodium_trace_XXXXXX";
+    int fd = mkstemp(path);
+    CPPUNIT_ASSERT(fd >= 0);
+    close(fd);
+    bool written = write_chrome_trace(path);
+    std::ifstream in(path);
+    std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    unlink(path);
+    CPPUNIT_ASSERT(written);
+    CPPUNIT_ASSERT(contents == json);
+    clear_trace();
+    CPPUNIT_ASSERT_EQUAL((size_t)0, count_of(chrome_trace_json(), "\"name\":"));
+}
+#endif
+
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+void test_sodium::memory_accounting()
+{
+    memory_snapshot m0 = snapshot_memory();
+    {
+        event_sink<string> e;
+        behavior<string> b = e.map<string>([] (const string& s) { return s + "!"; })
+                              .hold(string(100, 'x'));
+        memory_snapshot m1 = snapshot_memory();
+        CPPUNIT_ASSERT_EQUAL(m0.operators["map"].count + 1, m1.operators["map"].count);
+        CPPUNIT_ASSERT(m1.operators["map"].bytes > m0.operators["map"].bytes);
+        CPPUNIT_ASSERT(m1.nodes.count > m0.nodes.count);
+        CPPUNIT_ASSERT(m1.closures.count > m0.closures.count);
+        CPPUNIT_ASSERT(m1.payloads.count > m0.payloads.count);
+        CPPUNIT_ASSERT(m1.partition.count >= 1);
+        CPPUNIT_ASSERT(m1.transactions.bytes >= m1.partition.bytes);
+        CPPUNIT_ASSERT_EQUAL(m1.nodes.bytes + m1.payloads.bytes + m1.closures.bytes +
+            m1.cleanups.bytes + m1.transactions.bytes, m1.total().bytes);
+        e.send("hello");
+    }
+    memory_snapshot m2 = snapshot_memory();
+    CPPUNIT_ASSERT_EQUAL(m0.operators["map"].count, m2.operators["map"].count);
+    CPPUNIT_ASSERT_EQUAL(m0.nodes.count, m2.nodes.count);
+    CPPUNIT_ASSERT_EQUAL(m0.closures.count, m2.closures.count);
+    CPPUNIT_ASSERT_EQUAL(m0.cleanups.count, m2.cleanups.count);
+    CPPUNIT_ASSERT_EQUAL(m0.payloads.count, m2.payloads.count);
+}
+
+#if !defined(SODIUM_SINGLE_THREADED)
+void test_sodium::memory_accounting_threads()
+{
+    // Another thread's transactions grow and shrink the nodes' vectors while
+    // snapshots read them.
+    event_sink<int> e;
+    std::atomic<bool> stop(false);
+    std::thread t([e, &stop] () {
+        while (!stop.load()) {
+            auto kill = e.map<int>([] (const int& x) { return x + 1; })
+                         .listen([] (const int&) {});
+            e.send(1);
+            kill();
+        }
+    });
+    memory_snapshot m0 = snapshot_memory();
+    for (int i = 0; i < 200; i++) {
+        memory_snapshot m = snapshot_memory();
+        CPPUNIT_ASSERT(m.operators["sink"].count >= 1);
+    }
+    stop.store(true);
+    t.join();
+    CPPUNIT_ASSERT(m0.nodes.count >= 1);
+}
+#endif
+#endif
+
+#if defined(SODIUM_PROFILING)
+void test_sodium::profile_folded_stacks()
+{
+    event_sink<int> e;
+    std::function<void()> kill;
+    {
+        creation_site outer("pricing");
+        creation_site inner("spread");
+        kill = e.map<int>([] (const int& x) {
+                    volatile unsigned y = (unsigned)x;
+                    for (int i = 0; i < 200000; i++)
+                        y = y * 3 + 1;
+                    return (int)y;
+                })
+                .listen([] (const int&) {});
+    }
+    clear_profile();
+    set_profiling(1);
+    for (int i = 0; i < 5; i++)
+        e.send(i);
+    set_profiling(0);
+    e.send(5);
+    kill();
+    std::vector<profile_entry> report = profile_report();
+    CPPUNIT_ASSERT(!report.empty());
+    CPPUNIT_ASSERT_EQUAL(string("sodium;pricing;spread;map"), report[0].stack);
+    CPPUNIT_ASSERT_EQUAL((unsigned long)5, report[0].samples);
+    CPPUNIT_ASSERT(report[0].seconds > 0);
+    CPPUNIT_ASSERT(folded_stacks().find("sodium;pricing;spread;map ") == 0);
+    clear_profile();
+    CPPUNIT_ASSERT(profile_report().empty());
+}
+#endif
+
+#if defined(SODIUM_LATENCY)
+void test_sodium::latency_histograms()
+{
+    latency_histogram h;
+    for (unsigned long long ns = 1; ns <= 100000; ns++)
+        h.record(ns);
+    CPPUNIT_ASSERT_EQUAL(100000ULL, h.count());
+    CPPUNIT_ASSERT(h.quantile_ns(0.5) >= 50000 && h.quantile_ns(0.5) <= 50000 + 50000 / 64);
+    CPPUNIT_ASSERT(h.quantile_ns(0.99) >= 99000 && h.quantile_ns(0.99) <= 99000 + 99000 / 64);
+    CPPUNIT_ASSERT(h.max_ns() >= 100000 && h.max_ns() <= 100000 + 100000 / 64);
+
+    clear_latency();
+    event_sink<int> e("orders");
+    // The slow listener is queued ahead of "fills", so it holds it up.
+    auto kill1 = e.map<int>([] (const int& x) { return x + 1; })
+                  .listen([] (const int&) {}, "fills");
+    auto kill2 = e.listen([] (const int&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    });
+    for (int i = 0; i < 5; i++)
+        e.send(i);
+    kill1();
+    kill2();
+    e.send(5);
+    latency_histogram& fills = latency("fills");
+    latency_histogram& orders = latency("orders");
+    CPPUNIT_ASSERT_EQUAL(5ULL, fills.count());
+    CPPUNIT_ASSERT_EQUAL(6ULL, orders.count());
+    CPPUNIT_ASSERT(fills.quantile_ns(0) >= 2000000 - 2000000 / 64);
+    CPPUNIT_ASSERT(orders.max_ns() >= fills.quantile_ns(0));
+
+    std::vector<latency_summary> report = latency_report();
+    std::map<string, latency_summary> byName;
+    for (size_t i = 0; i < report.size(); i++)
+        byName[report[i].name] = report[i];
+    CPPUNIT_ASSERT_EQUAL(5ULL, byName["fills"].count);
+    CPPUNIT_ASSERT(byName["fills"].p50_seconds <= byName["fills"].p999_seconds);
+    CPPUNIT_ASSERT(byName["fills"].p999_seconds <= byName["fills"].max_seconds);
+    clear_latency();
+    CPPUNIT_ASSERT_EQUAL(0ULL, fills.count());
+}
+#endif
+
 int main(int argc, char* argv[])
 {
     for (int i = 0; i < 1; i++) {
@@ -76,6 +76,83 @@ class test_sodium : public CppUnit::TestFixture {
     CPPUNIT_TEST(move_semantics_sink);
     CPPUNIT_TEST(move_semantics_hold);
     CPPUNIT_TEST(lift_from_simultaneous);
+    CPPUNIT_TEST(simultaneous_order);
+    CPPUNIT_TEST(loop_rank_raised_in_transaction);
+    CPPUNIT_TEST(light_ptr_lifetime);
+    CPPUNIT_TEST(send_many_separate);
+    CPPUNIT_TEST(send_many_one_transaction);
+    CPPUNIT_TEST(send_many_behavior);
+    CPPUNIT_TEST(sample_committed_value);
+    CPPUNIT_TEST(pipeline_chain);
+    CPPUNIT_TEST(pipeline_filter_optional_gate);
+    CPPUNIT_TEST(unlisten_many);
+    CPPUNIT_TEST(loop_raises_long_chain);
+    CPPUNIT_TEST(relink_lowers_inflated_input);
+    CPPUNIT_TEST(arena_reuse);
+    CPPUNIT_TEST(transaction_recycled);
+    CPPUNIT_TEST(transaction_throws);
+    CPPUNIT_TEST(transaction_large_closure);
+    CPPUNIT_TEST(split_moves_when_unique);
+    CPPUNIT_TEST(split_copies_when_shared);
+    CPPUNIT_TEST(collect_state_handoff);
+    CPPUNIT_TEST(accum_state_handoff);
+    CPPUNIT_TEST(mutable_handlers);
+    CPPUNIT_TEST(std_function_handlers);
+    CPPUNIT_TEST(plain_function_handlers);
+#if defined(SODIUM_ATOMIC_COUNTS)
+    CPPUNIT_TEST(light_ptr_threaded_copy);
+    CPPUNIT_TEST(listen_threaded);
+    CPPUNIT_TEST(listen_teardown_race);
+    CPPUNIT_TEST(count_set_capacity);
+#endif
+#if defined(SODIUM_COMMITTED_READS)
+    CPPUNIT_TEST(sample_committed_during_transaction);
+    CPPUNIT_TEST(sample_committed_consistent);
+#endif
+#if defined(SODIUM_PARALLEL)
+    CPPUNIT_TEST(parallel_same_rank);
+#endif
+#if defined(SODIUM_INGRESS_QUEUE)
+    CPPUNIT_TEST(ingress_queue_per_send);
+    CPPUNIT_TEST(ingress_queue_batch);
+    CPPUNIT_TEST(ingress_queue_send_many);
+    CPPUNIT_TEST(ingress_queue_throws);
+    CPPUNIT_TEST(ingress_queue_hand_over);
+    CPPUNIT_TEST(executor_send);
+    CPPUNIT_TEST(executor_send_many_order);
+    CPPUNIT_TEST(executor_throws);
+    CPPUNIT_TEST(executor_cross);
+    CPPUNIT_TEST(work_stealing);
+    CPPUNIT_TEST(work_stealing_detach);
+    CPPUNIT_TEST(work_stealing_throws);
+#endif
+#if defined(SODIUM_METRICS)
+    CPPUNIT_TEST(metrics_partition);
+#endif
+#if defined(SODIUM_NODE_METRICS)
+    CPPUNIT_TEST(metrics_nodes);
+#endif
+#if defined(SODIUM_INTROSPECTION)
+    CPPUNIT_TEST(introspect_walk);
+#if !defined(SODIUM_SINGLE_THREADED)
+    CPPUNIT_TEST(introspect_walk_partition);
+#endif
+#endif
+#if defined(SODIUM_TRACING)
+    CPPUNIT_TEST(trace_chrome_json);
+#endif
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    CPPUNIT_TEST(memory_accounting);
+#if !defined(SODIUM_SINGLE_THREADED)
+    CPPUNIT_TEST(memory_accounting_threads);
+#endif
+#endif
+#if defined(SODIUM_PROFILING)
+    CPPUNIT_TEST(profile_folded_stacks);
+#endif
+#if defined(SODIUM_LATENCY)
+    CPPUNIT_TEST(latency_histograms);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -147,6 +224,83 @@ public:
     void move_semantics_sink();
     void move_semantics_hold();
     void lift_from_simultaneous();
+    void simultaneous_order();
+    void loop_rank_raised_in_transaction();
+    void light_ptr_lifetime();
+    void send_many_separate();
+    void send_many_one_transaction();
+    void send_many_behavior();
+    void sample_committed_value();
+    void pipeline_chain();
+    void pipeline_filter_optional_gate();
+    void unlisten_many();
+    void loop_raises_long_chain();
+    void relink_lowers_inflated_input();
+    void arena_reuse();
+    void transaction_recycled();
+    void transaction_throws();
+    void transaction_large_closure();
+    void split_moves_when_unique();
+    void split_copies_when_shared();
+    void collect_state_handoff();
+    void accum_state_handoff();
+    void mutable_handlers();
+    void std_function_handlers();
+    void plain_function_handlers();
+#if defined(SODIUM_ATOMIC_COUNTS)
+    void light_ptr_threaded_copy();
+    void listen_threaded();
+    void listen_teardown_race();
+    void count_set_capacity();
+#endif
+#if defined(SODIUM_COMMITTED_READS)
+    void sample_committed_during_transaction();
+    void sample_committed_consistent();
+#endif
+#if defined(SODIUM_PARALLEL)
+    void parallel_same_rank();
+#endif
+#if defined(SODIUM_INGRESS_QUEUE)
+    void ingress_queue_per_send();
+    void ingress_queue_batch();
+    void ingress_queue_send_many();
+    void ingress_queue_throws();
+    void ingress_queue_hand_over();
+    void executor_send();
+    void executor_send_many_order();
+    void executor_throws();
+    void executor_cross();
+    void work_stealing();
+    void work_stealing_detach();
+    void work_stealing_throws();
+#endif
+#if defined(SODIUM_METRICS)
+    void metrics_partition();
+#endif
+#if defined(SODIUM_NODE_METRICS)
+    void metrics_nodes();
+#endif
+#if defined(SODIUM_INTROSPECTION)
+    void introspect_walk();
+#if !defined(SODIUM_SINGLE_THREADED)
+    void introspect_walk_partition();
+#endif
+#endif
+#if defined(SODIUM_TRACING)
+    void trace_chrome_json();
+#endif
+#if defined(SODIUM_MEMORY_ACCOUNTING)
+    void memory_accounting();
+#if !defined(SODIUM_SINGLE_THREADED)
+    void memory_accounting_threads();
+#endif
+#endif
+#if defined(SODIUM_PROFILING)
+    void profile_folded_stacks();
+#endif
+#if defined(SODIUM_LATENCY)
+    void latency_histograms();
+#endif
 };
 
 #endif
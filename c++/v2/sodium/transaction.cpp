@@ -12,22 +12,37 @@ namespace SODIUM_NAMESPACE {
         node_t node_t::null(null_rank);
         target_ref_t node_t::target_t::next_target_ref = 0;
 
-        static bool ensure_bigger_than(const magic_ref<node_t>& node, rank_t limit, std::set<const node_t*>& visited) {
-            if (node->rank > limit || visited.find(node.get_ptr()) != visited.end())
+        // Like next_target_ref, these are only used with transaction_lock held.
+        static uint64_t last_visit_epoch = 0;
+        static std::vector<std::pair<node_t*, rank_t>> walk_stack;
+
+        /*!
+         * Raise the rank of node and everything downstream of it so it's bigger than
+         * limit, visiting each node once, in depth-first order. It uses an explicit
+         * stack and marks visited nodes with the walk's epoch, so long chains neither
+         * recurse deeply nor allocate a visited set.
+         */
+        bool ensure_bigger_than(const magic_ref<node_t>& node, rank_t limit) {
+            if (node->rank > limit)
                 return false;
 
-            visited.insert(node.get_ptr());
-            node.unsafe_get().rank = limit + 1;
-            for (auto it = node->listeners.begin(); it != node->listeners.end(); ++it)
-                ensure_bigger_than(it->node, node->rank, visited);
+            uint64_t epoch = ++last_visit_epoch;
+            walk_stack.push_back(std::make_pair(&node.unsafe_get(), limit));
+            while (!walk_stack.empty()) {
+                node_t* n = walk_stack.back().first;
+                rank_t lim = walk_stack.back().second;
+                walk_stack.pop_back();
+                if (n->rank > lim || n->visit_epoch == epoch)
+                    continue;
+                n->visit_epoch = epoch;
+                n->rank = lim + 1;
+                // In reverse, so they're popped in order.
+                for (auto it = n->listeners.rbegin(); it != n->listeners.rend(); ++it)
+                    walk_stack.push_back(std::make_pair(&it->node.unsafe_get(), n->rank));
+            }
             return true;
         }
 
-        bool ensure_bigger_than(const magic_ref<node_t>& node, rank_t limit) {
-            std::set<const node_t*> visited;
-            return ensure_bigger_than(node, limit, visited);
-        }
-
         /*!
          * Return true if any changes were made. 
          */
@@ -11,6 +11,7 @@
 #include <sodium/impl/magic_ref.h>
 #include <stdint.h>
 #include <memory>
+#include <vector>
 
 namespace SODIUM_NAMESPACE {
     class transaction;
@@ -39,9 +40,13 @@ namespace SODIUM_NAMESPACE {
                 magic_ref<node_t> node;
                 target_ref_t target_ref;
             };
-            node_t(rank_t rank) : rank(rank) {}
-            node_t(rank_t rank, const std::vector<target_t>& listeners) : rank(rank), listeners(listeners) {}
+            node_t(rank_t rank) : rank(rank), visit_epoch(0) {}
+            node_t(rank_t rank, const std::vector<target_t>& listeners) : rank(rank), visit_epoch(0), listeners(listeners) {}
             rank_t rank;
+            /*!
+             * The last ensure_bigger_than() walk that visited this node.
+             */
+            uint64_t visit_epoch;
             std::vector<target_t> listeners;
         };
 